@@ -0,0 +1,192 @@
+/*
+ * alloc.c -- memory allocators for tree nodes and leaves
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+/* largest power of two that divides size, up to a cache line */
+static inline size_t
+align_of(size_t size)
+{
+  size_t align = size & -size;
+  return align < NSD_CACHE_LINE ? align : NSD_CACHE_LINE;
+}
+
+static void *
+malloc_allocate(void *arg, size_t size)
+{
+  size_t align = align_of(size);
+
+  (void)arg;
+  /* size is a multiple of align as required by aligned_alloc */
+  if (align > _Alignof(max_align_t)) {
+    return aligned_alloc(align, size);
+  }
+  return malloc(size);
+}
+
+static void
+malloc_release(void *arg, void *ptr, size_t size)
+{
+  (void)arg;
+  (void)size;
+  free(ptr);
+}
+
+const nsd_allocator_t nsd_malloc_allocator = {
+  NULL, malloc_allocate, malloc_release
+};
+
+void
+nsd_slab_init(nsd_slab_t *slab)
+{
+  assert(slab != NULL);
+  memset(slab, 0, sizeof(*slab));
+}
+
+void
+nsd_slab_deinit(nsd_slab_t *slab)
+{
+  nsd_slab_chunk_t *chunk, *next;
+
+  assert(slab != NULL);
+
+  for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+
+  memset(slab, 0, sizeof(*slab));
+}
+
+static inline size_t
+slab_class(size_t size)
+{
+  assert(size != 0);
+  return (size - 1) / NSD_SLAB_ALIGN;
+}
+
+/* a chunk holds 31 objects of the largest size class */
+static int
+refill(nsd_slab_t *slab, nsd_slab_class_t *class, size_t size)
+{
+  size_t chunk_size = NSD_SLAB_CHUNK_SIZE, align = align_of(size);
+  nsd_slab_chunk_t *chunk;
+
+  if ((chunk = aligned_alloc(NSD_CACHE_LINE, chunk_size)) == NULL) {
+    return -1;
+  }
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->size += chunk_size;
+
+  /* header is padded to preserve alignment */
+  class->next = (char *)chunk + align;
+  class->end = (char *)chunk + align + ((chunk_size - align) / size) * size;
+  return 0;
+}
+
+void *
+nsd_slab_allocate(void *arg, size_t size)
+{
+  void *ptr;
+  nsd_slab_t *slab = arg;
+  nsd_slab_class_t *class;
+
+  assert(slab != NULL);
+
+  if (size > NSD_SLAB_MAX_SIZE) {
+    return malloc_allocate(NULL, size);
+  }
+
+  class = &slab->classes[slab_class(size)];
+  if ((ptr = class->free) != NULL) {
+    class->free = *(void **)ptr;
+    return ptr;
+  }
+
+  size = (slab_class(size) + 1) * NSD_SLAB_ALIGN;
+  if (class->next == class->end && refill(slab, class, size) != 0) {
+    return NULL;
+  }
+
+  ptr = class->next;
+  class->next += size;
+  return ptr;
+}
+
+void
+nsd_slab_release(void *arg, void *ptr, size_t size)
+{
+  nsd_slab_t *slab = arg;
+  nsd_slab_class_t *class;
+
+  assert(slab != NULL);
+
+  if (ptr == NULL) {
+    return;
+  }
+  if (size > NSD_SLAB_MAX_SIZE) {
+    free(ptr);
+    return;
+  }
+
+  class = &slab->classes[slab_class(size)];
+  *(void **)ptr = class->free;
+  class->free = ptr;
+}
+
+void
+nsd_slab_merge(nsd_slab_t *slab, nsd_slab_t *from)
+{
+  nsd_slab_chunk_t *chunk;
+
+  assert(slab != NULL);
+  assert(from != NULL);
+
+  if ((chunk = from->chunks) != NULL) {
+    while (chunk->next != NULL) {
+      chunk = chunk->next;
+    }
+    chunk->next = slab->chunks;
+    slab->chunks = from->chunks;
+    slab->size += from->size;
+  }
+
+  /* objects not yet carved from the current chunk are released as well */
+  for (size_t idx = 0; idx < NSD_SLAB_CLASSES; idx++) {
+    nsd_slab_class_t *class = &from->classes[idx];
+    size_t size = (idx + 1) * NSD_SLAB_ALIGN;
+    void *ptr;
+
+    for (; class->next != class->end; class->next += size) {
+      nsd_slab_release(slab, class->next, size);
+    }
+    while ((ptr = class->free) != NULL) {
+      class->free = *(void **)ptr;
+      nsd_slab_release(slab, ptr, size);
+    }
+  }
+
+  memset(from, 0, sizeof(*from));
+}
+
+void
+nsd_slab_allocator(nsd_slab_t *slab, nsd_allocator_t *allocator)
+{
+  assert(slab != NULL);
+  assert(allocator != NULL);
+
+  allocator->arg = slab;
+  allocator->allocate = nsd_slab_allocate;
+  allocator->release = nsd_slab_release;
+}
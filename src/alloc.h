@@ -0,0 +1,105 @@
+/*
+ * alloc.h -- memory allocators for tree nodes and leaves
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#ifndef NSD_ALLOC_H
+#define NSD_ALLOC_H
+
+#include <stddef.h>
+
+/* Nodes and leaves are released with the size they were allocated with so
+ * that allocators are not required to store a header with each object.
+ * Objects are aligned to the largest power of two that divides their size,
+ * up to NSD_CACHE_LINE octets, callers control alignment by choosing the
+ * size.
+ */
+#define NSD_CACHE_LINE (64)
+
+typedef struct nsd_allocator nsd_allocator_t;
+struct nsd_allocator {
+  void *arg;
+  void *(*allocate)(void *arg, size_t size);
+  void (*release)(void *arg, void *ptr, size_t size);
+};
+
+/** Allocator that uses malloc and free */
+extern const nsd_allocator_t nsd_malloc_allocator;
+
+/* Slab allocator that carves objects from large chunks of memory. Sizes are
+ * rounded up to a multiple of 8 octets and every multiple is a separate size
+ * class, hence every node type has its own size class and leaves are grouped
+ * by key length. Chunks are aligned to a cache line and objects of a class
+ * are carved at a multiple of their alignment. Released objects are kept in
+ * a free list per size class for reuse. Memory is returned to the system once
+ * the slab is deinitialized.
+ *
+ * Slabs are not thread-safe.
+ */
+#define NSD_SLAB_ALIGN (8)
+#define NSD_SLAB_MAX_SIZE (2048) /**< Larger objects are allocated with malloc */
+#define NSD_SLAB_CLASSES (NSD_SLAB_MAX_SIZE / NSD_SLAB_ALIGN)
+#define NSD_SLAB_CHUNK_SIZE (64 * 1024)
+
+typedef struct nsd_slab_chunk nsd_slab_chunk_t;
+struct nsd_slab_chunk {
+  nsd_slab_chunk_t *next;
+};
+
+typedef struct nsd_slab_class nsd_slab_class_t;
+struct nsd_slab_class {
+  void *free; /**< List of released objects */
+  char *next; /**< Next unused object in current chunk */
+  char *end;
+};
+
+typedef struct nsd_slab nsd_slab_t;
+struct nsd_slab {
+  nsd_slab_chunk_t *chunks;
+  size_t size; /**< Total size of chunks in octets */
+  nsd_slab_class_t classes[NSD_SLAB_CLASSES];
+};
+
+void
+nsd_slab_init(nsd_slab_t *slab)
+__attribute__((nonnull));
+
+/**
+ * @brief Release all chunks, objects must no longer be accessed
+ */
+void
+nsd_slab_deinit(nsd_slab_t *slab)
+__attribute__((nonnull));
+
+void *
+nsd_slab_allocate(void *slab, size_t size)
+__attribute__((nonnull));
+
+void
+nsd_slab_release(void *slab, void *ptr, size_t size)
+__attribute__((nonnull(1)));
+
+/**
+ * @brief Move all chunks and unused objects from one slab to another
+ *
+ * Objects allocated from either slab can be released to @slab afterwards.
+ * Used to combine slabs that were filled by different threads.
+ *
+ * @param[in,out]  slab  Slab to move chunks to
+ * @param[in,out]  from  Slab to move chunks from, empty afterwards
+ */
+void
+nsd_slab_merge(nsd_slab_t *slab, nsd_slab_t *from)
+__attribute__((nonnull));
+
+/**
+ * @brief Initialize allocator to allocate from slab
+ */
+void
+nsd_slab_allocator(nsd_slab_t *slab, nsd_allocator_t *allocator)
+__attribute__((nonnull));
+
+#endif /* NSD_ALLOC_H */
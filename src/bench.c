@@ -0,0 +1,1040 @@
+/*
+ * bench.c -- benchmark adaptive radix tree with domain name datasets
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "dname.h"
+#include "simd.h"
+#include "zone.h"
+
+/* Datasets are generated deterministically from a seed so that runs against
+ * different builds operate on exactly the same names. Every dataset derives
+ * a name from an index, names for indexes beyond the number of names in the
+ * dataset serve as misses unless the dataset specifies otherwise.
+ */
+
+typedef struct rng rng_t;
+struct rng {
+  uint64_t state;
+};
+
+static uint64_t mix(uint64_t x)
+{
+  /* splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t rng_next(rng_t *rng)
+{
+  rng->state += 0x9e3779b97f4a7c15ull;
+  return mix(rng->state);
+}
+
+static size_t make_label(rng_t *rng, char *buf, size_t len)
+{
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+  static const char digits[] = "0123456789";
+
+  for (size_t cnt = 0; cnt < len; cnt++) {
+    uint64_t r = rng_next(rng);
+    if (cnt != 0 && cnt != len - 1 && r % 20 == 0) {
+      buf[cnt] = '-';
+    } else if (r % 10 == 1) {
+      buf[cnt] = digits[(r >> 8) % 10];
+    } else {
+      buf[cnt] = letters[(r >> 8) % 26];
+    }
+  }
+
+  return len;
+}
+
+/* delegations in a top-level domain, label lengths skewed towards short */
+static void tld_name(uint64_t seed, size_t idx, char *buf)
+{
+  size_t len;
+  rng_t rng = { mix(seed ^ mix(idx)) };
+  uint64_t r = rng_next(&rng);
+
+  len = (r % 5 == 0) ? 1 + (r >> 8) % 24 : 3 + (r >> 8) % 10;
+  len = make_label(&rng, buf, len);
+  memcpy(buf + len, ".com.", sizeof(".com."));
+}
+
+/* hosts spread over sites and departments of a single organization */
+static void enterprise_name(uint64_t seed, size_t idx, char *buf)
+{
+  static const char *hosts[] = {
+    "ws", "srv", "db", "mail", "printer", "vpn", "dc", "app", "web", "cache",
+    "lb", "k8s-node", "nas", "voip", "cam", "build" };
+  static const char *depts[] = {
+    "it", "hr", "sales", "eng", "ops", "finance", "legal", "research",
+    "support", "marketing" };
+  static const char *sites[] = {
+    "ams", "nyc", "lon", "fra", "sin", "sfo", "tok", "syd" };
+  const size_t nsites = sizeof(sites) / sizeof(sites[0]);
+  const size_t ndepts = sizeof(depts) / sizeof(depts[0]);
+  const size_t nhosts = sizeof(hosts) / sizeof(hosts[0]);
+  size_t site = idx % nsites;
+  size_t dept = (idx / nsites) % ndepts;
+  size_t num = idx / (nsites * ndepts);
+
+  sprintf(buf, "%s-%zu.%s.%s.corp.example.com.",
+    hosts[mix(seed ^ num) % nhosts], num, depts[dept], sites[site]);
+}
+
+/* hosts in consecutive /24 networks */
+static void inaddr_name(uint64_t seed, size_t idx, char *buf)
+{
+  size_t net = idx / 254;
+
+  sprintf(buf, "%zu.%zu.%zu.%zu.in-addr.arpa.",
+    idx % 254 + 1, net % 256, (net / 256) % 256,
+    (size_t)((seed + net / 65536) % 223) + 1);
+}
+
+/* hosts with random interface identifiers in a /48 */
+static void ip6_name(uint64_t seed, size_t idx, char *buf)
+{
+  static const char nibbles[] = "0123456789abcdef";
+  uint64_t prefix = 0x20010db800000000ull | (mix(seed) & 0xffff);
+  uint64_t subnet = (prefix << 16) | (idx % 16);
+  uint64_t iid = mix(seed ^ mix(idx));
+  char *ptr = buf;
+
+  for (int cnt = 0; cnt < 16; cnt++, iid >>= 4) {
+    *ptr++ = nibbles[iid & 0xf];
+    *ptr++ = '.';
+  }
+  for (int cnt = 0; cnt < 16; cnt++, subnet >>= 4) {
+    *ptr++ = nibbles[subnet & 0xf];
+    *ptr++ = '.';
+  }
+  memcpy(ptr, "ip6.arpa.", sizeof("ip6.arpa."));
+}
+
+/* random subdomains of existing delegations */
+static void attack_miss(rng_t *rng, uint64_t seed, size_t count, char *buf)
+{
+  size_t len = make_label(rng, buf, 12);
+  buf[len++] = '.';
+  tld_name(seed, rng_next(rng) % count, buf + len);
+}
+
+typedef struct dataset dataset_t;
+struct dataset {
+  const char *name;
+  const char *description;
+  void (*name_func)(uint64_t seed, size_t idx, char *buf);
+  void (*miss_func)(rng_t *rng, uint64_t seed, size_t count, char *buf);
+  unsigned int hits; /**< Percentage of queries for existing names */
+};
+
+static const dataset_t datasets[] = {
+  { "tld", "flat zone with delegations",
+    tld_name, NULL, 50 },
+  { "enterprise", "hostnames in an enterprise zone",
+    enterprise_name, NULL, 50 },
+  { "in-addr", "in-addr.arpa reverse zone",
+    inaddr_name, NULL, 50 },
+  { "ip6", "ip6.arpa reverse zone",
+    ip6_name, NULL, 50 },
+  { "attack", "random subdomain attack on a flat zone",
+    tld_name, attack_miss, 5 }
+};
+
+/* keys are stored consecutively, each key is preceded by its length */
+typedef struct keyset keyset_t;
+struct keyset {
+  size_t count;
+  size_t *offsets;
+  size_t size;
+  uint8_t *octets;
+  size_t offsets_size;
+  size_t octets_size;
+};
+
+static void add_key(keyset_t *set, const nsd_key_t key, uint8_t key_len)
+{
+  if (set->count == set->offsets_size) {
+    set->offsets_size = set->offsets_size ? set->offsets_size * 2 : 1024;
+    set->offsets = realloc(set->offsets, set->offsets_size * sizeof(size_t));
+  }
+  if (set->size + 1 + key_len > set->octets_size) {
+    set->octets_size = set->octets_size ? set->octets_size * 2 : 65536;
+    set->octets = realloc(set->octets, set->octets_size);
+  }
+  if (set->offsets == NULL || set->octets == NULL) {
+    fprintf(stderr, "Cannot allocate memory for keys\n");
+    exit(1);
+  }
+
+  set->offsets[set->count++] = set->size;
+  set->octets[set->size] = key_len;
+  memcpy(set->octets + set->size + 1, key, key_len);
+  set->size += 1 + key_len;
+}
+
+static inline const uint8_t *get_key(const keyset_t *set, size_t idx, uint8_t *key_len)
+{
+  const uint8_t *ptr = set->octets + set->offsets[idx];
+  *key_len = ptr[0];
+  return ptr + 1;
+}
+
+/* names in presentation format are stored consecutively, null-terminated */
+typedef struct textset textset_t;
+struct textset {
+  size_t count;
+  size_t *offsets;
+  size_t size;
+  char *chars;
+  size_t offsets_size;
+  size_t chars_size;
+};
+
+static void add_text(textset_t *set, const char *str)
+{
+  size_t len = strlen(str);
+
+  if (set->count == set->offsets_size) {
+    set->offsets_size = set->offsets_size ? set->offsets_size * 2 : 1024;
+    set->offsets = realloc(set->offsets, set->offsets_size * sizeof(size_t));
+  }
+  if (set->size + len + 1 > set->chars_size) {
+    set->chars_size = set->chars_size ? set->chars_size * 2 : 65536;
+    set->chars = realloc(set->chars, set->chars_size);
+  }
+  if (set->offsets == NULL || set->chars == NULL) {
+    fprintf(stderr, "Cannot allocate memory for names\n");
+    exit(1);
+  }
+
+  set->offsets[set->count++] = set->size;
+  memcpy(set->chars + set->size, str, len + 1);
+  set->size += len + 1;
+}
+
+static inline const char *get_text(const textset_t *set, size_t idx, size_t *len)
+{
+  size_t next = idx + 1 < set->count ? set->offsets[idx + 1] : set->size;
+  *len = next - set->offsets[idx] - 1;
+  return set->chars + set->offsets[idx];
+}
+
+static const uint8_t *sort_octets;
+
+static int compare_keys(const void *a, const void *b)
+{
+  const uint8_t *key1 = sort_octets + *(const size_t *)a;
+  const uint8_t *key2 = sort_octets + *(const size_t *)b;
+  int ret = memcmp(key1 + 1, key2 + 1, key1[0] < key2[0] ? key1[0] : key2[0]);
+  return ret ? ret : (int)key1[0] - (int)key2[0];
+}
+
+/* canonical order */
+static void sort_keys(keyset_t *set)
+{
+  sort_octets = set->octets;
+  qsort(set->offsets, set->count, sizeof(*set->offsets), compare_keys);
+}
+
+/* names in wire and presentation format are stored in wires and texts
+   (optional) */
+static int add_name(
+  keyset_t *set, keyset_t *wires, textset_t *texts, const char *str)
+{
+  uint8_t name[NSD_MAX_HEIGHT + 1];
+  nsd_key_t key;
+  uint8_t key_len;
+  int name_len;
+
+  if ((name_len = dname_parse(name, str, strlen(str))) < 0) {
+    return -1;
+  }
+  if ((key_len = nsd_make_key(key, name)) == 0) {
+    return -1;
+  }
+
+  add_key(set, key, key_len);
+  if (wires != NULL) {
+    add_key(wires, name, (uint8_t)name_len);
+  }
+  if (texts != NULL) {
+    add_text(texts, str);
+  }
+  return 0;
+}
+
+static void load_names(
+  keyset_t *set, keyset_t *wires, textset_t *texts, const char *file)
+{
+  FILE *fh;
+  char line[4096], name[4096];
+  size_t lineno = 0;
+
+  if ((fh = fopen(file, "r")) == NULL) {
+    fprintf(stderr, "Cannot open %s\n", file);
+    exit(1);
+  }
+
+  /* first field on every line, empty lines and comments are skipped */
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    lineno++;
+    if (sscanf(line, "%4095s", name) != 1 || name[0] == ';' || name[0] == '#') {
+      continue;
+    }
+    if (add_name(set, wires, texts, name) != 0) {
+      fprintf(stderr, "%s:%zu: skipped invalid name %s\n", file, lineno, name);
+    }
+  }
+
+  fclose(fh);
+}
+
+static void generate_names(
+  keyset_t *set,
+  keyset_t *wires,
+  textset_t *texts,
+  const dataset_t *dataset,
+  uint64_t seed,
+  size_t count)
+{
+  char buf[1024];
+
+  for (size_t idx = 0; idx < count; idx++) {
+    dataset->name_func(seed, idx, buf);
+    if (add_name(set, wires, texts, buf) != 0) {
+      fprintf(stderr, "Cannot generate name %s\n", buf);
+      exit(1);
+    }
+  }
+}
+
+/* misses for names loaded from file are random subdomains of loaded names */
+static void generate_queries(
+  keyset_t *queries,
+  const keyset_t *names,
+  const dataset_t *dataset,
+  uint64_t seed,
+  size_t count,
+  unsigned int hits)
+{
+  char buf[1024];
+  rng_t rng = { mix(seed ^ 0x71756572ull) };
+
+  for (size_t idx = 0; idx < count; idx++) {
+    uint64_t r = rng_next(&rng);
+    if (names->count != 0 && r % 100 < hits) {
+      const uint8_t *key;
+      uint8_t key_len;
+      key = get_key(names, (r >> 8) % names->count, &key_len);
+      add_key(queries, key, key_len);
+    } else if (dataset == NULL) {
+      uint8_t label[10], key_len, label_len;
+      nsd_key_t key, label_key;
+      const uint8_t *parent = get_key(names, (r >> 8) % names->count, &key_len);
+      /* key of subdomain is key of parent followed by key of label */
+      label[0] = (uint8_t)make_label(&rng, (char *)label + 1, 8);
+      label[9] = 0;
+      label_len = nsd_make_key(label_key, label);
+      if (key_len - 1 + label_len > NSD_MAX_HEIGHT) {
+        add_key(queries, parent, key_len);
+      } else {
+        memcpy(key, parent, key_len - 1);
+        memcpy(key + key_len - 1, label_key, label_len);
+        add_key(queries, key, key_len - 1 + label_len);
+      }
+    } else if (dataset->miss_func != NULL) {
+      dataset->miss_func(&rng, seed, names->count, buf);
+      (void)add_name(queries, NULL, NULL, buf);
+    } else {
+      dataset->name_func(seed, names->count + (r >> 8) % (names->count + 1), buf);
+      (void)add_name(queries, NULL, NULL, buf);
+    }
+  }
+}
+
+/* allocator that keeps track of memory in use by the tree */
+typedef struct counter counter_t;
+struct counter {
+  nsd_allocator_t allocator;
+  size_t bytes;
+  size_t peak;
+};
+
+static void *count_allocate(void *arg, size_t size)
+{
+  counter_t *counter = arg;
+  void *ptr;
+
+  if ((ptr = counter->allocator.allocate(counter->allocator.arg, size)) != NULL) {
+    counter->bytes += size;
+    if (counter->bytes > counter->peak) {
+      counter->peak = counter->bytes;
+    }
+  }
+
+  return ptr;
+}
+
+static void count_release(void *arg, void *ptr, size_t size)
+{
+  counter_t *counter = arg;
+
+  if (ptr != NULL) {
+    counter->bytes -= size;
+  }
+  counter->allocator.release(counter->allocator.arg, ptr, size);
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_latency(const char *what, uint64_t *samples, size_t count)
+{
+  static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+
+  printf("%-6s latency (ns):", what);
+  if (count == 0) {
+    printf(" n/a\n");
+    return;
+  }
+
+  qsort(samples, count, sizeof(*samples), compare_u64);
+  for (size_t cnt = 0; cnt < sizeof(pcts) / sizeof(pcts[0]); cnt++) {
+    size_t idx = (size_t)((pcts[cnt] / 100.0) * (double)(count - 1));
+    printf(" p%g %" PRIu64, pcts[cnt], samples[idx]);
+  }
+  printf(" max %" PRIu64 "\n", samples[count - 1]);
+}
+
+/* leaves are marked so that owner names are counted once */
+static nsd_retcode_t count_record(void *arg, const nsd_record_t *record)
+{
+  if (record->owner->data == NULL) {
+    record->owner->data = arg;
+    (*(size_t *)arg)++;
+  }
+  return nsd_ok;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [OPTIONS]\n"
+    "\n"
+    "Options:\n"
+    "  -d DATASET  Generate names for DATASET (default: tld)\n"
+    "  -f FILE     Load names from FILE, one name per line\n"
+    "  -q FILE     Load queries from FILE, one name per line\n"
+    "  -n COUNT    Number of names to generate (default: 1000000)\n"
+    "  -l COUNT    Number of lookups (default: 1000000)\n"
+    "  -H PERCENT  Percentage of lookups for existing names\n"
+    "  -s SEED     Seed for generated names and queries (default: 1)\n"
+    "  -m          Allocate memory with malloc instead of slab\n"
+    "  -b          Sort names and build tree with bulk load\n"
+    "  -t THREADS  Build tree with THREADS threads, 0 for one per processor\n"
+    "  -x          Do not use AVX2 in the tree even if supported\n"
+    "  -c          Use a concurrent tree (optimistic lock coupling)\n"
+    "  -u          Store only key suffixes in leaves\n"
+    "  -S FILE     Save snapshot to FILE and look up queries in it\n"
+    "  -F          Freeze tree and look up queries in frozen copy\n"
+    "  -z FILE     Load names from zone FILE\n"
+    "  -o ORIGIN   Origin for relative names in zone FILE\n"
+    "\n"
+    "Datasets:\n",
+    prog);
+  for (size_t cnt = 0; cnt < sizeof(datasets) / sizeof(datasets[0]); cnt++) {
+    fprintf(stderr, "  %-10s  %s\n", datasets[cnt].name, datasets[cnt].description);
+  }
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  const char *names_file = NULL, *queries_file = NULL, *snapshot_file = NULL;
+  const char *zone_file = NULL, *zone_origin = NULL;
+  const dataset_t *dataset = &datasets[0];
+  size_t count = 1000000, lookups = 1000000;
+  int hits = -1;
+  uint64_t seed = 1;
+  int use_malloc = 0, use_bulk = 0, use_frozen = 0, threads = -1;
+  keyset_t names = { 0 }, queries = { 0 }, wires = { 0 };
+  textset_t texts = { 0 };
+  nsd_slab_t slab;
+  counter_t counter = { { NULL, NULL, NULL }, 0, 0 };
+  nsd_allocator_t allocator = { &counter, count_allocate, count_release };
+  nsd_options_t options = { NULL, &allocator, 0, false, 0, false };
+  nsd_rcu_t rcu;
+  nsd_rcu_reader_t reader;
+  nsd_tree_t tree;
+  nsd_path_t path;
+  uint64_t start, stop, *hit_ns, *miss_ns;
+  size_t created = 0, found = 0, nhits = 0, nmisses = 0, partial = 0;
+  static nsd_stats_t stats;
+  struct rusage usage_after;
+  static const char *type_names[] = {
+    "node4", "node16", "node17", "node32", "node38", "node48", "node256" };
+  static const size_t capacities[] = { 4, 16, 17, 32, 38, 48, NSD_MAX_WIDTH };
+
+  while ((opt = getopt(argc, argv, "d:f:q:n:l:H:s:mbt:xcuS:Fz:o:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        dataset = NULL;
+        for (size_t cnt = 0; cnt < sizeof(datasets) / sizeof(datasets[0]); cnt++) {
+          if (strcmp(optarg, datasets[cnt].name) == 0) {
+            dataset = &datasets[cnt];
+          }
+        }
+        if (dataset == NULL) {
+          fprintf(stderr, "Unknown dataset %s\n", optarg);
+          usage(argv[0]);
+        }
+        break;
+      case 'f':
+        names_file = optarg;
+        break;
+      case 'q':
+        queries_file = optarg;
+        break;
+      case 'n':
+        count = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        lookups = strtoull(optarg, NULL, 10);
+        break;
+      case 'H':
+        hits = atoi(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'm':
+        use_malloc = 1;
+        break;
+      case 'b':
+        use_bulk = 1;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'x':
+        options.disable_simd |= NSD_SIMD_AVX2;
+        break;
+      case 'c':
+        options.concurrent = true;
+        break;
+      case 'u':
+        options.suffix_leaves = true;
+        break;
+      case 'S':
+        snapshot_file = optarg;
+        break;
+      case 'F':
+        use_frozen = 1;
+        break;
+      case 'z':
+        zone_file = optarg;
+        break;
+      case 'o':
+        zone_origin = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (zone_file != NULL) {
+    /* names are read from the zone while the tree is built */
+    dataset = NULL;
+  } else if (names_file != NULL) {
+    load_names(&names, &wires, &texts, names_file);
+    printf("names: %zu from %s\n", names.count, names_file);
+    dataset = NULL;
+  } else {
+    generate_names(&names, &wires, &texts, dataset, seed, count);
+    printf("names: %zu from dataset %s (seed %" PRIu64 ")\n",
+      names.count, dataset->name, seed);
+  }
+
+  if (queries_file != NULL) {
+    load_names(&queries, NULL, NULL, queries_file);
+  } else if (names.count != 0) {
+    if (hits < 0) {
+      hits = dataset != NULL ? (int)dataset->hits : 50;
+    }
+    generate_queries(&queries, &names, dataset, seed, lookups, (unsigned int)hits);
+  }
+
+  if (use_malloc) {
+    counter.allocator = nsd_malloc_allocator;
+  } else {
+    nsd_slab_init(&slab);
+    nsd_slab_allocator(&slab, &counter.allocator);
+  }
+
+  /* writers of concurrent trees are readers too */
+  if (options.concurrent) {
+    if (nsd_rcu_init(&rcu) != 0) {
+      fprintf(stderr, "Cannot initialize reclamation domain\n");
+      exit(1);
+    }
+    nsd_rcu_register(&rcu, &reader);
+    nsd_rcu_online(&rcu, &reader);
+    options.rcu = &rcu;
+  }
+
+  if (nsd_init_tree(&tree, &options) != nsd_ok) {
+    fprintf(stderr, "Cannot initialize tree\n");
+    exit(1);
+  }
+  printf("simd:%s%s\n",
+    tree.simd & NSD_SIMD_SSE2 ? " sse2" : "",
+    tree.simd & NSD_SIMD_AVX2 ? " avx2" : "");
+
+  /* presentation format to wire format */
+  if (texts.count != 0) {
+    uint8_t name[DNAME_MAX_LENGTH];
+    size_t octets = 0;
+    uint64_t scalar_ns;
+    start = now();
+    for (size_t idx = 0; idx < texts.count; idx++) {
+      size_t len;
+      const char *str = get_text(&texts, idx, &len);
+      octets += (size_t)dname_parse_scalar(name, str, len);
+    }
+    stop = now();
+    scalar_ns = stop - start;
+    start = now();
+    for (size_t idx = 0; idx < texts.count; idx++) {
+      size_t len;
+      const char *str = get_text(&texts, idx, &len);
+      octets -= (size_t)dname_parse(name, str, len);
+    }
+    stop = now();
+    assert(octets == 0);
+    printf("parse: %zu characters, %.1f ns/name, scalar %.1f ns/name\n",
+      texts.size - texts.count, (double)(stop - start) / (double)texts.count,
+      (double)scalar_ns / (double)texts.count);
+  }
+
+  /* key construction */
+  if (wires.count != 0) {
+    nsd_key_t key;
+    size_t octets = 0;
+    start = now();
+    for (size_t idx = 0; idx < wires.count; idx++) {
+      uint8_t name_len;
+      octets += nsd_make_tree_key(&tree, key, get_key(&wires, idx, &name_len));
+    }
+    stop = now();
+    printf("keys: %zu octets, %.1f ns/key\n",
+      octets, (double)(stop - start) / (double)wires.count);
+  }
+
+  /* insert */
+  if (zone_file != NULL) {
+    nsd_zone_options_t zone_options = { zone_origin, count_record, &created };
+    nsd_zone_stats_t stats;
+    start = now();
+    if (nsd_load_zone(&tree, zone_file, &zone_options, &stats) != nsd_ok) {
+      fprintf(stderr, "%s:%zu: %s\n", zone_file, stats.line, stats.error);
+      exit(1);
+    }
+    stop = now();
+    printf("zone: %zu records, %zu names from %s in %.3f s, %.0f records/s, %.1f MB/s\n",
+      stats.records, created, zone_file, (double)(stop - start) / 1e9,
+      (double)stats.records / ((double)(stop - start) / 1e9),
+      (double)stats.octets / ((double)(stop - start) / 1e3));
+  } else if (use_bulk) {
+    nsd_bulk_t *bulk;
+    sort_keys(&names);
+    start = now();
+    if (nsd_bulk_begin(&tree, &bulk) != nsd_ok) {
+      fprintf(stderr, "Cannot start bulk load\n");
+      exit(1);
+    }
+    for (size_t idx = 0; idx < names.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&names, idx, &key_len);
+      nsd_leaf_t *leaf;
+      if (nsd_bulk_add(bulk, key, key_len, &leaf) != nsd_ok) {
+        fprintf(stderr, "Cannot insert name\n");
+        exit(1);
+      }
+      if (leaf->data == NULL) {
+        leaf->data = (void *)&names;
+        created++;
+      }
+    }
+    if (nsd_bulk_end(bulk) != nsd_ok) {
+      fprintf(stderr, "Cannot finish bulk load\n");
+      exit(1);
+    }
+  } else if (threads >= 0) {
+    nsd_lookup_t *lookups;
+    if (!(lookups = calloc(names.count ? names.count : 1, sizeof(*lookups)))) {
+      fprintf(stderr, "Cannot allocate lookups\n");
+      exit(1);
+    }
+    for (size_t idx = 0; idx < names.count; idx++) {
+      lookups[idx].key = get_key(&names, idx, &lookups[idx].key_len);
+    }
+    start = now();
+    if (nsd_build_parallel(&tree, lookups, names.count, (unsigned int)threads) != nsd_ok) {
+      fprintf(stderr, "Cannot insert names\n");
+      exit(1);
+    }
+    for (size_t idx = 0; idx < names.count; idx++) {
+      if (lookups[idx].leaf->data == NULL) {
+        lookups[idx].leaf->data = (void *)&names;
+        created++;
+      }
+    }
+    free(lookups);
+  } else {
+    start = now();
+    for (size_t idx = 0; idx < names.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&names, idx, &key_len);
+      path.height = 0;
+      if (nsd_make_path(&tree, &path, key, key_len) != nsd_ok) {
+        fprintf(stderr, "Cannot insert name\n");
+        exit(1);
+      }
+      nsd_leaf_t *leaf = nsd_leaf_raw(*path.levels[path.height - 1].noderef);
+      if (leaf->data == NULL) {
+        leaf->data = (void *)&names;
+        created++;
+      }
+    }
+  }
+  if (zone_file == NULL) {
+    stop = now();
+    printf("insert: %zu unique names in %.3f s, %.0f names/s\n",
+      created, (double)(stop - start) / 1e9,
+      (double)names.count / ((double)(stop - start) / 1e9));
+  }
+
+  /* throughput */
+  start = now();
+  for (size_t idx = 0; idx < queries.count; idx++) {
+    uint8_t key_len;
+    const uint8_t *key = get_key(&queries, idx, &key_len);
+    path.height = 0;
+    found += nsd_find_path(&tree, &path, key, key_len) == nsd_ok;
+  }
+  stop = now();
+  if (queries.count != 0) {
+    printf("lookup: %zu queries, %zu hits in %.3f s, %.0f queries/s, %.1f ns/query\n",
+      queries.count, found, (double)(stop - start) / 1e9,
+      (double)queries.count / ((double)(stop - start) / 1e9),
+      (double)(stop - start) / (double)queries.count);
+  }
+
+  /* lookup without path */
+  if (queries.count != 0) {
+    size_t leaf_found = 0;
+    start = now();
+    for (size_t idx = 0; idx < queries.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&queries, idx, &key_len);
+      leaf_found += nsd_find(&tree, key, key_len, NULL) == nsd_ok;
+    }
+    stop = now();
+    if (leaf_found != found) {
+      fprintf(stderr, "Lookup without path found %zu keys, expected %zu\n",
+        leaf_found, found);
+      exit(1);
+    }
+    printf("find: %zu queries, %.1f ns/query without path\n",
+      queries.count, (double)(stop - start) / (double)queries.count);
+  }
+
+  /* names in canonical order, resumed from the path of the previous name */
+  if (zone_file == NULL && names.count != 0) {
+    size_t root_found = 0, from_found = 0;
+    uint64_t root_ns;
+    sort_keys(&names);
+    start = now();
+    for (size_t idx = 0; idx < names.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&names, idx, &key_len);
+      path.height = 0;
+      root_found += nsd_find_path(&tree, &path, key, key_len) == nsd_ok;
+    }
+    stop = now();
+    root_ns = stop - start;
+    path.height = 0;
+    start = now();
+    for (size_t idx = 0; idx < names.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&names, idx, &key_len);
+      from_found += nsd_find_path_from(&tree, &path, key, key_len) == nsd_ok;
+    }
+    stop = now();
+    if (from_found != root_found || root_found != names.count) {
+      fprintf(stderr, "Sorted lookup found %zu names, expected %zu\n",
+        from_found, names.count);
+      exit(1);
+    }
+    printf("sorted: %zu names, %.1f ns/name from previous path, %.1f ns/name from root\n",
+      names.count, (double)(stop - start) / (double)names.count,
+      (double)root_ns / (double)names.count);
+  }
+
+  /* lookup from wire format, names are stored by themselves so offset is 0 */
+  if (wires.count != 0) {
+    nsd_key_t key;
+    size_t wire_found = 0, key_found = 0;
+    uint64_t key_ns;
+    start = now();
+    for (size_t idx = 0; idx < wires.count; idx++) {
+      uint8_t name_len;
+      const uint8_t *name = get_key(&wires, idx, &name_len);
+      path.height = 0;
+      key_found += nsd_find_path(
+        &tree, &path, key, nsd_make_tree_key(&tree, key, name)) == nsd_ok;
+    }
+    stop = now();
+    key_ns = stop - start;
+    start = now();
+    for (size_t idx = 0; idx < wires.count; idx++) {
+      uint8_t name_len;
+      const uint8_t *name = get_key(&wires, idx, &name_len);
+      wire_found += nsd_find_wire(&tree, &path, name, name_len, 0) == nsd_ok;
+    }
+    stop = now();
+    if (wire_found != key_found) {
+      fprintf(stderr, "Wire lookup found %zu names, expected %zu\n",
+        wire_found, key_found);
+      exit(1);
+    }
+    printf("wire: %zu names, %.1f ns/name, make_key + find_path %.1f ns/name\n",
+      wires.count, (double)(stop - start) / (double)wires.count,
+      (double)key_ns / (double)wires.count);
+  }
+
+  /* latency, includes overhead of reading the clock */
+  hit_ns = malloc((queries.count + 1) * sizeof(*hit_ns));
+  miss_ns = malloc((queries.count + 1) * sizeof(*miss_ns));
+  if (hit_ns == NULL || miss_ns == NULL) {
+    fprintf(stderr, "Cannot allocate memory for samples\n");
+    exit(1);
+  }
+  for (size_t idx = 0; idx < queries.count; idx++) {
+    uint8_t key_len;
+    const uint8_t *key = get_key(&queries, idx, &key_len);
+    nsd_retcode_t ret;
+    path.height = 0;
+    start = now();
+    ret = nsd_find_path(&tree, &path, key, key_len);
+    stop = now();
+    if (ret == nsd_ok) {
+      hit_ns[nhits++] = stop - start;
+    } else {
+      miss_ns[nmisses++] = stop - start;
+    }
+  }
+  print_latency("hit", hit_ns, nhits);
+  print_latency("miss", miss_ns, nmisses);
+
+  /* batch size sweep */
+  if (queries.count != 0) {
+    static const size_t sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    nsd_lookup_t *batch = malloc(queries.count * sizeof(*batch));
+    if (batch == NULL) {
+      fprintf(stderr, "Cannot allocate memory for lookups\n");
+      exit(1);
+    }
+    for (size_t idx = 0; idx < queries.count; idx++) {
+      batch[idx].key = get_key(&queries, idx, &batch[idx].key_len);
+    }
+    printf("batch:");
+    for (size_t cnt = 0; cnt < sizeof(sizes) / sizeof(sizes[0]); cnt++) {
+      size_t batch_found = 0;
+      start = now();
+      for (size_t idx = 0; idx < queries.count; idx += sizes[cnt]) {
+        size_t left = queries.count - idx;
+        batch_found += nsd_find_batch(
+          &tree, &batch[idx], left < sizes[cnt] ? left : sizes[cnt]);
+      }
+      stop = now();
+      if (batch_found != found) {
+        fprintf(stderr, "Batch lookup found %zu keys, expected %zu\n",
+          batch_found, found);
+        exit(1);
+      }
+      printf(" %zu %.1f ns/query%s", sizes[cnt],
+        (double)(stop - start) / (double)queries.count,
+        cnt + 1 < sizeof(sizes) / sizeof(sizes[0]) ? "," : "\n");
+    }
+    free(batch);
+  }
+
+  /* snapshot, opened right after it is written so pages are likely cached */
+  if (snapshot_file != NULL) {
+    nsd_snapshot_t snapshot;
+    size_t snapshot_found = 0;
+    uint64_t save_ns, open_ns;
+    start = now();
+    if (nsd_save_snapshot(&tree, snapshot_file, NULL, NULL) != nsd_ok) {
+      fprintf(stderr, "Cannot save snapshot to %s\n", snapshot_file);
+      exit(1);
+    }
+    stop = now();
+    save_ns = stop - start;
+    start = now();
+    if (nsd_open_snapshot(&snapshot, snapshot_file) != nsd_ok) {
+      fprintf(stderr, "Cannot open snapshot %s\n", snapshot_file);
+      exit(1);
+    }
+    snapshot.simd &= tree.simd;
+    stop = now();
+    open_ns = stop - start;
+    start = now();
+    for (size_t idx = 0; idx < queries.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&queries, idx, &key_len);
+      snapshot_found += nsd_find_snapshot(&snapshot, key, key_len, NULL) == nsd_ok;
+    }
+    stop = now();
+    if (snapshot_found != found) {
+      fprintf(stderr, "Snapshot lookup found %zu keys, expected %zu\n",
+        snapshot_found, found);
+      exit(1);
+    }
+    printf("snapshot: %zu bytes, save %.3f s, open %.3f ms, %.1f ns/query\n",
+      snapshot.size, (double)save_ns / 1e9, (double)open_ns / 1e6,
+      queries.count ? (double)(stop - start) / (double)queries.count : 0.0);
+    nsd_close_snapshot(&snapshot);
+  }
+
+  /* frozen copy */
+  if (use_frozen) {
+    nsd_frozen_t frozen;
+    size_t frozen_found = 0;
+    uint64_t freeze_ns;
+    start = now();
+    if (nsd_freeze(&tree, &frozen) != nsd_ok) {
+      fprintf(stderr, "Cannot freeze tree\n");
+      exit(1);
+    }
+    stop = now();
+    freeze_ns = stop - start;
+    start = now();
+    for (size_t idx = 0; idx < queries.count; idx++) {
+      uint8_t key_len;
+      const uint8_t *key = get_key(&queries, idx, &key_len);
+      frozen_found += nsd_find_frozen(&frozen, key, key_len, NULL) == nsd_ok;
+    }
+    stop = now();
+    if (frozen_found != found) {
+      fprintf(stderr, "Frozen lookup found %zu keys, expected %zu\n",
+        frozen_found, found);
+      exit(1);
+    }
+    printf("frozen: %zu bytes, freeze %.3f s, %.1f ns/query\n",
+      frozen.size, (double)freeze_ns / 1e9,
+      queries.count ? (double)(stop - start) / (double)queries.count : 0.0);
+    nsd_free_frozen(&frozen);
+  }
+
+  /* memory */
+  getrusage(RUSAGE_SELF, &usage_after);
+  printf("memory: %zu bytes in tree, %.1f bytes/name",
+    counter.bytes, created ? (double)counter.bytes / (double)created : 0.0);
+  if (!use_malloc) {
+    printf(", %zu bytes in slab", slab.size);
+  }
+  printf(", max rss %ld KiB\n", usage_after.ru_maxrss);
+
+  nsd_stat_tree(&tree, &stats);
+  printf("nodes:");
+  for (int type = nsd_node4; type <= nsd_node256; type++) {
+    printf(" %s %zu", type_names[type], stats.nodes[type].count);
+  }
+  printf(", leaves %zu, max height %zu\n", stats.leaves, stats.max_height);
+  printf("shape: %zu bytes, %.1f bytes/name, %zu bytes in leaves, %zu key bytes\n",
+    stats.bytes, stats.leaves ? (double)stats.bytes / (double)stats.leaves : 0.0,
+    stats.leaf_bytes, stats.key_bytes);
+  printf("fill:");
+  for (int type = nsd_node4; type <= nsd_node256; type++) {
+    const nsd_node_stats_t *node_stats = &stats.nodes[type];
+    if (node_stats->count == 0) {
+      continue;
+    }
+    printf(" %s %zu bytes %.1f/%zu", type_names[type], node_stats->bytes,
+      (double)node_stats->children / (double)node_stats->count, capacities[type]);
+  }
+  printf("\nprefix:");
+  for (int len = 0; len <= NSD_MAX_PREFIX; len++) {
+    printf(" %d:%zu", len, stats.prefixes[len]);
+  }
+  /* octets beyond NSD_MAX_PREFIX are not stored in the node */
+  for (int len = NSD_MAX_PREFIX + 1; len < NSD_MAX_HEIGHT; len++) {
+    partial += stats.prefixes[len];
+  }
+  printf(" >%d:%zu", NSD_MAX_PREFIX, partial);
+  printf("\nheight:");
+  for (size_t height = 1; height <= stats.max_height; height++) {
+    if (stats.heights[height] != 0) {
+      printf(" %zu:%zu", height, stats.heights[height]);
+    }
+  }
+  printf("\n");
+
+  if (options.concurrent) {
+    nsd_rcu_unregister(&rcu, &reader);
+  }
+  nsd_deinit_tree(&tree);
+  if (options.concurrent) {
+    nsd_rcu_deinit(&rcu);
+  }
+  if (!use_malloc) {
+    nsd_slab_deinit(&slab);
+  }
+  free(hit_ns);
+  free(miss_ns);
+  free(names.offsets);
+  free(names.octets);
+  free(queries.offsets);
+  free(queries.octets);
+  free(wires.offsets);
+  free(wires.octets);
+  free(texts.offsets);
+  free(texts.chars);
+
+  return 0;
+}
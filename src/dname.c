@@ -1,111 +1,196 @@
-#include <assert.h>
-#include <ctype.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
 
 #include "dname.h"
+#include "simd.h"
 
-static int
-hexdigit_to_int(char chr)
+#define isdigit_u8(chr) ((uint8_t)((chr) - '0') < 10)
+
+/* Name is written as it is parsed, label points to the length octet of the
+ * current label, octet to where the next octet goes. Data octets must be
+ * written before DNAME_MAX_LENGTH - 1 to leave room for the root label.
+ */
+
+static inline int
+parse_octet(
+  uint8_t *dname,
+  uint8_t **label,
+  uint8_t **octet,
+  const uint8_t *str,
+  const uint8_t *end)
 {
-  switch (chr) {
-    case '0': return 0;
-    case '1': return 1;
-    case '2': return 2;
-    case '3': return 3;
-    case '4': return 4;
-    case '5': return 5;
-    case '6': return 6;
-    case '7': return 7;
-    case '8': return 8;
-    case '9': return 9;
-    case 'a': case 'A': return 10;
-    case 'b': case 'B': return 11;
-    case 'c': case 'C': return 12;
-    case 'd': case 'D': return 13;
-    case 'e': case 'E': return 14;
-    case 'f': case 'F': return 15;
+  size_t label_len;
+
+  switch (*str) {
+    case '.':
+      label_len = (size_t)(*octet - *label) - 1;
+      if (label_len == 0) {
+        return DNAME_EMPTY_LABEL;
+      } else if (label_len > DNAME_MAX_LABEL_LENGTH) {
+        return DNAME_LABEL_TOO_LONG;
+      }
+      **label = (uint8_t)label_len;
+      *label = (*octet)++;
+      return 1;
+    case '\\':
+      if (*octet - dname >= DNAME_MAX_LENGTH - 1) {
+        return DNAME_NAME_TOO_LONG;
+      }
+      /* Handle escaped characters (RFC1035 5.1) */
+      if (end - str > 3 &&
+          isdigit_u8(str[1]) && isdigit_u8(str[2]) && isdigit_u8(str[3]))
+      {
+        int val = (str[1] - '0') * 100 + (str[2] - '0') * 10 + (str[3] - '0');
+        if (val > 255) {
+          return DNAME_BAD_ESCAPE;
+        }
+        *(*octet)++ = (uint8_t)val;
+        return 4;
+      } else if (end - str > 1) {
+        *(*octet)++ = str[1];
+        return 2;
+      }
+      return DNAME_BAD_ESCAPE;
     default:
-      break;
+      if (*octet - dname >= DNAME_MAX_LENGTH - 1) {
+        return DNAME_NAME_TOO_LONG;
+      }
+      *(*octet)++ = *str;
+      return 1;
+  }
+}
+
+static inline int
+parse_end(uint8_t *dname, uint8_t *label, uint8_t *octet)
+{
+  if (octet != label + 1) {
+    /* Terminate last label.  */
+    size_t label_len = (size_t)(octet - label) - 1;
+    if (label_len > DNAME_MAX_LABEL_LENGTH) {
+      return DNAME_LABEL_TOO_LONG;
+    }
+    *label = (uint8_t)label_len;
+    label = octet;
+  }
+
+  /* Add root label.  */
+  *label = 0;
+  return (int)(label - dname) + 1;
+}
+
+int dname_parse_scalar(uint8_t *dname, const char *name, size_t len)
+{
+  const uint8_t *str = (const uint8_t *)name, *end = str + len;
+  uint8_t *label = dname, *octet = dname + 1;
+
+  if (len == 1 && name[0] == '.') {
+    /* Root domain.  */
+    dname[0] = 0;
+    return 1;
+  } else if (len == 0) {
+    return DNAME_EMPTY_LABEL;
+  }
+
+  while (str < end) {
+    int ret = parse_octet(dname, &label, &octet, str, end);
+    if (ret < 0) {
+      return ret;
+    }
+    str += ret;
   }
-  abort();
+
+  return parse_end(dname, label, octet);
+}
+
+#if NSD_X86
+/* Octets map one-to-one as long as there are no escapes, delimiters simply
+ * become length octets. Vectors are therefore copied up to the first escape
+ * and the length octets are filled in for every delimiter. The name may be
+ * read beyond len, but never beyond the page it resides in.
+ */
+__attribute__((target("sse2"))) NSD_NO_SANITIZE_ADDRESS
+static int
+dname_parse_sse2(uint8_t *dname, const char *name, size_t len)
+{
+  const uint8_t *str = (const uint8_t *)name, *end = str + len;
+  uint8_t *label = dname, *octet = dname + 1;
+  const __m128i dot = _mm_set1_epi8('.');
+  const __m128i backslash = _mm_set1_epi8('\\');
+
+  if (len == 1 && name[0] == '.') {
+    /* Root domain.  */
+    dname[0] = 0;
+    return 1;
+  } else if (len == 0) {
+    return DNAME_EMPTY_LABEL;
+  }
+
+  while (str < end) {
+    size_t left = (size_t)(end - str);
+    if (octet - dname <= DNAME_MAX_LENGTH - 16 &&
+        (left >= 16 || NSD_SAME_PAGE(str, 16)))
+    {
+      __m128i vec = _mm_loadu_si128((const __m128i *)str);
+      uint32_t cnt = left >= 16 ? 16 : (uint32_t)left;
+      uint32_t valid = (1u << cnt) - 1;
+      uint32_t dots, escapes;
+
+      escapes = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(vec, backslash));
+      if (escapes & valid) {
+        cnt = (uint32_t)__builtin_ctz(escapes & valid);
+        valid = (1u << cnt) - 1;
+      }
+      dots = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(vec, dot)) & valid;
+
+      _mm_storeu_si128((__m128i *)octet, vec);
+      while (dots) {
+        uint8_t *delim = octet + __builtin_ctz(dots);
+        size_t label_len = (size_t)(delim - label) - 1;
+        if (label_len == 0) {
+          return DNAME_EMPTY_LABEL;
+        } else if (label_len > DNAME_MAX_LABEL_LENGTH) {
+          return DNAME_LABEL_TOO_LONG;
+        }
+        *label = (uint8_t)label_len;
+        label = delim;
+        dots &= dots - 1;
+      }
+      /* last octet can only be the length octet of the root label */
+      if ((octet - dname) + cnt >= DNAME_MAX_LENGTH &&
+          label != octet + cnt - 1)
+      {
+        return DNAME_NAME_TOO_LONG;
+      }
+      octet += cnt;
+      str += cnt;
+      if (str == end || *str != '\\') {
+        continue;
+      }
+    }
+
+    int ret = parse_octet(dname, &label, &octet, str, end);
+    if (ret < 0) {
+      return ret;
+    }
+    str += ret;
+  }
+
+  return parse_end(dname, label, octet);
 }
+#endif
 
-#define MAXDOMAINLEN 255
-#define MAXLABELLEN 63
+int dname_parse(uint8_t *dname, const char *name, size_t len)
+{
+#if NSD_X86
+  if (NSD_HAVE_SSE2) {
+    return dname_parse_sse2(dname, name, len);
+  }
+#endif
+  return dname_parse_scalar(dname, name, len);
+}
 
-int dname_parse_wire(uint8_t* dname, const char* name)
+int dname_parse_wire(uint8_t *dname, const char *name)
 {
-       const uint8_t *s = (const uint8_t *) name;
-       uint8_t *h;
-       uint8_t *p;
-       uint8_t *d = dname;
-       size_t label_length;
-
-       if (strcmp(name, ".") == 0) {
-               /* Root domain.  */
-               dname[0] = 0;
-               return 1;
-       }
-
-       for (h = d, p = h + 1; *s; ++s, ++p) {
-               if (p - dname >= MAXDOMAINLEN) {
-                       return 0;
-               }
-
-               switch (*s) {
-               case '.':
-                       if (p == h + 1) {
-                               /* Empty label.  */
-                               return 0;
-                       } else {
-                               label_length = p - h - 1;
-                               if (label_length > MAXLABELLEN) {
-                                       return 0;
-                               }
-                               *h = label_length;
-                               h = p;
-                       }
-                       break;
-               case '\\':
-                       /* Handle escaped characters (RFC1035 5.1) */
-                       if (isdigit((unsigned char)s[1]) && isdigit((unsigned char)s[2]) && isdigit((unsigned char)s[3])) {
-                               int val = (hexdigit_to_int(s[1]) * 100 +
-                                          hexdigit_to_int(s[2]) * 10 +
-                                          hexdigit_to_int(s[3]));
-                               if (0 <= val && val <= 255) {
-                                       s += 3;
-                                       *p = val;
-                               } else {
-                                       *p = *++s;
-                               }
-                       } else if (s[1] != '\0') {
-                               *p = *++s;
-                       }
-                       break;
-               default:
-                       *p = *s;
-                       break;
-               }
-       }
-
-       if (p != h + 1) {
-               /* Terminate last label.  */
-               label_length = p - h - 1;
-               if (label_length > MAXLABELLEN) {
-                       return 0;
-               }
-               *h = label_length;
-               h = p;
-       }
-
-       /* Add root label.  */
-       if (h - dname >= MAXDOMAINLEN) {
-               return 0;
-       }
-       *h = 0;
-
-       return p-dname;
+  int ret = dname_parse(dname, name, strlen(name));
+  return ret < 0 ? 0 : ret;
 }
@@ -1,8 +1,47 @@
 #ifndef NSD_DNAME_H
 #define NSD_DNAME_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define DNAME_MAX_LENGTH (255)
+#define DNAME_MAX_LABEL_LENGTH (63)
+
+/* errors returned by the parse functions, all negative */
+#define DNAME_EMPTY_LABEL (-1)
+#define DNAME_LABEL_TOO_LONG (-2)
+#define DNAME_NAME_TOO_LONG (-3)
+#define DNAME_BAD_ESCAPE (-4)
+
+/**
+ * @brief Convert domain name in presentation format to wire format
+ *
+ * Names are always made absolute, the trailing dot is optional. Escaped
+ * characters (RFC1035 section 5.1) are supported. Octets in dname beyond the
+ * returned length may be modified.
+ *
+ * @param[out] dname  Buffer of at least @DNAME_MAX_LENGTH octets
+ * @param[in]  name   Domain name in presentation format
+ * @param[in]  len    Number of characters in name
+ *
+ * @returns Length of the name in wire format or a negative error code
+ */
+int dname_parse(uint8_t *dname, const char *name, size_t len)
+  __attribute__((nonnull(1, 2)));
+
+/**
+ * @brief Convert domain name in presentation format to wire format
+ *
+ * Equivalent to @dname_parse, but never uses vector extensions.
+ */
+int dname_parse_scalar(uint8_t *dname, const char *name, size_t len)
+  __attribute__((nonnull(1, 2)));
+
+/**
+ * @brief Convert null-terminated domain name to wire format
+ *
+ * @returns Length of the name in wire format or 0 on error
+ */
 int dname_parse_wire(uint8_t *wirefmt, const char *name);
 
 #endif /* NSD_DNAME_H */
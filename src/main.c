@@ -84,8 +84,10 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  tree.root = calloc(1, sizeof(nsd_node4_t));
-  tree.root->type = nsd_node4;
+  if (nsd_init_tree(&tree, NULL) != nsd_ok) {
+    fprintf(stderr, "Cannot initialize tree\n");
+    exit(1);
+  }
 
   for (int opno = 0; opno < 2; opno++) {
     for (int argno = 1; argno < argc; argno++) {
@@ -113,5 +115,7 @@ skip:
     }
   }
 
+  nsd_deinit_tree(&tree);
+
   return 0;
 }
@@ -0,0 +1,251 @@
+/*
+ * rcu.c -- quiescent-state-based reclamation for lock-free readers
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "rcu.h"
+
+extern inline void
+nsd_rcu_quiescent(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader);
+
+extern inline void
+nsd_rcu_online(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader);
+
+extern inline void
+nsd_rcu_offline(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader);
+
+int
+nsd_rcu_init(nsd_rcu_t *rcu)
+{
+  int err;
+
+  assert(rcu != NULL);
+
+  if ((err = pthread_mutex_init(&rcu->lock, NULL)) != 0) {
+    return err;
+  }
+  if ((err = pthread_mutex_init(&rcu->retire_lock, NULL)) != 0) {
+    (void)pthread_mutex_destroy(&rcu->lock);
+    return err;
+  }
+
+  /* epoch 0 is reserved for offline readers */
+  rcu->epoch = 1;
+  rcu->readers = NULL;
+  rcu->count = 0;
+  rcu->size = 0;
+  rcu->held = 0;
+  rcu->retired = NULL;
+
+  return 0;
+}
+
+void
+nsd_rcu_deinit(nsd_rcu_t *rcu)
+{
+  assert(rcu != NULL);
+  assert(rcu->readers == NULL);
+
+  nsd_rcu_synchronize(rcu);
+  free(rcu->retired);
+  rcu->retired = NULL;
+  rcu->size = 0;
+  (void)pthread_mutex_destroy(&rcu->retire_lock);
+  (void)pthread_mutex_destroy(&rcu->lock);
+}
+
+void
+nsd_rcu_register(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+{
+  assert(rcu != NULL);
+  assert(reader != NULL);
+
+  reader->epoch = 0;
+  pthread_mutex_lock(&rcu->lock);
+  reader->next = rcu->readers;
+  rcu->readers = reader;
+  pthread_mutex_unlock(&rcu->lock);
+}
+
+void
+nsd_rcu_unregister(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+{
+  nsd_rcu_reader_t **ref;
+
+  assert(rcu != NULL);
+  assert(reader != NULL);
+
+  nsd_rcu_offline(rcu, reader);
+  pthread_mutex_lock(&rcu->lock);
+  for (ref = &rcu->readers; *ref != NULL; ref = &(*ref)->next) {
+    if (*ref == reader) {
+      *ref = reader->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&rcu->lock);
+}
+
+/* grow retired data to hold count more objects, retire_lock must be held */
+static int
+reserve(nsd_rcu_t *rcu, size_t count)
+{
+  size_t size;
+  nsd_rcu_retired_t *retired;
+
+  if (rcu->size - rcu->count >= count) {
+    return 0;
+  }
+
+  for (size = rcu->size ? rcu->size : 64; size - rcu->count < count; size *= 2) {
+    /* do nothing */
+  }
+
+  if ((retired = realloc(rcu->retired, size * sizeof(*retired))) == NULL) {
+    return ENOMEM;
+  }
+  rcu->retired = retired;
+  rcu->size = size;
+
+  return 0;
+}
+
+int
+nsd_rcu_reserve(nsd_rcu_t *rcu, size_t count)
+{
+  int err;
+
+  assert(rcu != NULL);
+
+  pthread_mutex_lock(&rcu->retire_lock);
+  err = reserve(rcu, rcu->held + count);
+  pthread_mutex_unlock(&rcu->retire_lock);
+
+  return err;
+}
+
+/* every writer that holds space retires fewer objects than it holds, space
+   for the sum of what writers hold is therefore always sufficient */
+int
+nsd_rcu_hold(nsd_rcu_t *rcu, size_t count)
+{
+  int err;
+
+  assert(rcu != NULL);
+
+  pthread_mutex_lock(&rcu->retire_lock);
+  if ((err = reserve(rcu, rcu->held + count)) == 0) {
+    rcu->held += count;
+  }
+  pthread_mutex_unlock(&rcu->retire_lock);
+
+  return err;
+}
+
+void
+nsd_rcu_unhold(nsd_rcu_t *rcu, size_t count)
+{
+  assert(rcu != NULL);
+
+  pthread_mutex_lock(&rcu->retire_lock);
+  assert(rcu->held >= count);
+  rcu->held -= count;
+  pthread_mutex_unlock(&rcu->retire_lock);
+}
+
+int
+nsd_rcu_retire(nsd_rcu_t *rcu, void *ptr, nsd_rcu_free_t func, void *arg)
+{
+  int err;
+
+  assert(rcu != NULL);
+  assert(func != NULL);
+
+  pthread_mutex_lock(&rcu->retire_lock);
+  if ((err = reserve(rcu, 1)) == 0) {
+    /* unlinking data must be visible before epoch is read */
+    rcu->retired[rcu->count].epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+    rcu->retired[rcu->count].ptr = ptr;
+    rcu->retired[rcu->count].func = func;
+    rcu->retired[rcu->count].arg = arg;
+    rcu->count++;
+  }
+  pthread_mutex_unlock(&rcu->retire_lock);
+
+  return err;
+}
+
+/* release data retired before specified epoch */
+static size_t
+release(nsd_rcu_t *rcu, uint64_t epoch)
+{
+  size_t cnt, idx;
+
+  pthread_mutex_lock(&rcu->retire_lock);
+  for (idx = 0, cnt = 0; idx < rcu->count; idx++) {
+    if (rcu->retired[idx].epoch < epoch) {
+      rcu->retired[idx].func(rcu->retired[idx].arg, rcu->retired[idx].ptr);
+    } else {
+      rcu->retired[cnt++] = rcu->retired[idx];
+    }
+  }
+
+  rcu->count = cnt;
+  pthread_mutex_unlock(&rcu->retire_lock);
+  return cnt;
+}
+
+size_t
+nsd_rcu_reclaim(nsd_rcu_t *rcu)
+{
+  uint64_t epoch, min;
+
+  assert(rcu != NULL);
+
+  /* data retired before now is unreachable for readers that observe the
+     new epoch */
+  min = epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&rcu->lock);
+  for (nsd_rcu_reader_t *reader = rcu->readers; reader; reader = reader->next) {
+    uint64_t reader_epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+    if (reader_epoch != 0 && reader_epoch < min) {
+      min = reader_epoch;
+    }
+  }
+  pthread_mutex_unlock(&rcu->lock);
+
+  return release(rcu, min);
+}
+
+void
+nsd_rcu_synchronize(nsd_rcu_t *rcu)
+{
+  uint64_t epoch;
+  nsd_rcu_reader_t *reader;
+
+  assert(rcu != NULL);
+
+  epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&rcu->lock);
+  for (reader = rcu->readers; reader; reader = reader->next) {
+    uint64_t reader_epoch;
+    while ((reader_epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE))
+             != 0 && reader_epoch < epoch)
+    {
+      sched_yield();
+    }
+  }
+  pthread_mutex_unlock(&rcu->lock);
+
+  (void)release(rcu, epoch);
+}
@@ -0,0 +1,173 @@
+/*
+ * rcu.h -- quiescent-state-based reclamation for lock-free readers
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#ifndef NSD_RCU_H
+#define NSD_RCU_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Quiescent-State-Based Reclamation (QSBR) allows readers to access shared
+ * data without locks or atomic read-modify-write operations. Writers never
+ * modify data that is visible to readers, they publish an updated copy and
+ * retire the old data instead. Retired data is reclaimed once every reader
+ * has passed through a quiescent state, i.e. a point where it holds no
+ * references to shared data, after it was retired.
+ *
+ * Readers register once, go online before accessing shared data and announce
+ * a quiescent state regularly, e.g. after every batch of queries. Readers that
+ * go offline for prolonged periods, e.g. to wait for network activity, do not
+ * hold up reclamation.
+ *
+ * Multiple writers may retire and reclaim data concurrently. Writers that
+ * access shared data must be registered and online themselves and must hold
+ * space for the data they retire, see @nsd_rcu_hold, as they cannot wait for
+ * a grace period while online.
+ */
+
+typedef struct nsd_rcu_reader nsd_rcu_reader_t;
+struct nsd_rcu_reader {
+  uint64_t epoch; /**< Last observed epoch, 0 if offline */
+  nsd_rcu_reader_t *next;
+};
+
+typedef void(*nsd_rcu_free_t)(void *, void *);
+
+typedef struct nsd_rcu_retired nsd_rcu_retired_t;
+struct nsd_rcu_retired {
+  uint64_t epoch;
+  void *ptr;
+  nsd_rcu_free_t func;
+  void *arg;
+};
+
+typedef struct nsd_rcu nsd_rcu_t;
+struct nsd_rcu {
+  uint64_t epoch;
+  pthread_mutex_t lock; /**< Protects list of readers */
+  nsd_rcu_reader_t *readers;
+  pthread_mutex_t retire_lock; /**< Protects retired data */
+  size_t count;
+  size_t size;
+  size_t held; /**< Space held by writers, see @nsd_rcu_hold */
+  nsd_rcu_retired_t *retired;
+};
+
+/**
+ * @brief Initialize reclamation domain
+ *
+ * @returns 0 on success, an error number otherwise
+ */
+int
+nsd_rcu_init(nsd_rcu_t *rcu)
+__attribute__((nonnull));
+
+/**
+ * @brief Reclaim all retired data and release resources
+ *
+ * All readers must be unregistered.
+ */
+void
+nsd_rcu_deinit(nsd_rcu_t *rcu)
+__attribute__((nonnull));
+
+/**
+ * @brief Register reader thread, reader is offline after registration
+ */
+void
+nsd_rcu_register(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+__attribute__((nonnull));
+
+void
+nsd_rcu_unregister(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+__attribute__((nonnull));
+
+inline void
+nsd_rcu_quiescent(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+{
+  /* prior reads must complete before the store is visible */
+  __atomic_store_n(
+    &reader->epoch, __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE),
+    __ATOMIC_RELEASE);
+}
+
+inline void
+nsd_rcu_online(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+{
+  /* subsequent reads must not be performed before the store is visible */
+  __atomic_store_n(
+    &reader->epoch, __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE),
+    __ATOMIC_SEQ_CST);
+}
+
+inline void
+nsd_rcu_offline(nsd_rcu_t *rcu, nsd_rcu_reader_t *reader)
+{
+  (void)rcu;
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Defer release of data until readers can no longer reference it
+ *
+ * Data must be unreachable for readers before it is retired.
+ *
+ * @returns 0 on success, an error number otherwise
+ */
+int
+nsd_rcu_retire(nsd_rcu_t *rcu, void *ptr, nsd_rcu_free_t func, void *arg)
+__attribute__((nonnull(1,3)));
+
+/**
+ * @brief Reserve space so that subsequent retire operations cannot fail
+ *
+ * @returns 0 on success, an error number otherwise
+ */
+int
+nsd_rcu_reserve(nsd_rcu_t *rcu, size_t count)
+__attribute__((nonnull));
+
+/**
+ * @brief Hold space so that retire operations of one of multiple writers
+ *        cannot fail
+ *
+ * Space remains held until released with @nsd_rcu_unhold, which allows
+ * writers to reserve space independently.
+ *
+ * @returns 0 on success, an error number otherwise
+ */
+int
+nsd_rcu_hold(nsd_rcu_t *rcu, size_t count)
+__attribute__((nonnull));
+
+void
+nsd_rcu_unhold(nsd_rcu_t *rcu, size_t count)
+__attribute__((nonnull));
+
+/**
+ * @brief Release retired data that readers can no longer reference
+ *
+ * Does not block.
+ *
+ * @returns Number of retired objects that could not be reclaimed yet
+ */
+size_t
+nsd_rcu_reclaim(nsd_rcu_t *rcu)
+__attribute__((nonnull));
+
+/**
+ * @brief Wait for a grace period to elapse and release all retired data
+ *
+ * Must be called by a writer that is not online.
+ */
+void
+nsd_rcu_synchronize(nsd_rcu_t *rcu)
+__attribute__((nonnull));
+
+#endif /* NSD_RCU_H */
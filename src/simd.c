@@ -8,14 +8,91 @@
  */
 #include "simd.h"
 
+uint32_t nsd_simd_features = 0;
+
+uint32_t
+nsd_simd_init(void)
+{
+  uint32_t features = 0;
+
+#if NSD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    features |= NSD_SIMD_SSE2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= NSD_SIMD_AVX2;
+  }
+#endif
+
+  /* readers may be active if trees already exist, only store once */
+  if (__atomic_load_n(&nsd_simd_features, __ATOMIC_RELAXED) != features) {
+    __atomic_store_n(&nsd_simd_features, features, __ATOMIC_RELAXED);
+  }
+
+  return features;
+}
+
+extern inline uint8_t
+nsd_findeq_u8(uint8_t chr, const uint8_t *vec, uint8_t max);
+
+extern inline uint8_t
+nsd_findgt_u8(uint8_t chr, const uint8_t *vec, uint8_t max);
+
+extern inline uint8_t
+nsd_xlat_u8(uint8_t oct);
+
+#if NSD_X86
+extern inline uint8_t
+nsd_v16_findeq_u8_sse2(uint8_t chr, const uint8_t vec[16], uint8_t max);
+
+extern inline uint8_t
+nsd_v16_findgt_u8_sse2(uint8_t chr, const uint8_t vec[16], uint8_t max);
+
+extern inline uint8_t
+nsd_v32_findeq_u8_avx2(uint8_t chr, const uint8_t vec[32], uint8_t max);
+
+extern inline uint8_t
+nsd_v32_findgt_u8_avx2(uint8_t chr, const uint8_t vec[32], uint8_t max);
+
+extern inline __m128i
+nsd_v16_xlat_u8_sse2(__m128i vec);
+
+extern inline __m256i
+nsd_v32_xlat_u8_avx2(__m256i vec);
+
+extern inline void
+nsd_xlat_u8_sse2(uint8_t *dst, const uint8_t *src, size_t len, size_t avail);
+
+extern inline uint8_t
+nsd_make_key_sse2(
+  uint8_t key[255],
+  const uint8_t *name,
+  size_t name_len,
+  const uint8_t *labels,
+  uint8_t nlabels);
+
+extern inline uint8_t
+nsd_make_key_avx2(
+  uint8_t key[255],
+  const uint8_t *name,
+  size_t name_len,
+  const uint8_t *labels,
+  uint8_t nlabels);
+#endif
+
 extern inline uint8_t
-nsd_v16_findeq_u8(uint8_t chr, const uint8_t vec[16], uint8_t max);
+nsd_v16_findeq_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[16], uint8_t max);
 
 extern inline uint8_t
-nsd_v16_findgt_u8(uint8_t chr, const uint8_t vec[16], uint8_t max);
+nsd_v16_findgt_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[16], uint8_t max);
 
 extern inline uint8_t
-nsd_v32_findeq_u8(uint8_t chr, const uint8_t vec[32], uint8_t max);
+nsd_v32_findeq_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[32], uint8_t max);
 
 extern inline uint8_t
-nsd_v32_findgt_u8(uint8_t chr, const uint8_t vec[32], uint8_t max);
+nsd_v32_findgt_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[32], uint8_t max);
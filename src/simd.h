@@ -9,18 +9,69 @@
 #ifndef NSD_SIMD_H
 #define NSD_SIMD_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #if defined(__i386__) || defined(__x86_64__)
+# define NSD_X86 1
 # include <immintrin.h>
 #elif defined(__arm)
 /* https://developer.arm.com/architectures/instruction-sets/simd-isas/neon */
 # include <arm_neon.h>
 #endif
 
-#if HAVE_SSE2
+/* Extensions are detected at runtime so that a single binary can make use of
+ * the widest extensions available on any given machine. Functions that
+ * require extensions beyond the baseline are compiled for the specific target
+ * and are only called if the extensions are available.
+ */
+#define NSD_SIMD_SSE2 (1u << 0)
+#define NSD_SIMD_AVX2 (1u << 1)
+
+/** Extensions supported by the CPU, 0 until @nsd_simd_init is called */
+extern uint32_t nsd_simd_features;
+
+/**
+ * @brief Detect supported extensions
+ *
+ * @returns Extensions supported by the CPU
+ */
+uint32_t
+nsd_simd_init(void);
+
+/* Vector search functions operate on sorted vectors of unsigned octets. Only
+ * the first max elements are considered.
+ *
+ * findeq: returns index + 1 of the element equal to chr, 0 if not found.
+ * findgt: returns index of the first element greater than chr, max if none.
+ */
+
+inline uint8_t
+nsd_findeq_u8(uint8_t chr, const uint8_t *vec, uint8_t max)
+{
+  for (uint8_t idx = 0; idx < max; idx++) {
+    if (vec[idx] == chr) {
+      return idx + 1;
+    }
+  }
+  return 0;
+}
+
+inline uint8_t
+nsd_findgt_u8(uint8_t chr, const uint8_t *vec, uint8_t max)
+{
+  for (uint8_t idx = 0; idx < max; idx++) {
+    if (vec[idx] > chr) {
+      return idx;
+    }
+  }
+  return max;
+}
+
+#if NSD_X86
+__attribute__((target("sse2")))
 inline uint8_t
-nsd_v16_findeq_u8(uint8_t chr, const uint8_t vec[16], uint8_t max)
+nsd_v16_findeq_u8_sse2(uint8_t chr, const uint8_t vec[16], uint8_t max)
 {
   __m128i cmp;
   uint16_t bitmap;
@@ -29,71 +80,309 @@ nsd_v16_findeq_u8(uint8_t chr, const uint8_t vec[16], uint8_t max)
   cmp = _mm_cmpeq_epi8(
     _mm_set1_epi8(chr), _mm_loadu_si128((__m128i*)vec));
   bitmap = _mm_movemask_epi8(cmp) & mask;
-  return __builtin_ctz(bitmap);
+  return bitmap ? __builtin_ctz(bitmap) + 1 : 0;
 }
 
+__attribute__((target("sse2")))
 inline uint8_t
-nsd_v16_findgt_u8(uint8_t chr, const uint8_t vec[16], uint8_t max)
+nsd_v16_findgt_u8_sse2(uint8_t chr, const uint8_t vec[16], uint8_t max)
 {
-  __m128i cmp;
+  __m128i bias, cmp;
   uint16_t bitmap;
   uint16_t mask = max < 16 ? (1 << max) - 1 : (uint16_t)-1;
 
+  /* SSE2 has no unsigned compare, flip sign bits instead */
+  bias = _mm_set1_epi8((char)0x80);
   cmp = _mm_cmpgt_epi8(
-    _mm_set1_epi8(chr), _mm_loadu_si128((__m128i*)vec));
-  bitmap = _mm_movemask_epi8(cmp);
-  return __builtin_ctz(~bitmap & mask);
+    _mm_xor_si128(_mm_loadu_si128((__m128i*)vec), bias),
+    _mm_xor_si128(_mm_set1_epi8(chr), bias));
+  bitmap = _mm_movemask_epi8(cmp) & mask;
+  return bitmap ? __builtin_ctz(bitmap) : max;
+}
+
+__attribute__((target("avx2")))
+inline uint8_t
+nsd_v32_findeq_u8_avx2(uint8_t chr, const uint8_t vec[32], uint8_t max)
+{
+  __m256i cmp;
+  uint32_t bitmap;
+  uint32_t mask = max < 32 ? (1u << max) - 1 : (uint32_t)-1;
+
+  cmp = _mm256_cmpeq_epi8(
+    _mm256_set1_epi8(chr), _mm256_loadu_si256((__m256i*)vec));
+  bitmap = _mm256_movemask_epi8(cmp) & mask;
+  return bitmap ? __builtin_ctz(bitmap) + 1 : 0;
+}
+
+__attribute__((target("avx2")))
+inline uint8_t
+nsd_v32_findgt_u8_avx2(uint8_t chr, const uint8_t vec[32], uint8_t max)
+{
+  __m256i bias, cmp;
+  uint32_t bitmap;
+  uint32_t mask = max < 32 ? (1u << max) - 1 : (uint32_t)-1;
+
+  bias = _mm256_set1_epi8((char)0x80);
+  cmp = _mm256_cmpgt_epi8(
+    _mm256_xor_si256(_mm256_loadu_si256((__m256i*)vec), bias),
+    _mm256_xor_si256(_mm256_set1_epi8(chr), bias));
+  bitmap = _mm256_movemask_epi8(cmp) & mask;
+  return bitmap ? __builtin_ctz(bitmap) : max;
 }
+#endif /* NSD_X86 */
+
+/* SSE2 is part of the x86-64 baseline and is used unconditionally there */
+#if NSD_X86 && defined(__SSE2__)
+# define NSD_HAVE_SSE2 (1)
+#elif NSD_X86
+# define NSD_HAVE_SSE2 \
+  (__atomic_load_n(&nsd_simd_features, __ATOMIC_RELAXED) & NSD_SIMD_SSE2)
+#else
+# define NSD_HAVE_SSE2 (0)
+#endif
+
+#if NSD_X86
+# define NSD_HAVE_AVX2 \
+  (__atomic_load_n(&nsd_simd_features, __ATOMIC_RELAXED) & NSD_SIMD_AVX2)
+#else
+# define NSD_HAVE_AVX2 (0)
+#endif
+
+/* Wrappers select the kernel from the extensions in simd, which trees select
+   once at initialization (see @nsd_tree_t), rather than from the extensions
+   supported by the CPU */
+#if NSD_X86
+# define NSD_USE_SSE2(simd) ((simd) & NSD_SIMD_SSE2)
+# define NSD_USE_AVX2(simd) ((simd) & NSD_SIMD_AVX2)
 #else
+# define NSD_USE_SSE2(simd) (0)
+# define NSD_USE_AVX2(simd) (0)
+#endif
+
 inline uint8_t
-nsd_v16_findeq_u8(uint8_t chr, const uint8_t vec[16], uint8_t max)
+nsd_v16_findeq_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[16], uint8_t max)
 {
-  for (uint8_t idx = 0; idx < 16; idx++) {
-    if (vec[idx] == chr) {
-      return idx + 1;
-    }
+#if NSD_X86
+  if (NSD_USE_SSE2(simd)) {
+    return nsd_v16_findeq_u8_sse2(chr, vec, max);
   }
-  return 0;
+#endif
+  return nsd_findeq_u8(chr, vec, max < 16 ? max : 16);
 }
 
 inline uint8_t
-nsd_v16_findgt_u8(uint8_t chr, const uint8_t vec[16], uint8_t max)
+nsd_v16_findgt_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[16], uint8_t max)
 {
-  for (uint8_t idx = 0; idx < 16; idx++) {
-    if (vec[idx] > chr) {
-      return idx + 1;
-    }
+#if NSD_X86
+  if (NSD_USE_SSE2(simd)) {
+    return nsd_v16_findgt_u8_sse2(chr, vec, max);
   }
-  return 0;
-}
 #endif
+  return nsd_findgt_u8(chr, vec, max < 16 ? max : 16);
+}
 
-#if HAVE_AVX2
 inline uint8_t
-nsd_v32_findeq_u8(uint8_t chr, const uint8_t vec[32], uint8_t max)
+nsd_v32_findeq_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[32], uint8_t max)
 {
-  __m256i cmp;
-  uint32_t bitmap;
-  uint32_t mask = max < 32 ? (1 << max) - 1 : (uint32_t)-1;
+#if NSD_X86
+  if (NSD_USE_AVX2(simd)) {
+    return nsd_v32_findeq_u8_avx2(chr, vec, max);
+  }
+#endif
+  return nsd_findeq_u8(chr, vec, max < 32 ? max : 32);
+}
 
-  cmp = _mm256_cmpeq_epi8(
-    _mm256_set1_epi8(chr), _mm256_loadu_si256((__m256i*)vec));
-  bitmap = _mm256_movemask_epi8(cmp) & mask;
-  return __builtin_ctz(bitmap);
+inline uint8_t
+nsd_v32_findgt_u8(
+  uint32_t simd, uint8_t chr, const uint8_t vec[32], uint8_t max)
+{
+#if NSD_X86
+  if (NSD_USE_AVX2(simd)) {
+    return nsd_v32_findgt_u8_avx2(chr, vec, max);
+  }
+#endif
+  return nsd_findgt_u8(chr, vec, max < 32 ? max : 32);
 }
 
+/* Key construction (see tree.h) translates octets in labels, which are
+ * specified by offset in name and processed in reverse order, and terminates
+ * every label with 0x00. Names are name_len octets, vectors may write past
+ * the key up to 255 octets.
+ */
+
 inline uint8_t
-nsd_v32_findgt_u8(uint8_t chr, const uint8_t vec[32], uint8_t max)
+nsd_xlat_u8(uint8_t oct)
 {
-  __m256i cmp;
-  uint32_t bitmap;
-  uint32_t mask = max < 32 ? (1 << max) - 1 : (uint32_t)-1;
+  if (oct < 0x41u) {
+    return oct + 0x01u;
+  } else if (oct < 0x5bu) {
+    return oct + 0x07u;
+  }
+  return oct - 0x19u;
+}
 
-  cmp = _mm256_cmpgt_epi8(
-    _mm256_set1_epi8(chr), _mm256_loadu_si256((__m256i*)vec));
-  bitmap = _mm256_movemask_epi8(cmp);
-  return __builtin_ctz(~bitmap & mask);
+#if NSD_X86
+/* 0xe7 (-0x19) is added to every octet, 0x20 is added to octets less than
+   0x5b and 0xfa is added to octets less than 0x41, modulo 256 */
+__attribute__((target("sse2")))
+inline __m128i
+nsd_v16_xlat_u8_sse2(__m128i vec)
+{
+  __m128i bias, biased, lt41, lt5b, delta;
+
+  bias = _mm_set1_epi8((char)0x80);
+  biased = _mm_xor_si128(vec, bias);
+  lt41 = _mm_cmpgt_epi8(_mm_set1_epi8((char)(0x41 ^ 0x80)), biased);
+  lt5b = _mm_cmpgt_epi8(_mm_set1_epi8((char)(0x5b ^ 0x80)), biased);
+  delta = _mm_add_epi8(
+    _mm_set1_epi8((char)0xe7),
+    _mm_add_epi8(_mm_and_si128(lt5b, _mm_set1_epi8(0x20)),
+                 _mm_and_si128(lt41, _mm_set1_epi8((char)0xfa))));
+  return _mm_add_epi8(vec, delta);
 }
+
+__attribute__((target("avx2")))
+inline __m256i
+nsd_v32_xlat_u8_avx2(__m256i vec)
+{
+  __m256i bias, biased, lt41, lt5b, delta;
+
+  bias = _mm256_set1_epi8((char)0x80);
+  biased = _mm256_xor_si256(vec, bias);
+  lt41 = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x41 ^ 0x80)), biased);
+  lt5b = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x5b ^ 0x80)), biased);
+  delta = _mm256_add_epi8(
+    _mm256_set1_epi8((char)0xe7),
+    _mm256_add_epi8(_mm256_and_si256(lt5b, _mm256_set1_epi8(0x20)),
+                    _mm256_and_si256(lt41, _mm256_set1_epi8((char)0xfa))));
+  return _mm256_add_epi8(vec, delta);
+}
+
+/* translates len octets, vectors read up to avail octets from src and write
+   past len in dst up to a multiple of 16 octets */
+__attribute__((target("sse2")))
+inline void
+nsd_xlat_u8_sse2(uint8_t *dst, const uint8_t *src, size_t len, size_t avail)
+{
+  size_t cnt;
+
+  for (cnt = 0; cnt < len && cnt + 16 <= avail; cnt += 16) {
+    _mm_storeu_si128((__m128i *)(dst + cnt), nsd_v16_xlat_u8_sse2(
+      _mm_loadu_si128((const __m128i *)(src + cnt))));
+  }
+  for (; cnt < len; cnt++) {
+    dst[cnt] = nsd_xlat_u8(src[cnt]);
+  }
+}
+
+/* Loads past the end of name are harmless as long as they do not cross a
+   page boundary (and are invisible to the address sanitizer) */
+#define NSD_SAME_PAGE(ptr, size) \
+  (((uintptr_t)(ptr) & 4095u) <= 4096u - (size))
+
+#if defined(__SANITIZE_ADDRESS__)
+# define NSD_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+# if __has_feature(address_sanitizer)
+#  define NSD_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+# endif
 #endif
+#ifndef NSD_NO_SANITIZE_ADDRESS
+# define NSD_NO_SANITIZE_ADDRESS
+#endif
+
+/* name is translated as a whole, including length octets, into a buffer
+   that is padded so that labels can be copied in vectors */
+__attribute__((target("sse2"))) NSD_NO_SANITIZE_ADDRESS
+inline uint8_t
+nsd_make_key_sse2(
+  uint8_t key[255],
+  const uint8_t *name,
+  size_t name_len,
+  const uint8_t *labels,
+  uint8_t nlabels)
+{
+  uint8_t buf[256 + 16], *ptr = key;
+  size_t cnt;
+
+  for (cnt = 0; cnt < name_len; cnt += 16) {
+    if (cnt + 16 > name_len && !NSD_SAME_PAGE(name + cnt, 16)) {
+      break;
+    }
+    _mm_storeu_si128((__m128i *)(buf + cnt), nsd_v16_xlat_u8_sse2(
+      _mm_loadu_si128((const __m128i *)(name + cnt))));
+  }
+  for (; cnt < name_len; cnt++) {
+    buf[cnt] = nsd_xlat_u8(name[cnt]);
+  }
+
+  while (nlabels > 0) {
+    uint8_t off = labels[--nlabels], len = name[off];
+    const uint8_t *src = &buf[off + 1];
+    for (cnt = 0; cnt < len && ptr + cnt + 16 <= key + 255; cnt += 16) {
+      _mm_storeu_si128(
+        (__m128i *)(ptr + cnt), _mm_loadu_si128((const __m128i *)(src + cnt)));
+    }
+    for (; cnt < len; cnt++) {
+      ptr[cnt] = src[cnt];
+    }
+    ptr += len;
+    *ptr++ = 0x00u; /* null-terminate label */
+  }
+  *ptr++ = 0x00u; /* null-terminate key */
+
+  return (uint8_t)(ptr - key);
+}
+
+__attribute__((target("avx2"))) NSD_NO_SANITIZE_ADDRESS
+inline uint8_t
+nsd_make_key_avx2(
+  uint8_t key[255],
+  const uint8_t *name,
+  size_t name_len,
+  const uint8_t *labels,
+  uint8_t nlabels)
+{
+  uint8_t buf[256 + 32], *ptr = key;
+  size_t cnt;
+
+  for (cnt = 0; cnt < name_len; cnt += 32) {
+    if (cnt + 32 > name_len && !NSD_SAME_PAGE(name + cnt, 32)) {
+      break;
+    }
+    _mm256_storeu_si256((__m256i *)(buf + cnt), nsd_v32_xlat_u8_avx2(
+      _mm256_loadu_si256((const __m256i *)(name + cnt))));
+  }
+  for (; cnt < name_len; cnt++) {
+    buf[cnt] = nsd_xlat_u8(name[cnt]);
+  }
+
+  while (nlabels > 0) {
+    uint8_t off = labels[--nlabels], len = name[off];
+    const uint8_t *src = &buf[off + 1];
+    /* labels are 63 octets at most, most fit in 16 octets */
+    if (len <= 16 && ptr + 16 <= key + 255) {
+      _mm_storeu_si128((__m128i *)ptr, _mm_loadu_si128((const __m128i *)src));
+      cnt = len;
+    } else {
+      for (cnt = 0; cnt < len && ptr + cnt + 32 <= key + 255; cnt += 32) {
+        _mm256_storeu_si256((__m256i *)(ptr + cnt),
+          _mm256_loadu_si256((const __m256i *)(src + cnt)));
+      }
+    }
+    for (; cnt < len; cnt++) {
+      ptr[cnt] = src[cnt];
+    }
+    ptr += len;
+    *ptr++ = 0x00u; /* null-terminate label */
+  }
+  *ptr++ = 0x00u; /* null-terminate key */
+
+  return (uint8_t)(ptr - key);
+}
+#endif /* NSD_X86 */
 
 #endif /* NSD_SIMD_H */
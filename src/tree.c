@@ -8,9 +8,15 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "simd.h"
 #include "tree.h"
@@ -19,17 +25,7 @@
 
 extern inline bool nsd_is_leaf(const nsd_node_t *);
 extern inline nsd_leaf_t *nsd_leaf_raw(const nsd_node_t *);
-
-static uint8_t
-xlat(uint8_t oct)
-{
-  if (oct < 0x41u) {
-    return oct + 0x01u;
-  } else if (oct < 0x5bu) {
-    return oct + 0x07u;
-  }
-  return oct - 0x19u;
-}
+extern inline void *nsd_leaf_value(const nsd_leaf_t *);
 
 /* translate key to node38 index */
 static inline uint8_t
@@ -52,7 +48,7 @@ node38_xlat(uint8_t key)
 static inline uint8_t
 node38_unxlat(uint8_t key)
 {
-  if (key >= 0x0bu && key <= 0x25u) { /* "a..z" */
+  if (key >= 0x0cu && key <= 0x25u) { /* "a..z" */
     return key + 0x3cu;
   } else if (key >= 0x02u && key <= 0x0bu) { /* "0..9" */
     return key + 0x2fu;
@@ -65,28 +61,98 @@ node38_unxlat(uint8_t key)
   return (uint8_t)-1;
 }
 
-uint8_t
-nsd_make_key(nsd_key_t key, const uint8_t *name)
+/* node17 index plus one for reverse DNS keys, digits and letters alternate
+   unpredictably in reverse zones, a table avoids branching on either */
+static const uint8_t node17_index[UINT8_MAX + 1] = {
+  [0x00] = 1,
+  [0x31] = 2, [0x32] = 3, [0x33] = 4, [0x34] = 5, [0x35] = 6, /* "0..4" */
+  [0x36] = 7, [0x37] = 8, [0x38] = 9, [0x39] = 10, [0x3a] = 11, /* "5..9" */
+  [0x48] = 12, [0x49] = 13, [0x4a] = 14, [0x4b] = 15, [0x4c] = 16, /* "a..e" */
+  [0x4d] = 17 /* "f" */
+};
+
+/* translate key to node17 index */
+static inline uint8_t
+node17_xlat(uint8_t key)
+{
+  return (uint8_t)(node17_index[key] - 1u);
+}
+
+/* translate node17 index to key */
+static inline uint8_t
+node17_unxlat(uint8_t key)
+{
+  if (key >= 0x0bu && key <= 0x10u) { /* "a..f" */
+    return key + 0x3du;
+  } else if (key >= 0x01u && key <= 0x0au) { /* "0..9" */
+    return key + 0x30u;
+  } else if (key == 0x00u) {
+    return 0x00u;
+  }
+
+  return (uint8_t)-1;
+}
+
+static uint8_t
+make_key(uint32_t simd, nsd_key_t key, const uint8_t *name)
 {
   size_t cnt = 0, len = 0;
-  uint8_t *ptr;
+  uint8_t *ptr, labels[NSD_MAX_HEIGHT / 2], nlabels = 0;
 
   assert(key != NULL);
   assert(name != NULL);
 
-  ptr = key - 1; /* 1st octet never written */
+  /* labels are stored in reverse order */
   while (name[cnt] != 0x00) {
-    if ((name[cnt] & 0xc0u) || ((len += name[cnt] + 1) > 0xffu)) {
+    if ((name[cnt] & 0xc0u) || cnt + name[cnt] + 1 >= NSD_MAX_HEIGHT) {
       return 0;
     }
-    for (++cnt; cnt < len; cnt++) {
-      ptr[cnt] = xlat(name[cnt]);
+    labels[nlabels++] = (uint8_t)cnt;
+    cnt += name[cnt] + 1;
+  }
+
+#if NSD_X86
+  /* name is cnt + 1 octets */
+  if (NSD_USE_AVX2(simd)) {
+    return nsd_make_key_avx2(key, name, cnt + 1, labels, nlabels);
+  } else if (NSD_USE_SSE2(simd)) {
+    return nsd_make_key_sse2(key, name, cnt + 1, labels, nlabels);
+  }
+#endif
+
+  ptr = key;
+  while (nlabels > 0) {
+    const uint8_t *label = &name[labels[--nlabels]];
+    for (len = 1; len <= label[0]; len++) {
+      *ptr++ = nsd_xlat_u8(label[len]);
     }
-    ptr[cnt] = 0x00u; /* null-terminate label */
+    *ptr++ = 0x00u; /* null-terminate label */
   }
-  ptr[++cnt] = 0x00u; /* null-terminate key */
+  *ptr++ = 0x00u; /* null-terminate key */
 
-  return cnt;
+  return (uint8_t)(ptr - key);
+}
+
+uint8_t
+nsd_make_key(nsd_key_t key, const uint8_t *name)
+{
+  uint32_t simd = 0;
+
+  if (NSD_HAVE_SSE2) {
+    simd |= NSD_SIMD_SSE2;
+  }
+  if (NSD_HAVE_AVX2) {
+    simd |= NSD_SIMD_AVX2;
+  }
+
+  return make_key(simd, key, name);
+}
+
+uint8_t
+nsd_make_tree_key(const nsd_tree_t *tree, nsd_key_t key, const uint8_t *name)
+{
+  assert(tree != NULL);
+  return make_key(tree->simd, key, name);
 }
 
 static uint8_t
@@ -105,76 +171,234 @@ compare_keys(
   return cnt;
 }
 
-static void *alloc_node(nsd_node_type_t type)
+/* Number of octets key has in common with the key of leaf, octets before
+ * depth are known to be equal. Leaves in trees with suffix leaves do not
+ * store octets before the depth at which they were created, which is never
+ * more than the depth at which they are found.
+ */
+static inline uint8_t
+compare_leaf(
+  const nsd_leaf_t *leaf, const uint8_t *key, uint8_t key_len, uint8_t depth)
 {
-  size_t size;
-  nsd_node_t *node;
+  assert(depth >= leaf->depth);
+  assert(depth <= key_len && depth <= leaf->key_len);
+  return depth + compare_keys(key + depth, key_len - depth,
+                              leaf->key + (depth - leaf->depth),
+                              leaf->key_len - depth);
+}
+
+/* Allocators align objects to the largest power of two that divides their
+ * size (up to a cache line). Sizes are padded to a multiple of the smallest
+ * power of two that holds the header and the keys scanned on lookup, so that
+ * both are fetched with a single cache line. node17, node38, node48 and
+ * node256 are indexed directly and only need the header to not straddle a
+ * line.
+ */
+#define NODE_SIZE(type, align) \
+  ((sizeof(type) + ((align) - 1)) & ~(size_t)((align) - 1))
+
+_Static_assert(sizeof(nsd_node_t) == 16, "node header must be 16 octets");
 
+static size_t node_size(nsd_node_type_t type)
+{
   switch (type) {
     case nsd_node4:
-      size = sizeof(nsd_node4_t);
-      break;
+      return NODE_SIZE(nsd_node4_t, 32);
     case nsd_node16:
-      size = sizeof(nsd_node16_t);
-      break;
+      return NODE_SIZE(nsd_node16_t, 32);
+    case nsd_node17:
+      return NODE_SIZE(nsd_node17_t, 16);
     case nsd_node32:
-      size = sizeof(nsd_node32_t);
-      break;
+      return NODE_SIZE(nsd_node32_t, 64);
     case nsd_node38:
-      size = sizeof(nsd_node38_t);
-      break;
+      return NODE_SIZE(nsd_node38_t, 16);
     case nsd_node48:
-      size = sizeof(nsd_node48_t);
-      break;
+      return NODE_SIZE(nsd_node48_t, 16);
     case nsd_node256:
-      size = sizeof(nsd_node256_t);
-      break;
+      return NODE_SIZE(nsd_node256_t, 16);
     default:
-      abort();
+      break;
   }
 
-  if ((node = calloc(1, size)) != NULL) {
+  abort();
+}
+
+/* Writers lock a node by setting NODE_LOCKED and unlock it by adding it once
+ * more, which increments the version. Nodes that are replaced are marked
+ * NODE_OBSOLETE before they are unlocked.
+ */
+#define NODE_OBSOLETE (1u)
+#define NODE_LOCKED (2u)
+
+static void *alloc_node(nsd_tree_t *tree, nsd_node_type_t type)
+{
+  nsd_node_t *node;
+  size_t size = node_size(type);
+
+  if ((node = tree->allocator.allocate(tree->allocator.arg, size)) != NULL) {
+    memset(node, 0, size);
     node->type = type;
   }
 
   return node;
 }
 
+static void *clone_node(nsd_tree_t *tree, const nsd_node_t *node)
+{
+  nsd_node_t *clone;
+  size_t size = node_size(node->type);
+
+  if ((clone = tree->allocator.allocate(tree->allocator.arg, size)) != NULL) {
+    memcpy(clone, node, size);
+    clone->version = 0;
+  }
+
+  return clone;
+}
+
 static void copy_header(nsd_node_t *dest, nsd_node_t *src)
 {
   dest->width = src->width;
-  memcpy(dest->prefix, src->prefix, src->prefix_len);
+  memcpy(dest->prefix, src->prefix, sizeof(dest->prefix));
   dest->prefix_len = src->prefix_len;
 }
 
-static nsd_leaf_t *make_leaf(const nsd_key_t key, uint8_t key_len)
+/* inline values follow the stored octets of the key, see nsd_leaf_value */
+static inline size_t leaf_size(const nsd_tree_t *tree, uint8_t key_len)
+{
+  size_t size = sizeof(nsd_leaf_t) + key_len;
+
+  if (tree->value_size == 0) {
+    return size;
+  }
+  return ((size + 7u) & ~(size_t)7u) + tree->value_size;
+}
+
+/* depth is the depth at which the leaf is created, leaves never move up */
+static nsd_leaf_t *make_leaf(
+  nsd_tree_t *tree, const nsd_key_t key, uint8_t key_len, uint8_t depth)
 {
   size_t size;
   nsd_leaf_t *leaf;
 
-  size = sizeof(nsd_leaf_t) + key_len;
-  if ((leaf = malloc(size)) == NULL) {
+  if (!tree->suffix_leaves) {
+    depth = 0;
+  }
+  assert(depth <= key_len);
+  size = leaf_size(tree, key_len - depth);
+  if ((leaf = tree->allocator.allocate(tree->allocator.arg, size)) == NULL) {
     return NULL;
   }
 
   leaf->data = NULL;
   leaf->key_len = key_len;
-  memcpy(leaf->key, key, key_len);
+  leaf->depth = depth;
+  memcpy(leaf->key, key + depth, key_len - depth);
+  if (tree->value_size != 0) {
+    memset(nsd_leaf_value(leaf), 0, tree->value_size);
+  }
 
   return leaf;
 }
 
-static void free_node(void *node)
+static void release_node(void *arg, void *node)
+{
+  nsd_tree_t *tree = arg;
+  nsd_leaf_t *leaf;
+
+  if (nsd_is_leaf(node)) {
+    leaf = nsd_leaf_raw(node);
+    tree->allocator.release(
+      tree->allocator.arg, leaf, leaf_size(tree, leaf->key_len - leaf->depth));
+  } else {
+    tree->allocator.release(
+      tree->allocator.arg, node, node_size(((nsd_node_t *)node)->type));
+  }
+}
+
+/* nodes may still be referenced by readers if tree is shared */
+static void free_node(nsd_tree_t *tree, void *node)
+{
+  if (node == NULL) {
+    return;
+  }
+
+  if (tree->rcu != NULL) {
+    /* node is locked by the writer in concurrent trees */
+    if (tree->concurrent && !nsd_is_leaf(node)) {
+      __atomic_fetch_or(
+        &((nsd_node_t *)node)->version, NODE_OBSOLETE, __ATOMIC_RELAXED);
+    }
+    if (nsd_rcu_retire(tree->rcu, node, &release_node, tree) == 0) {
+      return;
+    }
+    /* wait for readers if node cannot be retired */
+    nsd_rcu_synchronize(tree->rcu);
+  }
+
+  release_node(tree, node);
+}
+
+/* Prefixes that exceed NSD_MAX_PREFIX are stored out of line in trees with
+ * suffix leaves, the first octet holds the size of the prefix the buffer was
+ * allocated for. Copies of a node share the buffer, it is therefore not
+ * released with the node, but when the prefix of the node changes or the
+ * node is removed from the tree. Buffers that readers may still access are
+ * never modified.
+ */
+static inline bool
+long_prefix(const nsd_tree_t *tree, const nsd_node_t *node)
+{
+  return tree->suffix_leaves && node->prefix_len > NSD_MAX_PREFIX;
+}
+
+static void release_prefix(void *arg, void *prefix)
+{
+  nsd_tree_t *tree = arg;
+  uint8_t *buffer = prefix;
+
+  tree->allocator.release(tree->allocator.arg, buffer, 1u + buffer[0]);
+}
+
+/* prefix may still be accessed by readers if tree is shared */
+static void free_prefix(nsd_tree_t *tree, const nsd_node_t *node)
 {
-  if (node != NULL) {
-    free(nsd_is_leaf(node) ? nsd_leaf_raw(node) : node);
+  if (!long_prefix(tree, node)) {
+    return;
   }
+
+  if (tree->rcu != NULL) {
+    if (nsd_rcu_retire(
+          tree->rcu, node->long_prefix, &release_prefix, tree) == 0)
+    {
+      return;
+    }
+    nsd_rcu_synchronize(tree->rcu);
+  }
+
+  release_prefix(tree, node->long_prefix);
+}
+
+/* node32 is only used if the CPU supports AVX2, other nodes grow to node38
+   or node48 directly */
+static inline bool
+use_node32(const nsd_tree_t *tree)
+{
+  return (tree->simd & NSD_SIMD_AVX2) != 0;
+}
+
+/* root is replaced by the writer if tree is shared, read references once */
+static inline nsd_node_t *
+load_node(nsd_node_t **noderef)
+{
+  return __atomic_load_n(noderef, __ATOMIC_ACQUIRE);
 }
 
 static inline nsd_node_t **
 find_child256(const nsd_node256_t *node256, uint8_t key)
 {
-  return (nsd_node_t **)&node256->children[key];
+  return node256->children[key] != NULL
+    ? (nsd_node_t **)&node256->children[key] : NULL;
 }
 
 static inline nsd_node_t **
@@ -188,24 +412,31 @@ static inline nsd_node_t **
 find_child38(const nsd_node38_t *node38, uint8_t key)
 {
   uint8_t idx = node38_xlat(key);
-  return idx != (uint8_t)-1 ? (nsd_node_t **)&node38->children[idx] : NULL;
+  return idx != (uint8_t)-1 && node38->children[idx] != NULL
+    ? (nsd_node_t **)&node38->children[idx] : NULL;
+}
+
+static inline nsd_node_t **
+find_child17(const nsd_node17_t *node17, uint8_t key)
+{
+  uint8_t idx = node17_xlat(key);
+  return idx != (uint8_t)-1 && node17->children[idx] != NULL
+    ? (nsd_node_t **)&node17->children[idx] : NULL;
 }
 
 static inline nsd_node_t **
-find_child32(const nsd_node32_t *node32, uint8_t key)
+find_child32(uint32_t simd, const nsd_node32_t *node32, uint8_t key)
 {
-#if HAVE_AVX2
-  uint8_t idx = nsd_v32_findeq_u8(key, node32->keys, node32->base.width);
+  uint8_t idx =
+    nsd_v32_findeq_u8(simd, key, node32->keys, node32->base.width);
   return idx != 0 ? (nsd_node_t **)&node32->children[ idx - 1 ] : NULL;
-#else
-  abort();
-#endif
 }
 
 static inline nsd_node_t **
-find_child16(const nsd_node16_t *node16, uint8_t key)
+find_child16(uint32_t simd, const nsd_node16_t *node16, uint8_t key)
 {
-  uint8_t idx = nsd_v16_findeq_u8(key, node16->keys, node16->base.width);
+  uint8_t idx =
+    nsd_v16_findeq_u8(simd, key, node16->keys, node16->base.width);
   return idx != 0 ? (nsd_node_t **)&node16->children[ idx - 1 ] : NULL;
 }
 
@@ -221,17 +452,20 @@ find_child4(const nsd_node4_t *node4, uint8_t key)
   return NULL;
 }
 
+/* simd selects the vector kernels, see @nsd_tree_t */
 static nsd_node_t **
-find_child(const nsd_node_t *node, uint8_t key)
+find_child(uint32_t simd, const nsd_node_t *node, uint8_t key)
 {
   assert(node != NULL);
   switch (node->type) {
     case nsd_node4:
       return find_child4((const nsd_node4_t *)node, key);
     case nsd_node16:
-      return find_child16((const nsd_node16_t *)node, key);
+      return find_child16(simd, (const nsd_node16_t *)node, key);
+    case nsd_node17:
+      return find_child17((const nsd_node17_t *)node, key);
     case nsd_node32:
-      return find_child32((const nsd_node32_t *)node, key);
+      return find_child32(simd, (const nsd_node32_t *)node, key);
     case nsd_node38:
       return find_child38((const nsd_node38_t *)node, key);
     case nsd_node48:
@@ -245,240 +479,665 @@ find_child(const nsd_node_t *node, uint8_t key)
   abort();
 }
 
-static inline nsd_node_t **
-add_child256(nsd_node_t **noderef, uint8_t key, nsd_node_t *node)
+/* first key in use, -1 if none */
+static inline int
+bitmap_first(const uint64_t *bitmap)
 {
-  nsd_node256_t *node256 = (nsd_node256_t *)*noderef;
-
-  assert(node256 != NULL);
-  assert(node256->base.type == nsd_node256);
-  assert(node256->children[key] == NULL);
-
-  node256->base.width++;
-  node256->children[key] = node;
+  for (int word = 0; word < NSD_BITMAP_WORDS; word++) {
+    if (bitmap[word]) {
+      return word * 64 + __builtin_ctzll(bitmap[word]);
+    }
+  }
 
-  return &node256->children[key];
+  return -1;
 }
 
-static inline nsd_node_t **
-add_child48(nsd_node_t **noderef, uint8_t key, nsd_node_t *node)
+/* Only the first NSD_MAX_PREFIX octets of a prefix are stored in the node,
+ * the remaining octets are equal for every key in the subtree and are read
+ * from the key of any leaf under the node. Concurrent writers can empty a
+ * node that is read optimistically, NULL is returned in that case.
+ */
+static const nsd_leaf_t *
+any_leaf(const nsd_node_t *node)
 {
-  nsd_node48_t *node48 = (nsd_node48_t *)*noderef;
+  while (node != NULL && !nsd_is_leaf(node)) {
+    nsd_node_t *const *children;
+    int idx = 0;
 
-  assert(node48 != NULL);
-  assert(node48->base.type == nsd_node48);
-
-  if (node48->base.width == 48) {
-    uint8_t cnt, idx;
-    nsd_node256_t *node256;
-
-    if ((node256 = alloc_node(nsd_node256)) == NULL) {
-      return NULL;
-    }
-    copy_header((nsd_node_t *)node256, (nsd_node_t *)node48);
-    for (idx = 0, cnt = 0; idx < 256; idx++) {
-      if (node48->keys[idx] != 0) {
-        node256->children[idx] = node48->children[node48->keys[idx] - 1];
-        if (++cnt == node48->base.width) {
-          break;
+    switch (node->type) {
+      case nsd_node4:
+        children = ((const nsd_node4_t *)node)->children;
+        break;
+      case nsd_node16:
+        children = ((const nsd_node16_t *)node)->children;
+        break;
+      case nsd_node17: {
+        const nsd_node17_t *node17 = (const nsd_node17_t *)node;
+        children = node17->children;
+        idx = node17->bitmap ? __builtin_ctz(node17->bitmap) : 0;
+        break;
+      }
+      case nsd_node32:
+        children = ((const nsd_node32_t *)node)->children;
+        break;
+      case nsd_node38: {
+        const nsd_node38_t *node38 = (const nsd_node38_t *)node;
+        children = node38->children;
+        idx = node38->bitmap ? __builtin_ctzll(node38->bitmap) : 0;
+        break;
+      }
+      case nsd_node48: {
+        const nsd_node48_t *node48 = (const nsd_node48_t *)node;
+        if ((idx = bitmap_first(node48->bitmap)) == -1 ||
+            node48->keys[idx] == 0)
+        {
+          return NULL;
+        }
+        children = node48->children;
+        idx = node48->keys[idx] - 1;
+        break;
+      }
+      case nsd_node256: {
+        const nsd_node256_t *node256 = (const nsd_node256_t *)node;
+        if ((idx = bitmap_first(node256->bitmap)) == -1) {
+          return NULL;
         }
+        children = node256->children;
+        break;
       }
+      default:
+        abort();
     }
 
-    assert(cnt == node48->base.width);
-    *noderef = (nsd_node_t *)node256;
-    free_node(node48);
-    return add_child256(noderef, key, node);
+    node = load_node((nsd_node_t **)&children[idx]);
   }
 
-  assert(node48->base.width < 48);
-  assert(node48->keys[key] == 0);
-  node48->keys[key] = ++node48->base.width;
-  node48->children[node48->base.width - 1] = node;
-  return &node48->children[node48->base.width - 1];
+  return node != NULL ? nsd_leaf_raw(node) : NULL;
 }
 
-static inline nsd_node_t **
-add_child38(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+/* full prefix of node, depth is that of the first octet of the prefix */
+static inline const uint8_t *
+load_prefix(const nsd_tree_t *tree, const nsd_node_t *node, uint8_t depth)
 {
-  uint8_t idx;
-  nsd_node38_t *node38 = (nsd_node38_t *)*noderef;
-
-  assert(node38 != NULL);
-  assert(node38->base.type == nsd_node38);
+  const nsd_leaf_t *leaf;
 
-  if ((idx = node38_xlat(key)) == (uint8_t)-1) {
-    uint8_t cnt;
-    nsd_node48_t *node48;
+  if (node->prefix_len <= NSD_MAX_PREFIX) {
+    return node->prefix;
+  } else if (tree->suffix_leaves) {
+    return node->long_prefix + 1;
+  }
+  leaf = any_leaf(node);
+  assert(leaf != NULL);
+  assert(leaf->depth == 0);
+  return leaf->key + depth;
+}
 
-    if ((node48 = alloc_node(nsd_node48)) == NULL) {
-      return NULL;
-    }
-    copy_header((nsd_node_t *)node48, (nsd_node_t *)node38);
-    for (idx = 0, cnt = 0; idx < 38; idx++) {
-      if (node38->children[idx] != NULL) {
-        node48->children[cnt++] = node38->children[idx];
-        node48->keys[ node38_unxlat(idx) ] = cnt;
-        if (cnt == node38->base.width) {
-          break;
-        }
-      }
-    }
+/* number of octets of prefix that match key from depth */
+static inline uint8_t
+match_prefix(
+  const nsd_tree_t *tree,
+  const nsd_node_t *node,
+  const uint8_t *key,
+  uint8_t key_len,
+  uint8_t depth)
+{
+  uint8_t cnt, len = node->prefix_len;
 
-    assert(cnt == node38->base.width);
-    *noderef = (nsd_node_t *)node48;
-    free_node(node38);
-    return add_child48(noderef, key, child);
+  if (len <= NSD_MAX_PREFIX || tree->suffix_leaves) {
+    return compare_keys(
+      key + depth, key_len - depth, load_prefix(tree, node, depth), len);
   }
-
-  assert(node38->base.width < 38);
-  assert(node38->children[idx] == NULL);
-  node38->children[idx] = child;
-  node38->base.width++;
-  return &node38->children[idx];
+  cnt = compare_keys(key + depth, key_len - depth, node->prefix, NSD_MAX_PREFIX);
+  if (cnt != NSD_MAX_PREFIX) {
+    return cnt;
+  }
+  return compare_keys(
+    key + depth, key_len - depth, load_prefix(tree, node, depth), len);
 }
 
-static nsd_node_t **
-add_child32(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+/* prefixes are compared in full in trees with suffix leaves */
+static inline bool
+skips_prefix(const nsd_tree_t *tree, const nsd_node_t *node)
 {
-#if HAVE_AVX2
-  uint8_t idx;
-  nsd_node32_t *node32 = (nsd_node32_t *)*noderef;
+  return node->prefix_len > NSD_MAX_PREFIX && !tree->suffix_leaves;
+}
 
-  assert(node32 != NULL);
-  assert(node32->base.type == nsd_node32);
+/* Lookups compare stored octets only, octets that are skipped are verified
+ * once a leaf is reached. Returns false if the key cannot be in the subtree.
+ */
+static inline bool
+skip_prefix(
+  const nsd_tree_t *tree,
+  const nsd_node_t *node,
+  const uint8_t *key,
+  uint8_t key_len,
+  uint8_t depth)
+{
+  uint8_t len = node->prefix_len;
+  const uint8_t *prefix = node->prefix;
 
-  if (node32->base.width == 32) {
-    uint8_t cnt;
-    nsd_node38_t *node38;
-    nsd_node48_t *node48;
-    int ishost = (node38_xlat(key) != (uint8_t)-1);
+  /* keys cannot be prefixes, the prefix is followed by at least one octet */
+  if (len >= key_len - depth) {
+    return false;
+  } else if (len > NSD_MAX_PREFIX) {
+    if (tree->suffix_leaves) {
+      prefix = node->long_prefix + 1;
+    } else {
+      len = NSD_MAX_PREFIX;
+    }
+  }
+  return compare_keys(key + depth, len, prefix, len) == len;
+}
 
-    for (idx = 0; ishost && idx < 32; idx++) {
-      ishost = (node38_xlat(node32->keys[idx]) != (uint8_t)-1);
+/* set prefix of node that has no prefix stored out of line, returns false
+   if out of memory */
+static inline bool
+set_prefix(
+  nsd_tree_t *tree, nsd_node_t *node, const uint8_t *prefix, uint8_t len)
+{
+  if (tree->suffix_leaves && len > NSD_MAX_PREFIX) {
+    uint8_t *buffer = tree->allocator.allocate(tree->allocator.arg, 1u + len);
+    if (buffer == NULL) {
+      return false;
     }
+    buffer[0] = len;
+    memcpy(buffer + 1, prefix, len);
+    node->long_prefix = buffer;
+  } else {
+    /* prefix may be stored in node */
+    memmove(node->prefix, prefix, len < NSD_MAX_PREFIX ? len : NSD_MAX_PREFIX);
+  }
+  node->prefix_len = len;
+  return true;
+}
 
-    if (ishost) {
-      if ((node38 = alloc_node(nsd_node38)) == NULL) {
-        return NULL;
-      }
+/* remove cnt octets from the start of the prefix of a node, readers must
+   not access the prefix, depth is that of the first octet, never allocates */
+static void
+cut_prefix(nsd_tree_t *tree, nsd_node_t *node, uint8_t depth, uint8_t cnt)
+{
+  uint8_t len = node->prefix_len - cnt;
 
-      copy_header((nsd_node_t *)node38, (nsd_node_t *)node32);
-      for (idx = 0; idx < 32; idx++) {
-         node38->children[ node38_xlat(node32->keys[idx]) ]
-           = node32->children[idx];
-      }
-      *noderef = (nsd_node_t *)node38;
-      free_node(node32);
-      return add_child38(noderef, key, child);
+  if (long_prefix(tree, node)) {
+    uint8_t *buffer = node->long_prefix;
+    if (len > NSD_MAX_PREFIX) {
+      memmove(buffer + 1, buffer + 1 + cnt, len);
     } else {
-      if ((node48 = alloc_node(nsd_node48)) == NULL) {
-        return NULL;
-      }
-
-      copy_header((nsd_node_t *)node48, (nsd_node_t *)node32);
-      for (idx = 0, cnt = 0; idx < 32; idx++) {
-        node48->children[cnt++] = node32->children[idx];
-        node48->keys[ node32->keys[idx] ] = cnt;
-      }
-      *noderef = (nsd_node_t *)node48;
-      free_node(node32);
-      return add_child48(noderef, key, child);
+      memcpy(node->prefix, buffer + 1 + cnt, len);
+      release_prefix(tree, buffer);
     }
+    node->prefix_len = len;
+  } else {
+    (void)set_prefix(tree, node, load_prefix(tree, node, depth) + cnt, len);
   }
 
-  assert(node32->base.width < 32);
+  if (len == 0) {
+    memset(node->prefix, 0, sizeof(node->prefix));
+  }
+}
 
-  idx = nsd_v32_findgt_u8(key, node32->keys, node32->base.width);
-  if (idx != 0) {
-    assert(idx < node32->base.width);
-    memmove(&node32->keys[idx + 1],
-            &node32->keys[idx],
-            sizeof(uint8_t) * (node32->base.width - idx));
-    memmove(&node32->children[idx + 1],
-            &node32->children[idx],
-            sizeof(void*) * (node32->base.width - idx));
-  } else {
-    idx = node32->base.width;
+/* depth of octet that selects a child of the node at specified level */
+static inline uint8_t
+child_depth(const nsd_path_t *path, uint8_t level, const nsd_node_t *node)
+{
+  return (level != 0 ? path->levels[level].depth + 1 : 0) + node->prefix_len;
+}
+
+/* Strip levels from the first node with a prefix that does not match, cnt
+ * is the number of octets key has in common with a leaf under the node at
+ * the top of the path. A failed lookup yields the same path as it would if
+ * every prefix had been compared in full.
+ */
+static void
+trim_path(nsd_path_t *path, uint8_t cnt)
+{
+  for (uint8_t level = 0; level < path->height; level++) {
+    const nsd_node_t *node = load_node(path->levels[level].noderef);
+    if (nsd_is_leaf(node) || child_depth(path, level, node) > cnt) {
+      path->height = level;
+      break;
+    }
   }
+}
 
-  node32->keys[idx] = key;
-  node32->children[idx] = child;
-  node32->base.width++;
+/* octet that selects the child at childref */
+static uint8_t
+child_key(const nsd_node_t *node, nsd_node_t *const *childref)
+{
+  switch (node->type) {
+    case nsd_node4: {
+      const nsd_node4_t *node4 = (const nsd_node4_t *)node;
+      return node4->keys[childref - node4->children];
+    }
+    case nsd_node16: {
+      const nsd_node16_t *node16 = (const nsd_node16_t *)node;
+      return node16->keys[childref - node16->children];
+    }
+    case nsd_node17:
+      return node17_unxlat(
+        (uint8_t)(childref - ((const nsd_node17_t *)node)->children));
+    case nsd_node32: {
+      const nsd_node32_t *node32 = (const nsd_node32_t *)node;
+      return node32->keys[childref - node32->children];
+    }
+    case nsd_node38:
+      return node38_unxlat(
+        (uint8_t)(childref - ((const nsd_node38_t *)node)->children));
+    case nsd_node48: {
+      const nsd_node48_t *node48 = (const nsd_node48_t *)node;
+      uint8_t idx = (uint8_t)(childref - node48->children) + 1;
+      for (uint8_t word = 0; word < NSD_BITMAP_WORDS; word++) {
+        for (uint64_t bits = node48->bitmap[word]; bits; bits &= bits - 1) {
+          uint8_t key = word * 64 + __builtin_ctzll(bits);
+          if (node48->keys[key] == idx) {
+            return key;
+          }
+        }
+      }
+      break;
+    }
+    case nsd_node256:
+      return (uint8_t)(childref - ((const nsd_node256_t *)node)->children);
+    default:
+      break;
+  }
 
-  return &node32->children[idx];
-#else
   abort();
-#endif /* HAVE_AVX2 */
 }
 
-static nsd_node_t **
-add_child16(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+/* Leaves in trees with suffix leaves do not store the octets that selected
+ * the levels of the path to them, the octets are read from the nodes in the
+ * path instead. Octets up to and including the one that selected the top
+ * level are written to key.
+ */
+static void
+load_path_key(const nsd_tree_t *tree, const nsd_path_t *path, uint8_t *key)
 {
-  uint8_t idx;
-  nsd_node16_t *node16 = (nsd_node16_t *)*noderef;
+  for (uint8_t level = 1; level < path->height; level++) {
+    const nsd_node_t *node = load_node(path->levels[level - 1].noderef);
+    uint8_t depth = path->levels[level].depth - node->prefix_len;
+    if (node->prefix_len != 0) {
+      memcpy(key + depth, load_prefix(tree, node, depth), node->prefix_len);
+    }
+    key[path->levels[level].depth] =
+      child_key(node, path->levels[level].noderef);
+  }
+}
 
-  assert(node16 != NULL);
-  assert(node16->base.type == nsd_node16);
+/* Strip levels selected by octets that key does not share with the key the
+ * path was recorded for. Every leaf under the node at the top of the path
+ * shares the octets that selected the levels, the remaining levels are
+ * therefore exactly those a descent for key would record.
+ */
+static void
+rewind_path(
+  const nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+{
+  const nsd_node_t *node;
+  const nsd_leaf_t *leaf;
+  uint8_t cnt, len;
 
-  if (node16->base.width == 16) {
-#if HAVE_AVX2
-    nsd_node32_t *node32;
+  if (path->height <= 1) {
+    return;
+  }
 
-    if ((node32 = alloc_node(nsd_node32)) == NULL) {
-      return NULL;
-    }
+  /* leaves do not store the octets that selected the levels, comparing
+     octets of nodes in the path costs as much as a descent from the root */
+  if (tree->suffix_leaves) {
+    path->height = 1;
+    return;
+  }
 
-    copy_header((nsd_node_t *)node32, (nsd_node_t *)node16);
-    memcpy(node32->keys, node16->keys, sizeof(uint8_t) * 16);
-    memcpy(node32->children, node16->children, sizeof(void *) * 16);
-    *noderef = (nsd_node_t *)node32;
-    free_node(node16);
-    return add_child32(noderef, key, child);
-#else
-    int ishost = (node38_xlat(key) != (uint8_t)-1);
+  node = load_node(path->levels[path->height - 1].noderef);
+  leaf = nsd_is_leaf(node) ? nsd_leaf_raw(node) : any_leaf(node);
+  if (leaf == NULL) {
+    path->height = 1;
+    return;
+  }
 
-    for (idx = 0; ishost && idx < node16->base.width; idx++) {
-      ishost = (node38_xlat(node16->keys[idx]) != (uint8_t)-1);
-    }
+  /* octets beyond the depth of the top level do not select levels */
+  len = path->levels[path->height - 1].depth + 1;
+  if (key_len < len) {
+    len = key_len;
+  }
+  cnt = compare_keys(key, len, leaf->key, leaf->key_len);
+  while (path->height > 1 && path->levels[path->height - 1].depth >= cnt) {
+    path->height--;
+  }
+}
 
-    if (ishost) {
-      nsd_node38_t *node38;
-      if ((node38 = alloc_node(nsd_node38)) == NULL) {
-        return NULL;
-      }
+/* verify prefixes skipped in lookup */
+static nsd_retcode_t
+verify_path(nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  const nsd_node_t *node = load_node(path->levels[path->height - 1].noderef);
+  const nsd_leaf_t *leaf;
+  uint8_t cnt;
+
+  leaf = nsd_is_leaf(node) ? nsd_leaf_raw(node) : any_leaf(node);
+  assert(leaf != NULL);
+  /* prefixes are not skipped in trees with suffix leaves */
+  assert(leaf->depth == 0);
+  cnt = compare_keys(key, key_len, leaf->key, leaf->key_len);
+  if (cnt == key_len && nsd_is_leaf(node)) {
+    assert(key_len == leaf->key_len);
+    return nsd_ok;
+  }
+  trim_path(path, cnt);
+  return nsd_not_found;
+}
+
+/* collect keys and children in order */
+static uint8_t
+gather_children(const nsd_node_t *node, uint8_t *keys, nsd_node_t **children)
+{
+  uint8_t cnt = 0;
 
-      copy_header((nsd_node_t *)node38, (nsd_node_t *)node16);
-      for (idx = 0; idx < 16; idx++) {
-        node38->children[ node38_xlat(node16->keys[idx]) ]
-          = node16->children[idx];
+  switch (node->type) {
+    case nsd_node4:
+      cnt = node->width;
+      memcpy(keys, ((nsd_node4_t *)node)->keys, cnt);
+      memcpy(children, ((nsd_node4_t *)node)->children, cnt * sizeof(void *));
+      break;
+    case nsd_node16:
+      cnt = node->width;
+      memcpy(keys, ((nsd_node16_t *)node)->keys, cnt);
+      memcpy(children, ((nsd_node16_t *)node)->children, cnt * sizeof(void *));
+      break;
+    case nsd_node17:
+      for (uint32_t bits = ((nsd_node17_t *)node)->bitmap; bits; bits &= bits - 1) {
+        uint8_t idx = __builtin_ctz(bits);
+        keys[cnt] = node17_unxlat(idx);
+        children[cnt++] = ((nsd_node17_t *)node)->children[idx];
       }
-      *noderef = (nsd_node_t *)node38;
-      free_node(node16);
-      return add_child38(noderef, key, child);
-    } else {
-      nsd_node48_t *node48;
-      if ((node48 = alloc_node(nsd_node48)) == NULL) {
-        return NULL;
+      break;
+    case nsd_node32:
+      cnt = node->width;
+      memcpy(keys, ((nsd_node32_t *)node)->keys, cnt);
+      memcpy(children, ((nsd_node32_t *)node)->children, cnt * sizeof(void *));
+      break;
+    case nsd_node38:
+      for (uint64_t bits = ((nsd_node38_t *)node)->bitmap; bits; bits &= bits - 1) {
+        uint8_t idx = __builtin_ctzll(bits);
+        keys[cnt] = node38_unxlat(idx);
+        children[cnt++] = ((nsd_node38_t *)node)->children[idx];
       }
+      break;
+    case nsd_node48:
+      for (uint8_t word = 0; word < NSD_BITMAP_WORDS; word++) {
+        uint64_t bits = ((nsd_node48_t *)node)->bitmap[word];
+        for (; bits; bits &= bits - 1) {
+          uint8_t key = word * 64 + __builtin_ctzll(bits);
+          keys[cnt] = key;
+          children[cnt++] =
+            ((nsd_node48_t *)node)->children[((nsd_node48_t *)node)->keys[key] - 1];
+        }
+      }
+      break;
+    case nsd_node256:
+      for (uint8_t word = 0; word < NSD_BITMAP_WORDS; word++) {
+        uint64_t bits = ((nsd_node256_t *)node)->bitmap[word];
+        for (; bits; bits &= bits - 1) {
+          uint8_t key = word * 64 + __builtin_ctzll(bits);
+          keys[cnt] = key;
+          children[cnt++] = ((nsd_node256_t *)node)->children[key];
+        }
+      }
+      break;
+    default:
+      abort();
+  }
+
+  assert(cnt == node->width);
+  return cnt;
+}
+
+#define BITMAP_SET(bitmap, key) \
+  ((bitmap)[(key) / 64] |= (1ull << ((key) % 64)))
+#define BITMAP_CLEAR(bitmap, key) \
+  ((bitmap)[(key) / 64] &= ~(1ull << ((key) % 64)))
 
-      copy_header((nsd_node_t *)node48, (nsd_node_t *)node);
-      for (idx = 0, cnt = 0; idx < 16; idx++) {
-        node48->children[cnt++] = node16->children[idx];
-        node48->keys[ node16->keys[idx] ] = cnt;
+/* store sorted keys and children in node of specified type */
+static void
+fill_node(
+  nsd_node_t *node,
+  const uint8_t *keys,
+  nsd_node_t *const *children,
+  uint8_t cnt)
+{
+  switch (node->type) {
+    case nsd_node4:
+      assert(cnt <= 4);
+      memcpy(((nsd_node4_t *)node)->keys, keys, cnt);
+      memcpy(((nsd_node4_t *)node)->children, children, cnt * sizeof(void *));
+      break;
+    case nsd_node16:
+      assert(cnt <= 16);
+      memcpy(((nsd_node16_t *)node)->keys, keys, cnt);
+      memcpy(((nsd_node16_t *)node)->children, children, cnt * sizeof(void *));
+      break;
+    case nsd_node17:
+      assert(cnt <= 17);
+      for (uint8_t idx = 0; idx < cnt; idx++) {
+        uint8_t pos = node17_xlat(keys[idx]);
+        assert(pos != (uint8_t)-1);
+        ((nsd_node17_t *)node)->bitmap |= (1u << pos);
+        ((nsd_node17_t *)node)->children[pos] = children[idx];
+      }
+      break;
+    case nsd_node32:
+      assert(cnt <= 32);
+      memcpy(((nsd_node32_t *)node)->keys, keys, cnt);
+      memcpy(((nsd_node32_t *)node)->children, children, cnt * sizeof(void *));
+      break;
+    case nsd_node38:
+      assert(cnt <= 38);
+      for (uint8_t idx = 0; idx < cnt; idx++) {
+        uint8_t pos = node38_xlat(keys[idx]);
+        assert(pos != (uint8_t)-1);
+        ((nsd_node38_t *)node)->bitmap |= (1ull << pos);
+        ((nsd_node38_t *)node)->children[pos] = children[idx];
+      }
+      break;
+    case nsd_node48:
+      assert(cnt <= 48);
+      for (uint8_t idx = 0; idx < cnt; idx++) {
+        BITMAP_SET(((nsd_node48_t *)node)->bitmap, keys[idx]);
+        ((nsd_node48_t *)node)->keys[ keys[idx] ] = idx + 1;
+        ((nsd_node48_t *)node)->children[idx] = children[idx];
+      }
+      break;
+    case nsd_node256:
+      for (uint8_t idx = 0; idx < cnt; idx++) {
+        BITMAP_SET(((nsd_node256_t *)node)->bitmap, keys[idx]);
+        ((nsd_node256_t *)node)->children[ keys[idx] ] = children[idx];
       }
-      *noderef = (nsd_node_t *)node48;
-      free_node(node16);
-      return add_child48(noderef, key, child);
+      break;
+    default:
+      abort();
+  }
+}
+
+/* replace node by node of specified type, leave node as is on failure */
+static nsd_node_t *
+convert_node(nsd_tree_t *tree, nsd_node_t **noderef, nsd_node_type_t type)
+{
+  uint8_t cnt;
+  uint8_t keys[NSD_MAX_WIDTH];
+  nsd_node_t *children[NSD_MAX_WIDTH];
+  nsd_node_t *node;
+
+  if ((node = alloc_node(tree, type)) == NULL) {
+    return NULL;
+  }
+
+  copy_header(node, *noderef);
+  cnt = gather_children(*noderef, keys, children);
+  fill_node(node, keys, children, cnt);
+
+  free_node(tree, *noderef);
+  *noderef = node;
+  return node;
+}
+
+static inline nsd_node_t **
+add_child256(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *node)
+{
+  nsd_node256_t *node256 = (nsd_node256_t *)*noderef;
+
+  (void)tree;
+  assert(node256 != NULL);
+  assert(node256->base.type == nsd_node256);
+  assert(node256->children[key] == NULL);
+
+  node256->base.width++;
+  node256->children[key] = node;
+  BITMAP_SET(node256->bitmap, key);
+
+  return &node256->children[key];
+}
+
+static inline nsd_node_t **
+add_child48(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *node)
+{
+  nsd_node48_t *node48 = (nsd_node48_t *)*noderef;
+
+  assert(node48 != NULL);
+  assert(node48->base.type == nsd_node48);
+
+  if (node48->base.width == 48) {
+    if (convert_node(tree, noderef, nsd_node256) == NULL) {
+      return NULL;
+    }
+    return add_child256(tree, noderef, key, node);
+  }
+
+  assert(node48->base.width < 48);
+  assert(node48->keys[key] == 0);
+  node48->keys[key] = ++node48->base.width;
+  node48->children[node48->base.width - 1] = node;
+  BITMAP_SET(node48->bitmap, key);
+  return &node48->children[node48->base.width - 1];
+}
+
+static inline nsd_node_t **
+add_child38(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+{
+  uint8_t idx;
+  nsd_node38_t *node38 = (nsd_node38_t *)*noderef;
+
+  assert(node38 != NULL);
+  assert(node38->base.type == nsd_node38);
+
+  if ((idx = node38_xlat(key)) == (uint8_t)-1) {
+    if (convert_node(tree, noderef, nsd_node48) == NULL) {
+      return NULL;
+    }
+    return add_child48(tree, noderef, key, child);
+  }
+
+  assert(node38->base.width < 38);
+  assert(node38->children[idx] == NULL);
+  node38->children[idx] = child;
+  node38->bitmap |= (1ull << idx);
+  node38->base.width++;
+  return &node38->children[idx];
+}
+
+/* pick node38 over node48 if all keys are hostname keys */
+static nsd_node_t **
+grow_node(
+  nsd_tree_t *tree,
+  nsd_node_t **noderef,
+  const uint8_t *keys,
+  uint8_t key,
+  nsd_node_t *child)
+{
+  int ishost = (node38_xlat(key) != (uint8_t)-1);
+
+  for (uint8_t idx = 0; ishost && idx < (*noderef)->width; idx++) {
+    ishost = (node38_xlat(keys[idx]) != (uint8_t)-1);
+  }
+
+  if (ishost) {
+    if (convert_node(tree, noderef, nsd_node38) == NULL) {
+      return NULL;
+    }
+    return add_child38(tree, noderef, key, child);
+  } else {
+    if (convert_node(tree, noderef, nsd_node48) == NULL) {
+      return NULL;
+    }
+    return add_child48(tree, noderef, key, child);
+  }
+}
+
+static nsd_node_t **
+add_child32(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+{
+  uint8_t idx;
+  nsd_node32_t *node32 = (nsd_node32_t *)*noderef;
+
+  assert(node32 != NULL);
+  assert(node32->base.type == nsd_node32);
+
+  if (node32->base.width == 32) {
+    return grow_node(tree, noderef, node32->keys, key, child);
+  }
+
+  assert(node32->base.width < 32);
+
+  idx = nsd_v32_findgt_u8(tree->simd, key, node32->keys, node32->base.width);
+  if (idx < node32->base.width) {
+    memmove(&node32->keys[idx + 1],
+            &node32->keys[idx],
+            sizeof(uint8_t) * (node32->base.width - idx));
+    memmove(&node32->children[idx + 1],
+            &node32->children[idx],
+            sizeof(void*) * (node32->base.width - idx));
+  }
+
+  node32->keys[idx] = key;
+  node32->children[idx] = child;
+  node32->base.width++;
+
+  return &node32->children[idx];
+}
+
+static nsd_node_t **
+add_child16(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+{
+  uint8_t idx;
+  nsd_node16_t *node16 = (nsd_node16_t *)*noderef;
+
+  assert(node16 != NULL);
+  assert(node16->base.type == nsd_node16);
+
+  if (node16->base.width == 16) {
+    nsd_node32_t *node32;
+
+    if (!use_node32(tree)) {
+      return grow_node(tree, noderef, node16->keys, key, child);
+    }
+    if ((node32 = alloc_node(tree, nsd_node32)) == NULL) {
+      return NULL;
     }
-#endif /* HAVE_AVX2 */
+
+    copy_header((nsd_node_t *)node32, (nsd_node_t *)node16);
+    memcpy(node32->keys, node16->keys, sizeof(uint8_t) * 16);
+    memcpy(node32->children, node16->children, sizeof(void *) * 16);
+    *noderef = (nsd_node_t *)node32;
+    free_node(tree, node16);
+    return add_child32(tree, noderef, key, child);
   }
 
   assert(node16->base.width < 16);
 
-  idx = nsd_v16_findgt_u8(key, node16->keys, node16->base.width);
-  if (idx) {
-    assert(idx < node16->base.width);
+  idx = nsd_v16_findgt_u8(tree->simd, key, node16->keys, node16->base.width);
+  if (idx < node16->base.width) {
     memmove(
       &node16->keys[idx + 1],
       &node16->keys[idx],
@@ -487,8 +1146,6 @@ add_child16(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
       &node16->children[idx + 1],
       &node16->children[idx],
       sizeof(nsd_node_t *) * (node16->base.width - idx));
-  } else {
-    idx = node16->base.width;
   }
 
   node16->keys[idx] = key;
@@ -499,14 +1156,70 @@ add_child16(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
 }
 
 static nsd_node_t **
-add_child4(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+add_child17(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+{
+  uint8_t idx;
+  nsd_node17_t *node17 = (nsd_node17_t *)*noderef;
+
+  assert(node17 != NULL);
+  assert(node17->base.type == nsd_node17);
+
+  if ((idx = node17_xlat(key)) == (uint8_t)-1) {
+    uint8_t keys[17];
+    nsd_node_t *children[17];
+
+    if (node17->base.width < 16) {
+      if (convert_node(tree, noderef, nsd_node16) == NULL) {
+        return NULL;
+      }
+      return add_child16(tree, noderef, key, child);
+    } else if (use_node32(tree)) {
+      if (convert_node(tree, noderef, nsd_node32) == NULL) {
+        return NULL;
+      }
+      return add_child32(tree, noderef, key, child);
+    }
+    (void)gather_children(*noderef, keys, children);
+    return grow_node(tree, noderef, keys, key, child);
+  }
+
+  assert(node17->base.width < 17);
+  assert(node17->children[idx] == NULL);
+  node17->children[idx] = child;
+  node17->bitmap |= (1u << idx);
+  node17->base.width++;
+  return &node17->children[idx];
+}
+
+/* node4 grows into node17 rather than node16 if key and all keys are reverse
+   DNS keys */
+static bool
+is_reverse(const uint8_t *keys, uint8_t width, uint8_t key)
+{
+  bool isreverse = (node17_xlat(key) != (uint8_t)-1);
+
+  for (uint8_t idx = 0; isreverse && idx < width; idx++) {
+    isreverse = (node17_xlat(keys[idx]) != (uint8_t)-1);
+  }
+
+  return isreverse;
+}
+
+static nsd_node_t **
+add_child4(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
 {
   uint8_t idx = 0;
   nsd_node4_t *node4 = (nsd_node4_t *)*noderef;
   nsd_node16_t *node16;
 
   if (node4->base.width == 4) {
-    if ((node16 = alloc_node(nsd_node16)) == NULL) {
+    if (is_reverse(node4->keys, 4, key)) {
+      if (convert_node(tree, noderef, nsd_node17) == NULL) {
+        return NULL;
+      }
+      return add_child17(tree, noderef, key, child);
+    }
+    if ((node16 = alloc_node(tree, nsd_node16)) == NULL) {
       return NULL;
     }
 
@@ -514,8 +1227,8 @@ add_child4(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
     memcpy(node16->keys, node4->keys, sizeof(uint8_t) * 4);
     memcpy(node16->children, node4->children, sizeof(void*) * 4);
     *noderef = (nsd_node_t *)node16;
-    free_node(node4);
-    return add_child16(noderef, key, child);
+    free_node(tree, node4);
+    return add_child16(tree, noderef, key, child);
   }
 
   assert(node4->base.width < 4);
@@ -542,22 +1255,24 @@ add_child4(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
 }
 
 static nsd_node_t **
-add_child(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
+add_child(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
 {
   assert(noderef != NULL);
   switch ((*noderef)->type) {
     case nsd_node4:
-      return add_child4(noderef, key, child);
+      return add_child4(tree, noderef, key, child);
     case nsd_node16:
-      return add_child16(noderef, key, child);
+      return add_child16(tree, noderef, key, child);
+    case nsd_node17:
+      return add_child17(tree, noderef, key, child);
     case nsd_node32:
-      return add_child32(noderef, key, child);
+      return add_child32(tree, noderef, key, child);
     case nsd_node38:
-      return add_child38(noderef, key, child);
+      return add_child38(tree, noderef, key, child);
     case nsd_node48:
-      return add_child48(noderef, key, child);
+      return add_child48(tree, noderef, key, child);
     case nsd_node256:
-      return add_child256(noderef, key, child);
+      return add_child256(tree, noderef, key, child);
     default:
       break;
   }
@@ -565,85 +1280,479 @@ add_child(nsd_node_t **noderef, uint8_t key, nsd_node_t *child)
   abort();
 }
 
-nsd_retcode_t
-nsd_find_path(
-  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+/* Nodes are demoted once their width drops well below the capacity of the
+ * next smaller type. The gap avoids reallocating a node every time a key is
+ * inserted and removed again around the boundary.
+ */
+#define NODE256_SHRINK (40) /* node48 at 48 */
+#define NODE48_SHRINK(tree) \
+  (use_node32(tree) ? 28 /* node32 at 32 */ : 12 /* node16 at 16 */)
+#define NODE38_SHRINK(tree) NODE48_SHRINK(tree)
+#define NODE32_SHRINK (12) /* node16 at 16 */
+#define NODE17_SHRINK (3) /* node4 at 4 */
+#define NODE16_SHRINK (3) /* node4 at 4 */
+
+static inline void
+remove_child256(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
 {
-  uint8_t depth = 0;
-  nsd_node_t **childref, **noderef;
+  nsd_node256_t *node256 = (nsd_node256_t *)*noderef;
 
-  assert(tree != NULL);
-  assert(path != NULL);
-  assert(key_len != 0);
+  assert(node256->children[key] != NULL);
+  node256->children[key] = NULL;
+  BITMAP_CLEAR(node256->bitmap, key);
+  node256->base.width--;
 
-  if (path->height == 0) {
-    path->levels[0].depth = depth;
-    path->levels[0].noderef = &tree->root;
-    path->height++;
-  } else {
-    assert(path->levels[0].depth == 0);
-    assert(path->levels[0].noderef == &tree->root);
-    depth = path->levels[path->height - 1].depth;
+  if (node256->base.width <= NODE256_SHRINK) {
+    (void)convert_node(tree, noderef, nsd_node48);
   }
+}
 
-  assert(key_len >= path->levels[path->height - 1].depth);
+static inline void
+remove_child48(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node48_t *node48 = (nsd_node48_t *)*noderef;
 
-  while (depth < key_len) {
-    noderef = path->levels[path->height - 1].noderef;
-    if (nsd_is_leaf(*noderef)) {
-      uint8_t cnt;
-      nsd_leaf_t *leaf = nsd_leaf_raw(*noderef);
+  assert(node48->keys[key] != 0);
+  idx = node48->keys[key] - 1;
+  node48->keys[key] = 0;
+  BITMAP_CLEAR(node48->bitmap, key);
+  node48->base.width--;
 
-      assert(key_len >= leaf->key_len);
-      cnt = compare_keys(key, key_len, leaf->key, leaf->key_len);
-      assert(cnt >= depth);
-      if (cnt == key_len) {
-        /* keys cannot be prefixes */
-        assert(key_len == leaf->key_len);
-        return nsd_ok;
-      } else {
-        /* discard node from path */
-        path->height--;
-        return nsd_not_found;
+  /* keep children contiguous, move last child into the gap */
+  if (idx != node48->base.width) {
+    for (uint16_t last = 0; last < NSD_MAX_WIDTH; last++) {
+      if (node48->keys[last] == node48->base.width + 1) {
+        node48->keys[last] = idx + 1;
+        break;
       }
-    } else if ((*noderef)->prefix_len != 0) {
-      uint8_t cnt;
+    }
+    node48->children[idx] = node48->children[node48->base.width];
+  }
+  node48->children[node48->base.width] = NULL;
 
-      cnt = compare_keys(
-        key + depth, key_len - depth, (*noderef)->prefix, (*noderef)->prefix_len);
-      if (cnt == (*noderef)->prefix_len) {
-        depth += cnt;
-      } else {
-        /* discard node from path */
-        path->height--;
-        return nsd_not_found;
+  if (node48->base.width <= NODE48_SHRINK(tree)) {
+    (void)convert_node(
+      tree, noderef, use_node32(tree) ? nsd_node32 : nsd_node16);
+  }
+}
+
+static inline void
+remove_child38(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node38_t *node38 = (nsd_node38_t *)*noderef;
+
+  idx = node38_xlat(key);
+  assert(idx != (uint8_t)-1);
+  assert(node38->children[idx] != NULL);
+  node38->children[idx] = NULL;
+  node38->bitmap &= ~(1ull << idx);
+  node38->base.width--;
+
+  if (node38->base.width <= NODE38_SHRINK(tree)) {
+    (void)convert_node(
+      tree, noderef, use_node32(tree) ? nsd_node32 : nsd_node16);
+  }
+}
+
+static inline void
+remove_child32(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node32_t *node32 = (nsd_node32_t *)*noderef;
+
+  idx = nsd_v32_findeq_u8(tree->simd, key, node32->keys, node32->base.width);
+  assert(idx != 0);
+  memmove(&node32->keys[idx - 1],
+          &node32->keys[idx],
+          sizeof(uint8_t) * (node32->base.width - idx));
+  memmove(&node32->children[idx - 1],
+          &node32->children[idx],
+          sizeof(void*) * (node32->base.width - idx));
+  node32->base.width--;
+
+  if (node32->base.width <= NODE32_SHRINK) {
+    (void)convert_node(tree, noderef, nsd_node16);
+  }
+}
+
+static inline void
+remove_child17(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node17_t *node17 = (nsd_node17_t *)*noderef;
+
+  idx = node17_xlat(key);
+  assert(idx != (uint8_t)-1);
+  assert(node17->children[idx] != NULL);
+  node17->children[idx] = NULL;
+  node17->bitmap &= ~(1u << idx);
+  node17->base.width--;
+
+  if (node17->base.width <= NODE17_SHRINK) {
+    (void)convert_node(tree, noderef, nsd_node4);
+  }
+}
+
+static inline void
+remove_child16(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node16_t *node16 = (nsd_node16_t *)*noderef;
+
+  idx = nsd_v16_findeq_u8(tree->simd, key, node16->keys, node16->base.width);
+  assert(idx != 0);
+  memmove(
+    &node16->keys[idx - 1],
+    &node16->keys[idx],
+    sizeof(uint8_t) * (node16->base.width - idx));
+  memmove(
+    &node16->children[idx - 1],
+    &node16->children[idx],
+    sizeof(nsd_node_t *) * (node16->base.width - idx));
+  node16->base.width--;
+
+  if (node16->base.width <= NODE16_SHRINK) {
+    (void)convert_node(tree, noderef, nsd_node4);
+  }
+}
+
+static inline void
+remove_child4(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  uint8_t idx;
+  nsd_node4_t *node4 = (nsd_node4_t *)*noderef;
+
+  (void)tree;
+  for (idx = 0; idx < node4->base.width && node4->keys[idx] != key; idx++) { }
+
+  assert(idx < node4->base.width);
+  memmove(
+    &node4->keys[idx],
+    &node4->keys[idx + 1],
+    sizeof(uint8_t) * (node4->base.width - (idx + 1)));
+  memmove(
+    &node4->children[idx],
+    &node4->children[idx + 1],
+    sizeof(void*) * (node4->base.width - (idx + 1)));
+  node4->base.width--;
+}
+
+static void
+remove_child(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t key)
+{
+  assert(noderef != NULL);
+  switch ((*noderef)->type) {
+    case nsd_node4:
+      remove_child4(tree, noderef, key);
+      return;
+    case nsd_node16:
+      remove_child16(tree, noderef, key);
+      return;
+    case nsd_node17:
+      remove_child17(tree, noderef, key);
+      return;
+    case nsd_node32:
+      remove_child32(tree, noderef, key);
+      return;
+    case nsd_node38:
+      remove_child38(tree, noderef, key);
+      return;
+    case nsd_node48:
+      remove_child48(tree, noderef, key);
+      return;
+    case nsd_node256:
+      remove_child256(tree, noderef, key);
+      return;
+    default:
+      break;
+  }
+
+  abort();
+}
+
+/* merge node4 with a single child into said child, depth is the depth at
+   which the node is found */
+static void
+collapse_node4(nsd_tree_t *tree, nsd_node_t **noderef, uint8_t depth)
+{
+  nsd_node4_t *node4 = (nsd_node4_t *)*noderef;
+  nsd_node_t *child;
+
+  assert(node4->base.type == nsd_node4);
+  assert(node4->base.width == 1);
+
+  child = node4->children[0];
+  if (nsd_is_leaf(child)) {
+    /* leaves do not store octets before the depth they were created at */
+    if (nsd_leaf_raw(child)->depth > depth) {
+      return;
+    }
+  } else {
+    uint8_t len, stored, prefix[NSD_MAX_HEIGHT];
+    nsd_node_t header = *child, *clone = NULL;
+
+    /* prefix of node, followed by key of child, followed by prefix of child,
+       only octets that are stored are required */
+    len = node4->base.prefix_len + 1 + child->prefix_len;
+    stored = node4->base.prefix_len;
+    if (!tree->suffix_leaves) {
+      stored = stored < NSD_MAX_PREFIX ? stored : NSD_MAX_PREFIX;
+      memcpy(prefix, node4->base.prefix, stored);
+      memcpy(prefix + stored + 1, child->prefix, NSD_MAX_PREFIX);
+    } else {
+      memcpy(prefix, load_prefix(tree, &node4->base, depth), stored);
+      memcpy(prefix + stored + 1,
+             load_prefix(tree, child, depth + stored + 1), child->prefix_len);
+    }
+    prefix[stored] = node4->keys[0];
+    /* child is not in path and therefore visible to readers */
+    if (tree->rcu != NULL && (clone = clone_node(tree, child)) == NULL) {
+      return;
+    }
+    if (!set_prefix(tree, clone != NULL ? clone : child, prefix, len)) {
+      if (clone != NULL) {
+        release_node(tree, clone);
       }
+      return;
+    }
+    free_prefix(tree, &header);
+    if (clone != NULL) {
+      free_node(tree, child);
+      child = clone;
     }
+  }
 
-    if ((childref = find_child(*noderef, key[depth])) == NULL) {
-      return nsd_not_found;
+  *noderef = child;
+  free_prefix(tree, &node4->base);
+  free_node(tree, node4);
+}
+
+/* Nodes in concurrent trees are read optimistically, i.e. the version is
+ * read before and validated after reading the node. Writers never hold a
+ * lock while waiting for another, a writer that cannot upgrade its read lock
+ * releases the locks it holds and restarts.
+ */
+static inline void
+olc_pause(void)
+{
+#if NSD_X86
+  __builtin_ia32_pause();
+#endif
+}
+
+/* returns false if node was replaced */
+static inline bool
+read_lock(const nsd_node_t *node, uint32_t *version)
+{
+  uint32_t value;
+
+  while ((value = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & NODE_LOCKED) {
+    olc_pause();
+  }
+
+  *version = value;
+  return (value & NODE_OBSOLETE) == 0;
+}
+
+/* returns false if node was modified since it was read locked */
+static inline bool
+read_unlock(const nsd_node_t *node, uint32_t version)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+static inline bool
+upgrade_lock(nsd_node_t *node, uint32_t version)
+{
+  return __atomic_compare_exchange_n(
+    &node->version, &version, version + NODE_LOCKED, false,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+write_unlock(nsd_node_t *node)
+{
+  __atomic_fetch_add(&node->version, NODE_LOCKED, __ATOMIC_RELEASE);
+}
+
+typedef enum {
+  olc_restart, /**< Node was modified during descent */
+  olc_found, /**< Last level is leaf for key */
+  olc_leaf, /**< Last level is leaf for another key */
+  olc_prefix, /**< Prefix of node at last level does not match */
+  olc_child /**< Node at last level has no child for key */
+} olc_result_t;
+
+typedef struct olc_state olc_state_t;
+struct olc_state {
+  nsd_node_t *nodes[NSD_MAX_HEIGHT]; /**< Node at every inner level */
+  uint32_t versions[NSD_MAX_HEIGHT];
+  uint8_t depth; /**< Depth at which descent stopped */
+};
+
+/* verify prefixes skipped in descent, report the first node with a prefix
+   that does not match if there is one */
+static olc_result_t
+olc_verify(
+  nsd_path_t *path,
+  olc_state_t *state,
+  const nsd_key_t key,
+  uint8_t key_len,
+  olc_result_t result)
+{
+  uint8_t cnt, height = path->height;
+  const nsd_leaf_t *leaf;
+
+  if (result == olc_leaf) {
+    leaf = nsd_leaf_raw(path->last);
+    height--;
+  } else if ((leaf = any_leaf(state->nodes[height - 1])) == NULL) {
+    return olc_restart;
+  }
+
+  /* prefixes are only consistent with the path if no node was modified */
+  cnt = compare_keys(key, key_len, leaf->key, leaf->key_len);
+  for (uint8_t level = 0; level < height; level++) {
+    const nsd_node_t *node = state->nodes[level];
+    bool diverges = child_depth(path, level, node) > cnt;
+    if (!read_unlock(node, state->versions[level])) {
+      return olc_restart;
+    } else if (diverges) {
+      path->height = level + 1;
+      state->depth = level != 0 ? path->levels[level].depth + 1 : 0;
+      return olc_prefix;
+    }
+  }
+
+  return result;
+}
+
+static olc_result_t
+olc_find(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  olc_state_t *state,
+  const nsd_key_t key,
+  uint8_t key_len)
+{
+  uint8_t depth = 0, level = 0;
+  bool skipped = false;
+  nsd_node_t *node, *child, **childref;
+
+  path->levels[0].depth = 0;
+  path->levels[0].noderef = &tree->root;
+  path->height = 1;
+
+  node = load_node(&tree->root);
+  if (!read_lock(node, &state->versions[0])) {
+    return olc_restart;
+  }
+
+  for (;;) {
+    uint32_t version = state->versions[level];
+
+    state->nodes[level] = node;
+    state->depth = depth;
+    if (node->prefix_len != 0) {
+      uint8_t len = node->prefix_len;
+      bool skips = skips_prefix(tree, node);
+      bool match = skip_prefix(tree, node, key, key_len, depth);
+
+      if (!read_unlock(node, version)) {
+        return olc_restart;
+      } else if (!match) {
+        return skipped
+          ? olc_verify(path, state, key, key_len, olc_prefix) : olc_prefix;
+      }
+      skipped = skipped || skips;
+      depth += len;
+      state->depth = depth;
+    }
+
+    assert(depth < key_len);
+    childref = find_child(tree->simd, node, key[depth]);
+    child = childref != NULL ? load_node(childref) : NULL;
+    if (!read_unlock(node, version)) {
+      return olc_restart;
+    } else if (child == NULL) {
+      return skipped
+        ? olc_verify(path, state, key, key_len, olc_child) : olc_child;
     }
 
     path->levels[path->height].depth = depth;
     path->levels[path->height].noderef = childref;
     path->height++;
+
+    if (nsd_is_leaf(child)) {
+      nsd_leaf_t *leaf = nsd_leaf_raw(child);
+
+      path->last = child;
+      path->levels[path->height - 1].noderef = &path->last;
+      if (compare_leaf(
+            leaf, key, key_len, skipped ? 0 : depth + 1) == key_len)
+      {
+        return olc_found;
+      }
+      return skipped
+        ? olc_verify(path, state, key, key_len, olc_leaf) : olc_leaf;
+    }
+
+    /* child may have been modified in place, e.g. by a split that inserts
+       a node above it, before it was read locked, which is only detected
+       by validating the parent again */
+    level++;
+    if (!read_lock(child, &state->versions[level]) ||
+        !read_unlock(node, version))
+    {
+      return olc_restart;
+    }
+    node = child;
     depth++;
   }
+}
 
-  return nsd_ok;
+/* last level refers to a copy, other levels are not dereferenced */
+static nsd_retcode_t
+olc_find_path(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  olc_state_t state;
+  olc_result_t result;
+
+  while ((result = olc_find(tree, path, &state, key, key_len)) == olc_restart) {
+    olc_pause();
+  }
+
+  if (result == olc_found) {
+    return nsd_ok;
+  } else if (result != olc_child) {
+    /* discard node from path */
+    path->height--;
+  }
+  path->last = state.nodes[path->height - 1];
+  path->levels[path->height - 1].noderef = &path->last;
+  return nsd_not_found;
 }
 
 nsd_retcode_t
-nsd_make_path(
+nsd_find_path(
   nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
 {
   uint8_t depth = 0;
-  nsd_node_t **childref, **noderef;
+  bool skipped = false;
+  nsd_node_t *node, **childref, **noderef;
 
   assert(tree != NULL);
   assert(path != NULL);
   assert(key_len != 0);
 
+  if (tree->concurrent) {
+    return olc_find_path(tree, path, key, key_len);
+  }
+
   if (path->height == 0) {
     path->levels[0].depth = depth;
     path->levels[0].noderef = &tree->root;
@@ -651,146 +1760,3150 @@ nsd_make_path(
   } else {
     assert(path->levels[0].depth == 0);
     assert(path->levels[0].noderef == &tree->root);
-    depth = path->levels[path->height - 1].depth;
+    /* root consumes first octet, other levels consume octet at depth */
+    if (path->height > 1) {
+      depth = path->levels[path->height - 1].depth + 1;
+    }
   }
 
   assert(key_len >= path->levels[path->height - 1].depth);
 
   while (depth < key_len) {
     noderef = path->levels[path->height - 1].noderef;
-    if (nsd_is_leaf(*noderef)) {
+    node = load_node(noderef);
+    if (nsd_is_leaf(node)) {
       uint8_t cnt;
-      nsd_leaf_t *leaf = nsd_leaf_raw(*noderef);
-
-      assert(key_len >= leaf->key_len);
-      cnt = compare_keys(key, key_len, leaf->key, leaf->key_len);
-      assert(cnt >= depth);
+      nsd_leaf_t *leaf = nsd_leaf_raw(node);
 
+      if (skipped) {
+        return verify_path(path, key, key_len);
+      }
+      cnt = compare_leaf(leaf, key, key_len, depth);
       if (cnt == key_len) {
-        /* match */
-        /* duplicates can exist but keys cannot be prefixes */
+        /* keys cannot be prefixes */
         assert(key_len == leaf->key_len);
         return nsd_ok;
       } else {
-        /* mismatch, split node. */
-        uint8_t len;
-        nsd_node_t **childref, *dummy, *node;
-        nsd_path_t relpath;
+        /* discard node from path */
+        path->height--;
+        return nsd_not_found;
+      }
+    } else if (node->prefix_len != 0) {
+      if (!skip_prefix(tree, node, key, key_len, depth)) {
+        if (skipped) {
+          return verify_path(path, key, key_len);
+        }
+        /* discard node from path */
+        path->height--;
+        return nsd_not_found;
+      }
+      skipped = skipped || skips_prefix(tree, node);
+      depth += node->prefix_len;
+    }
 
-        assert(cnt < key_len);
-        assert(cnt < leaf->key_len);
+    if ((childref = find_child(tree->simd, node, key[depth])) == NULL) {
+      return skipped ? verify_path(path, key, key_len) : nsd_not_found;
+    }
 
-        relpath.height = 0;
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    depth++;
+  }
 
-        /* take depth of *this* node for offset */
-        depth = path->levels[path->height - 1].depth;
-        while (depth < cnt) {
-          if ((node = alloc_node(nsd_node4)) == NULL) {
-            /* discard newly allocated nodes */
-            while (relpath.height > 0) {
-              free_node(*relpath.levels[--relpath.height].noderef);
-            }
-            return nsd_no_memory;
-          }
-          /* determine prefix length, exclude first octet */
-          len = cnt - depth;
-          if (len > NSD_MAX_PREFIX) {
-            len = NSD_MAX_PREFIX;
-          } else {
-            len--;
-          }
-          if (len > 0) {
-            memcpy(node->prefix, &key[1 + depth], len);
-            node->prefix_len = len;
-          }
-          if (relpath.height == 0) {
-            dummy = node;
-            childref = &dummy;
-          } else {
-            childref = add_child(
-              relpath.levels[ relpath.height - 1 ].noderef, key[depth], node);
-          }
-          relpath.levels[relpath.height].depth = depth;
-          relpath.levels[relpath.height].noderef = childref;
-          relpath.height++;
-          depth += 1 + len;
-        }
+  return skipped ? verify_path(path, key, key_len) : nsd_ok;
+}
 
-        assert(depth == cnt);
-        /* unlink leaf */
-        *noderef = *relpath.levels[0].noderef;
-        /* merge paths */
-        if (--relpath.height > 0) { /* skip dummy */
-          assert(path->height <= NSD_MAX_HEIGHT - relpath.height);
-          memcpy(&path->levels[path->height],
-                 &relpath.levels[1],
-                  relpath.height * sizeof(relpath.levels[1]));
-          path->height += relpath.height;
-        }
-        /* link leaf */
-        (void)add_child(
-          path->levels[path->height - 1].noderef, leaf->key[depth], SET_LEAF(leaf));
-      }
-    } else if ((*noderef)->prefix_len != 0) {
-      uint8_t cnt;
-      nsd_node_t *node;
+nsd_retcode_t
+nsd_find_path_from(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
 
-      cnt = compare_keys(
-        key + depth, key_len - depth, (*noderef)->prefix, (*noderef)->prefix_len);
-      assert(path->levels[path->height - 1].depth == depth - 1);
+  /* paths in concurrent trees cannot be resumed */
+  if (tree->concurrent) {
+    path->height = 0;
+  } else {
+    rewind_path(tree, path, key, key_len);
+  }
 
-      if (cnt != (*noderef)->prefix_len) {
-        /* mismatch, split node */
-        assert(cnt < key_len - depth);
-        assert(cnt < (*noderef)->prefix_len);
+  return nsd_find_path(tree, path, key, key_len);
+}
 
-        if ((node = alloc_node(nsd_node4)) == NULL) {
-          return nsd_no_memory;
-        }
+/* A key that exists is in the subtree of every node in the descent and is
+   compared in full at the leaf, hence prefixes that are skipped need not be
+   verified. Leaves in trees with suffix leaves are compared from the depth
+   at which they are found as prefixes are compared in full. Versions are
+   validated hand-over-hand as in olc_find. */
+static olc_result_t
+olc_find_leaf(
+  nsd_tree_t *tree, const nsd_key_t key, uint8_t key_len, nsd_leaf_t **leaf)
+{
+  uint8_t depth = 0;
+  uint32_t version, child_version;
+  nsd_node_t *node, *child, **childref;
 
-        node->prefix_len = cnt;
-        memcpy(node->prefix, (*noderef)->prefix, cnt);
-        /* link node */
-        add_child(&node, (*noderef)->prefix[cnt], *noderef);
-        /* determine prefix length, exclude first octet */
-        (*noderef)->prefix_len = (*noderef)->prefix_len - (1 + cnt);
-        if ((*noderef)->prefix_len != 0) {
-          memmove((*noderef)->prefix,
-                  (*noderef)->prefix + (1 + cnt),
-                  (*noderef)->prefix_len);
-        } else {
-          memset((*noderef)->prefix, 0, sizeof((*noderef)->prefix));
-        }
-        /* unlink node, link inner node */
-        *noderef = node;
+  node = load_node(&tree->root);
+  if (!read_lock(node, &version)) {
+    return olc_restart;
+  }
+
+  for (;;) {
+    if (node->prefix_len != 0) {
+      uint8_t len = node->prefix_len;
+      bool match = skip_prefix(tree, node, key, key_len, depth);
+
+      if (!read_unlock(node, version)) {
+        return olc_restart;
+      } else if (!match) {
+        return olc_prefix;
       }
-      depth += cnt;
+      depth += len;
     }
 
-    childref = find_child(*noderef, key[depth]);
-    if (childref != NULL) {
-      path->levels[path->height].depth = depth;
-      path->levels[path->height].noderef = childref;
-      path->height++;
-      depth++;
-    } else {
-      nsd_leaf_t *leaf;
+    assert(depth < key_len);
+    childref = find_child(tree->simd, node, key[depth]);
+    child = childref != NULL ? load_node(childref) : NULL;
+    if (!read_unlock(node, version)) {
+      return olc_restart;
+    } else if (child == NULL) {
+      return olc_child;
+    }
 
-      if ((leaf = make_leaf(key, key_len)) == NULL) {
-        return nsd_no_memory;
-      }
-      childref = add_child(noderef, key[depth], SET_LEAF(leaf));
-      if (childref == NULL) {
-        free_node(SET_LEAF(leaf));
-        return nsd_no_memory;
+    if (nsd_is_leaf(child)) {
+      nsd_leaf_t *raw = nsd_leaf_raw(child);
+      uint8_t from = tree->suffix_leaves ? depth + 1 : 0;
+      if (compare_leaf(raw, key, key_len, from) != key_len) {
+        return olc_leaf;
       }
+      *leaf = raw;
+      return olc_found;
+    }
 
-      path->levels[path->height].depth = depth;
-      path->levels[path->height].noderef = childref;
-      path->height++;
-      depth = key_len;
+    if (!read_lock(child, &child_version) || !read_unlock(node, version)) {
+      return olc_restart;
+    }
+    node = child;
+    version = child_version;
+    depth++;
+  }
+}
+
+nsd_retcode_t
+nsd_find(
+  nsd_tree_t *tree, const nsd_key_t key, uint8_t key_len, nsd_leaf_t **leaf)
+{
+  uint8_t depth = 0;
+  const nsd_node_t *node;
+  nsd_node_t **childref;
+  nsd_leaf_t *found = NULL;
+
+  assert(tree != NULL);
+  assert(key_len != 0);
+
+  if (tree->concurrent) {
+    olc_result_t result;
+    while ((result = olc_find_leaf(tree, key, key_len, &found)) == olc_restart) {
+      olc_pause();
+    }
+    if (result != olc_found) {
+      return nsd_not_found;
+    }
+  } else {
+    node = load_node(&tree->root);
+    while (!nsd_is_leaf(node)) {
+      if (node->prefix_len != 0) {
+        if (!skip_prefix(tree, node, key, key_len, depth)) {
+          return nsd_not_found;
+        }
+        depth += node->prefix_len;
+      }
+      if (depth >= key_len ||
+          (childref = find_child(tree->simd, node, key[depth])) == NULL)
+      {
+        return nsd_not_found;
+      }
+      node = load_node(childref);
+      depth++;
+    }
+    found = nsd_leaf_raw(node);
+    /* prefixes are compared in full in trees with suffix leaves */
+    if (!tree->suffix_leaves) {
+      depth = 0;
+    }
+    if (found->key_len != key_len ||
+        memcmp(found->key + (depth - found->depth), key + depth,
+               key_len - depth) != 0)
+    {
+      return nsd_not_found;
     }
   }
 
+  if (leaf != NULL) {
+    *leaf = found;
+  }
   return nsd_ok;
 }
+
+/* Names in a message are stored leaf-first and may be compressed, keys start
+ * at the root. Offsets of the labels are gathered first, which only requires
+ * the length octets to be read. Labels are then transformed in reverse order,
+ * a label at a time when the descent first reaches it, into a key that is
+ * compared like any other key. A miss therefore stops without transforming
+ * the remaining labels.
+ */
+#define WIRE_XLAT(oct) \
+  ((uint8_t)((oct) < 0x41 ? (oct) + 0x01 : (oct) < 0x5b ? (oct) + 0x07 : (oct) - 0x19))
+#define WIRE_XLAT4(oct) \
+  WIRE_XLAT(oct), WIRE_XLAT((oct) + 1), WIRE_XLAT((oct) + 2), WIRE_XLAT((oct) + 3)
+#define WIRE_XLAT16(oct) \
+  WIRE_XLAT4(oct), WIRE_XLAT4((oct) + 4), \
+  WIRE_XLAT4((oct) + 8), WIRE_XLAT4((oct) + 12)
+#define WIRE_XLAT64(oct) \
+  WIRE_XLAT16(oct), WIRE_XLAT16((oct) + 16), \
+  WIRE_XLAT16((oct) + 32), WIRE_XLAT16((oct) + 48)
+
+/* nsd_xlat_u8 as a table, single octet labels (e.g. nibbles in ip6.arpa) are
+   translated without a vector round trip or mispredicted branches */
+static const uint8_t wire_xlat[UINT8_MAX + 1] = {
+  WIRE_XLAT64(0), WIRE_XLAT64(64), WIRE_XLAT64(128), WIRE_XLAT64(192)
+};
+
+typedef struct wire_key wire_key_t;
+struct wire_key {
+  const uint8_t *packet;
+  const uint8_t *end;
+  uint32_t simd;
+  uint8_t len; /* octets of key transformed */
+  uint8_t nlabels;
+  uint16_t labels[NSD_MAX_HEIGHT / 2];
+  uint8_t key[NSD_MAX_HEIGHT + 16]; /* vectors write past the label */
+};
+
+/* returns length of the key, 0 if the name is malformed */
+static uint8_t
+scan_wire(
+  wire_key_t *wire,
+  uint32_t simd,
+  const uint8_t *packet,
+  size_t packet_len,
+  size_t offset)
+{
+  size_t len = 0;
+  uint8_t nlabels = 0;
+
+  /* locals avoid reloads, stores to the key may alias the message */
+  wire->packet = packet;
+  wire->end = packet + packet_len;
+  wire->simd = simd;
+  wire->len = 0;
+  wire->nlabels = 0;
+  while (offset < packet_len) {
+    uint8_t label_len = packet[offset];
+    if ((label_len & 0xc0u) == 0xc0u) {
+      size_t target;
+      if (offset + 1 >= packet_len) {
+        return 0;
+      }
+      /* pointers must point backwards to prevent loops */
+      target = ((size_t)(label_len & 0x3fu) << 8) | packet[offset + 1];
+      if (target >= offset) {
+        return 0;
+      }
+      offset = target;
+    } else if (label_len & 0xc0u) {
+      return 0;
+    } else if (label_len == 0) {
+      wire->nlabels = nlabels;
+      return (uint8_t)(len + 1);
+    } else {
+      len += label_len + 1;
+      if (len >= NSD_MAX_HEIGHT || offset + label_len + 1 >= packet_len ||
+          offset > UINT16_MAX)
+      {
+        return 0;
+      }
+      wire->labels[nlabels++] = (uint16_t)offset;
+      offset += label_len + 1;
+    }
+  }
+
+  return 0;
+}
+
+/* transform labels until the key is at least len octets */
+static inline const uint8_t *
+fill_wire(wire_key_t *wire, uint8_t len)
+{
+  const uint8_t *packet = wire->packet;
+  uint8_t *key = wire->key, key_len = wire->len, nlabels = wire->nlabels;
+
+  if (key_len >= len) {
+    return key;
+  }
+
+  do {
+    const uint8_t *label;
+    uint8_t label_len;
+
+    if (nlabels == 0) {
+      key[key_len++] = 0x00u; /* null-terminate key */
+      break;
+    }
+    label = packet + wire->labels[--nlabels];
+    label_len = label[0];
+#if NSD_X86
+    if (label_len > 1 && NSD_USE_SSE2(wire->simd)) {
+      nsd_xlat_u8_sse2(key + key_len, label + 1, label_len,
+        (size_t)(wire->end - (label + 1)));
+    } else
+#endif
+    {
+      for (uint8_t cnt = 0; cnt < label_len; cnt++) {
+        key[key_len + cnt] = wire_xlat[label[1 + cnt]];
+      }
+    }
+    key_len += label_len;
+    key[key_len++] = 0x00u; /* null-terminate label */
+  } while (key_len < len);
+
+  wire->len = key_len;
+  wire->nlabels = nlabels;
+  return key;
+}
+
+static nsd_retcode_t
+verify_wire(nsd_path_t *path, wire_key_t *wire, uint8_t key_len)
+{
+  const nsd_node_t *node = load_node(path->levels[path->height - 1].noderef);
+  const nsd_leaf_t *leaf;
+  const uint8_t *key = fill_wire(wire, key_len);
+  uint8_t cnt;
+
+  leaf = nsd_is_leaf(node) ? nsd_leaf_raw(node) : any_leaf(node);
+  assert(leaf != NULL);
+  cnt = compare_keys(key, key_len, leaf->key, leaf->key_len);
+  if (nsd_is_leaf(node) && cnt == key_len && cnt == leaf->key_len) {
+    return nsd_ok;
+  }
+
+  trim_path(path, cnt);
+  return nsd_not_found;
+}
+
+nsd_retcode_t
+nsd_find_wire(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const uint8_t *packet,
+  size_t packet_len,
+  size_t offset)
+{
+  uint8_t depth = 0, key_len;
+  nsd_node_t *node, **childref;
+  const uint8_t *key;
+  wire_key_t wire;
+  bool skipped = false;
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(packet != NULL);
+
+  path->height = 0;
+  key_len = scan_wire(&wire, tree->simd, packet, packet_len, offset);
+  if (key_len == 0) {
+    return nsd_bad_parameter;
+  }
+
+  path->levels[0].depth = 0;
+  path->levels[0].noderef = &tree->root;
+  path->height = 1;
+
+  while (depth < key_len) {
+    node = load_node(path->levels[path->height - 1].noderef);
+    if (nsd_is_leaf(node)) {
+      nsd_leaf_t *leaf = nsd_leaf_raw(node);
+      if (skipped) {
+        return verify_wire(path, &wire, key_len);
+      }
+      /* octets before depth are equal */
+      key = fill_wire(&wire, key_len);
+      if (leaf->key_len == key_len &&
+          memcmp(leaf->key + (depth - leaf->depth), key + depth,
+                 key_len - depth) == 0)
+      {
+        return nsd_ok;
+      }
+      /* discard node from path */
+      path->height--;
+      return nsd_not_found;
+    } else if (node->prefix_len != 0) {
+      uint8_t len = node->prefix_len;
+      /* octets that are not stored are skipped */
+      if (skips_prefix(tree, node)) {
+        len = NSD_MAX_PREFIX;
+      }
+      key = fill_wire(&wire, len < key_len - depth ? depth + len : key_len);
+      if (!skip_prefix(tree, node, key, key_len, depth)) {
+        if (skipped) {
+          return verify_wire(path, &wire, key_len);
+        }
+        /* discard node from path */
+        path->height--;
+        return nsd_not_found;
+      }
+      skipped = skipped || skips_prefix(tree, node);
+      depth += node->prefix_len;
+    }
+
+    key = fill_wire(&wire, depth + 1);
+    if ((childref = find_child(tree->simd, node, key[depth])) == NULL) {
+      return skipped ? verify_wire(path, &wire, key_len) : nsd_not_found;
+    }
+
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    depth++;
+  }
+
+  return skipped ? verify_wire(path, &wire, key_len) : nsd_ok;
+}
+
+/* Lookups in a batch are independent. Every lookup is advanced one node at
+ * a time in round-robin fashion and the next node of a lookup is prefetched
+ * when it is selected, so that memory accesses for other lookups overlap the
+ * cache miss (Asynchronous Memory Access Chaining).
+ */
+typedef struct batch_state batch_state_t;
+struct batch_state {
+  nsd_lookup_t *lookup;
+  const nsd_node_t *node;
+  uint8_t depth;
+};
+
+static inline void
+prefetch_node(const nsd_node_t *node)
+{
+  const char *ptr = nsd_is_leaf(node)
+    ? (const char *)nsd_leaf_raw(node) : (const char *)node;
+  /* header, keys and first children are not always in the same line */
+  __builtin_prefetch(ptr);
+  __builtin_prefetch(ptr + 64);
+}
+
+/* advance lookup to next node, returns true if lookup is finished */
+static inline bool
+batch_step(const nsd_tree_t *tree, batch_state_t *state)
+{
+  nsd_node_t **childref;
+  const nsd_node_t *node = state->node;
+  nsd_lookup_t *lookup = state->lookup;
+
+  if (nsd_is_leaf(node)) {
+    nsd_leaf_t *leaf = nsd_leaf_raw(node);
+    /* prefixes are compared in full in trees with suffix leaves */
+    uint8_t depth = tree->suffix_leaves ? state->depth : 0;
+    if (leaf->key_len == lookup->key_len &&
+        memcmp(leaf->key + (depth - leaf->depth), lookup->key + depth,
+               lookup->key_len - depth) == 0)
+    {
+      lookup->leaf = leaf;
+    }
+    return true;
+  } else if (node->prefix_len != 0) {
+    if (!skip_prefix(
+          tree, node, lookup->key, lookup->key_len, state->depth))
+    {
+      return true;
+    }
+    state->depth += node->prefix_len;
+  }
+
+  if (state->depth >= lookup->key_len ||
+      (childref = find_child(
+         tree->simd, node, lookup->key[state->depth])) == NULL)
+  {
+    return true;
+  }
+
+  state->node = load_node(childref);
+  state->depth++;
+  prefetch_node(state->node);
+  return false;
+}
+
+size_t
+nsd_find_batch(nsd_tree_t *tree, nsd_lookup_t *lookups, size_t count)
+{
+  size_t idx = 0, next = 0, found = 0, active, width;
+  batch_state_t states[NSD_BATCH_WIDTH];
+  const nsd_node_t *root;
+
+  assert(tree != NULL);
+  assert(lookups != NULL || count == 0);
+
+  width = count < NSD_BATCH_WIDTH ? count : NSD_BATCH_WIDTH;
+  root = load_node(&tree->root);
+  for (active = 0; active < width; active++) {
+    lookups[next].leaf = NULL;
+    states[active].lookup = &lookups[next++];
+    states[active].node = root;
+    states[active].depth = 0;
+  }
+
+  while (active > 0) {
+    batch_state_t *state = &states[idx];
+    if (state->lookup != NULL && batch_step(tree, state)) {
+      found += state->lookup->leaf != NULL;
+      if (next < count) {
+        /* root is accessed by every lookup and likely cached */
+        lookups[next].leaf = NULL;
+        state->lookup = &lookups[next++];
+        state->node = root;
+        state->depth = 0;
+      } else {
+        state->lookup = NULL;
+        active--;
+      }
+    }
+    idx = idx + 1 < width ? idx + 1 : 0;
+  }
+
+  return found;
+}
+
+nsd_retcode_t
+nsd_find_encloser(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  uint8_t cnt, depth = 0, height = 0, enc_depth = 0;
+  nsd_node_t *node, **childref, **enc_ref = NULL;
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  path->levels[0].depth = 0;
+  path->levels[0].noderef = &tree->root;
+  path->height = 1;
+
+  while (depth < key_len) {
+    node = load_node(path->levels[path->height - 1].noderef);
+    if (nsd_is_leaf(node)) {
+      nsd_leaf_t *leaf = nsd_leaf_raw(node);
+
+      /* prefixes were compared in full */
+      cnt = compare_leaf(leaf, key, key_len, depth);
+      if (cnt == key_len) {
+        assert(key_len == leaf->key_len);
+        return nsd_ok;
+      } else if (cnt == leaf->key_len - 1) {
+        /* leaf matches up to its terminator, leaf is an ancestor */
+        return nsd_not_found;
+      }
+      path->height--;
+      break;
+    } else if (node->prefix_len != 0) {
+      cnt = match_prefix(tree, node, key, key_len, depth);
+      if (cnt != node->prefix_len) {
+        /* ancestors diverge at a label separator, never inside a prefix */
+        break;
+      }
+      depth += cnt;
+    }
+
+    /* ancestor exists if node branches on terminator at start of a label */
+    if (depth == 0 || key[depth - 1] == 0x00u) {
+      if ((childref = find_child(tree->simd, node, 0x00u)) != NULL) {
+        height = path->height;
+        enc_depth = depth;
+        enc_ref = childref;
+      }
+    }
+
+    if ((childref = find_child(tree->simd, node, key[depth])) == NULL) {
+      break;
+    }
+
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    depth++;
+  }
+
+  if (depth == key_len) {
+    return nsd_ok;
+  }
+
+  if (enc_ref == NULL) {
+    path->height = 0;
+  } else {
+    assert(nsd_is_leaf(load_node(enc_ref)));
+    path->height = height;
+    path->levels[path->height].depth = enc_depth;
+    path->levels[path->height].noderef = enc_ref;
+    path->height++;
+  }
+
+  return nsd_not_found;
+}
+
+/* number of node17 indexes for keys less than or equal to key */
+static inline uint8_t
+node17_rank(uint8_t key)
+{
+  if (key >= 0x4du) {
+    return 17;
+  } else if (key >= 0x48u) { /* "a..f" */
+    return 11 + (key - 0x47u);
+  } else if (key >= 0x3au) {
+    return 11;
+  } else if (key >= 0x31u) { /* "0..9" */
+    return 1 + (key - 0x30u);
+  }
+  return 1;
+}
+
+/* number of node38 indexes for keys less than or equal to key */
+static inline uint8_t
+node38_rank(uint8_t key)
+{
+  if (key >= 0x61u) {
+    return 38;
+  } else if (key >= 0x48u) { /* "a..z" */
+    return 12 + (key - 0x47u);
+  } else if (key >= 0x3au) {
+    return 12;
+  } else if (key >= 0x31u) { /* "0..9" */
+    return 2 + (key - 0x30u);
+  } else if (key >= 0x2eu) { /* "-" */
+    return 2;
+  }
+  return 1;
+}
+
+/* first key in use greater than or equal to key, -1 if none */
+static inline int
+bitmap_next(const uint64_t *bitmap, int key)
+{
+  for (int word = key / 64; word < NSD_BITMAP_WORDS; word++) {
+    uint64_t bits = bitmap[word];
+    if (word == key / 64) {
+      bits &= ~0ull << (key % 64);
+    }
+    if (bits) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
+  }
+
+  return -1;
+}
+
+/* last key in use less than or equal to key, -1 if none */
+static inline int
+bitmap_prev(const uint64_t *bitmap, int key)
+{
+  for (int word = key / 64; key >= 0 && word >= 0; word--) {
+    uint64_t bits = bitmap[word];
+    if (word == key / 64 && (key % 64) != 63) {
+      bits &= (1ull << ((key % 64) + 1)) - 1;
+    }
+    if (bits) {
+      return word * 64 + (63 - __builtin_clzll(bits));
+    }
+  }
+
+  return -1;
+}
+
+/* find child with smallest key greater than key, -1 selects first child */
+static nsd_node_t **
+next_child(uint32_t simd, const nsd_node_t *node, int key)
+{
+  uint8_t idx;
+  int next;
+
+  assert(key >= -1 && key < NSD_MAX_WIDTH);
+
+  switch (node->type) {
+    case nsd_node4: {
+      const nsd_node4_t *node4 = (const nsd_node4_t *)node;
+      for (idx = 0; idx < node->width && node4->keys[idx] <= key; idx++) { }
+      return idx < node->width ? (nsd_node_t **)&node4->children[idx] : NULL;
+    }
+    case nsd_node16: {
+      const nsd_node16_t *node16 = (const nsd_node16_t *)node;
+      idx = key < 0
+        ? 0 : nsd_v16_findgt_u8(simd, key, node16->keys, node->width);
+      return idx < node->width ? (nsd_node_t **)&node16->children[idx] : NULL;
+    }
+    case nsd_node17: {
+      const nsd_node17_t *node17 = (const nsd_node17_t *)node;
+      uint32_t bits = node17->bitmap;
+      if (key >= 0) {
+        bits &= ~0u << node17_rank(key);
+      }
+      return bits ? (nsd_node_t **)&node17->children[__builtin_ctz(bits)] : NULL;
+    }
+    case nsd_node32: {
+      const nsd_node32_t *node32 = (const nsd_node32_t *)node;
+      idx = key < 0
+        ? 0 : nsd_v32_findgt_u8(simd, key, node32->keys, node->width);
+      return idx < node->width ? (nsd_node_t **)&node32->children[idx] : NULL;
+    }
+    case nsd_node38: {
+      const nsd_node38_t *node38 = (const nsd_node38_t *)node;
+      uint64_t bits = node38->bitmap;
+      if (key >= 0) {
+        bits &= ~0ull << node38_rank(key);
+      }
+      return bits ? (nsd_node_t **)&node38->children[__builtin_ctzll(bits)] : NULL;
+    }
+    case nsd_node48: {
+      const nsd_node48_t *node48 = (const nsd_node48_t *)node;
+      if ((next = bitmap_next(node48->bitmap, key + 1)) == -1) {
+        return NULL;
+      }
+      return (nsd_node_t **)&node48->children[node48->keys[next] - 1];
+    }
+    case nsd_node256: {
+      const nsd_node256_t *node256 = (const nsd_node256_t *)node;
+      if ((next = bitmap_next(node256->bitmap, key + 1)) == -1) {
+        return NULL;
+      }
+      return (nsd_node_t **)&node256->children[next];
+    }
+    default:
+      break;
+  }
+
+  abort();
+}
+
+/* find child with largest key less than key, NSD_MAX_WIDTH selects last */
+static nsd_node_t **
+prev_child(uint32_t simd, const nsd_node_t *node, int key)
+{
+  uint8_t idx;
+  int prev;
+
+  assert(key >= 0 && key <= NSD_MAX_WIDTH);
+
+  switch (node->type) {
+    case nsd_node4: {
+      const nsd_node4_t *node4 = (const nsd_node4_t *)node;
+      for (idx = node->width; idx > 0 && node4->keys[idx - 1] >= key; idx--) { }
+      return idx > 0 ? (nsd_node_t **)&node4->children[idx - 1] : NULL;
+    }
+    case nsd_node16: {
+      const nsd_node16_t *node16 = (const nsd_node16_t *)node;
+      idx = key == 0
+        ? 0 : nsd_v16_findgt_u8(simd, key - 1, node16->keys, node->width);
+      return idx > 0 ? (nsd_node_t **)&node16->children[idx - 1] : NULL;
+    }
+    case nsd_node17: {
+      const nsd_node17_t *node17 = (const nsd_node17_t *)node;
+      uint32_t bits = 0;
+      if (key > 0) {
+        bits = node17->bitmap & ((1u << node17_rank(key - 1)) - 1);
+      }
+      return bits
+        ? (nsd_node_t **)&node17->children[31 - __builtin_clz(bits)] : NULL;
+    }
+    case nsd_node32: {
+      const nsd_node32_t *node32 = (const nsd_node32_t *)node;
+      idx = key == 0
+        ? 0 : nsd_v32_findgt_u8(simd, key - 1, node32->keys, node->width);
+      return idx > 0 ? (nsd_node_t **)&node32->children[idx - 1] : NULL;
+    }
+    case nsd_node38: {
+      const nsd_node38_t *node38 = (const nsd_node38_t *)node;
+      uint64_t bits = 0;
+      if (key > 0) {
+        bits = node38->bitmap & ((1ull << node38_rank(key - 1)) - 1);
+      }
+      return bits
+        ? (nsd_node_t **)&node38->children[63 - __builtin_clzll(bits)] : NULL;
+    }
+    case nsd_node48: {
+      const nsd_node48_t *node48 = (const nsd_node48_t *)node;
+      if ((prev = bitmap_prev(node48->bitmap, key - 1)) == -1) {
+        return NULL;
+      }
+      return (nsd_node_t **)&node48->children[node48->keys[prev] - 1];
+    }
+    case nsd_node256: {
+      const nsd_node256_t *node256 = (const nsd_node256_t *)node;
+      if ((prev = bitmap_prev(node256->bitmap, key - 1)) == -1) {
+        return NULL;
+      }
+      return (nsd_node_t **)&node256->children[prev];
+    }
+    default:
+      break;
+  }
+
+  abort();
+}
+
+/* extend path to first (or last) leaf under node at top of path */
+static nsd_retcode_t
+descend(const nsd_tree_t *tree, nsd_path_t *path, bool last)
+{
+  nsd_node_t *node, **childref;
+
+  for (;;) {
+    node = load_node(path->levels[path->height - 1].noderef);
+    if (nsd_is_leaf(node)) {
+      return nsd_ok;
+    }
+    childref = last
+      ? prev_child(tree->simd, node, NSD_MAX_WIDTH)
+      : next_child(tree->simd, node, -1);
+    if (childref == NULL) {
+      /* only the root can be empty */
+      return nsd_not_found;
+    }
+    path->levels[path->height].depth =
+      child_depth(path, path->height - 1, node);
+    path->levels[path->height].noderef = childref;
+    path->height++;
+  }
+}
+
+/* move path to first leaf following (or preceding) the subtree at top of
+   path, key must contain the octets that selected each level */
+static nsd_retcode_t
+step(
+  const nsd_tree_t *tree, nsd_path_t *path, const uint8_t *key, bool back)
+{
+  uint8_t height;
+  nsd_node_t *node, **childref;
+
+  for (height = path->height - 1; height > 0; height--) {
+    node = load_node(path->levels[height - 1].noderef);
+    if (back) {
+      childref = prev_child(tree->simd, node, key[path->levels[height].depth]);
+    } else {
+      childref = next_child(tree->simd, node, key[path->levels[height].depth]);
+    }
+    if (childref != NULL) {
+      /* sibling is selected by octet at same depth */
+      path->levels[height].noderef = childref;
+      path->height = height + 1;
+      return descend(tree, path, back);
+    }
+  }
+
+  return nsd_not_found;
+}
+
+nsd_retcode_t
+nsd_seek(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  uint8_t cnt, depth = 0;
+  nsd_node_t *node, **childref;
+  nsd_retcode_t ret;
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  path->levels[0].depth = 0;
+  path->levels[0].noderef = &tree->root;
+  path->height = 1;
+
+  for (;;) {
+    node = load_node(path->levels[path->height - 1].noderef);
+    if (nsd_is_leaf(node)) {
+      nsd_leaf_t *leaf = nsd_leaf_raw(node);
+
+      cnt = compare_leaf(leaf, key, key_len, depth);
+      if (cnt == key_len ||
+          (cnt < leaf->key_len && leaf->key[cnt - leaf->depth] > key[cnt]))
+      {
+        return nsd_ok;
+      }
+      ret = step(tree, path, key, false);
+      break;
+    }
+
+    if (node->prefix_len != 0) {
+      cnt = match_prefix(tree, node, key, key_len, depth);
+      if (cnt != node->prefix_len) {
+        /* subtree is either ordered before or after key */
+        if (depth + cnt == key_len ||
+            load_prefix(tree, node, depth)[cnt] > key[depth + cnt])
+        {
+          ret = descend(tree, path, false);
+        } else {
+          ret = step(tree, path, key, false);
+        }
+        break;
+      }
+      depth += cnt;
+    }
+
+    if (depth >= key_len) {
+      ret = descend(tree, path, false);
+      break;
+    }
+
+    if ((childref = find_child(tree->simd, node, key[depth])) == NULL) {
+      if ((childref = next_child(tree->simd, node, key[depth])) == NULL) {
+        ret = step(tree, path, key, false);
+        break;
+      }
+      path->levels[path->height].depth = depth;
+      path->levels[path->height].noderef = childref;
+      path->height++;
+      ret = descend(tree, path, false);
+      break;
+    }
+
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    depth++;
+  }
+
+  if (ret != nsd_ok) {
+    path->height = 0;
+  }
+
+  return ret;
+}
+
+nsd_retcode_t
+nsd_find_prev(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  uint8_t cnt, depth;
+  nsd_node_t *node, *child, **childref;
+  nsd_retcode_t ret;
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  /* resumes from result of previous lookup at negligible cost */
+  if ((ret = nsd_find_path(tree, path, key, key_len)) == nsd_ok) {
+    return ret;
+  } else if (path->height == 0) {
+    return nsd_not_found;
+  }
+
+  node = load_node(path->levels[path->height - 1].noderef);
+  assert(!nsd_is_leaf(node));
+  depth = child_depth(path, path->height - 1, node);
+  assert(depth < key_len);
+
+  /* lookup stopped at child that diverges from key, the subtree is ordered
+     before key if the first octet that differs is less than that of key */
+  if ((childref = find_child(tree->simd, node, key[depth])) != NULL) {
+    bool before;
+
+    child = load_node(childref);
+    if (nsd_is_leaf(child)) {
+      nsd_leaf_t *leaf = nsd_leaf_raw(child);
+      /* prefixes in the path were verified */
+      cnt = compare_leaf(leaf, key, key_len, depth + 1);
+      before = cnt < key_len && (cnt == leaf->key_len ||
+                                 leaf->key[cnt - leaf->depth] < key[cnt]);
+    } else {
+      cnt = match_prefix(tree, child, key, key_len, depth + 1);
+      assert(cnt < child->prefix_len);
+      before = depth + 1 + cnt < key_len &&
+               load_prefix(tree, child, depth + 1)[cnt] < key[depth + 1 + cnt];
+    }
+
+    if (before) {
+      path->levels[path->height].depth = depth;
+      path->levels[path->height].noderef = childref;
+      path->height++;
+      ret = descend(tree, path, true);
+      goto exit;
+    }
+  }
+
+  if ((childref = prev_child(tree->simd, node, key[depth])) != NULL) {
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    ret = descend(tree, path, true);
+  } else {
+    ret = step(tree, path, key, true);
+  }
+
+exit:
+  if (ret != nsd_ok) {
+    path->height = 0;
+  }
+
+  return ret == nsd_ok ? nsd_not_found : ret;
+}
+
+static nsd_retcode_t
+move(nsd_tree_t *tree, nsd_path_t *path, bool back)
+{
+  nsd_node_t *node;
+  nsd_retcode_t ret;
+
+  assert(tree != NULL);
+  assert(path != NULL);
+
+  if (path->height == 0) {
+    path->levels[0].depth = 0;
+    path->levels[0].noderef = &tree->root;
+    path->height = 1;
+    if ((ret = descend(tree, path, back)) != nsd_ok) {
+      path->height = 0;
+    }
+    return ret;
+  }
+
+  assert(path->levels[0].noderef == &tree->root);
+  node = load_node(path->levels[path->height - 1].noderef);
+  assert(nsd_is_leaf(node));
+  if (tree->suffix_leaves) {
+    nsd_key_t key;
+    load_path_key(tree, path, key);
+    return step(tree, path, key, back);
+  }
+  return step(tree, path, nsd_leaf_raw(node)->key, back);
+}
+
+nsd_retcode_t
+nsd_next(nsd_tree_t *tree, nsd_path_t *path)
+{
+  return move(tree, path, false);
+}
+
+nsd_retcode_t
+nsd_prev(nsd_tree_t *tree, nsd_path_t *path)
+{
+  return move(tree, path, true);
+}
+
+static nsd_retcode_t
+make_path(
+  nsd_tree_t *tree,
+  nsd_node_t **rootref,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+{
+  uint8_t depth = 0;
+  nsd_node_t **childref, **noderef;
+
+  if (path->height == 0) {
+    path->levels[0].depth = depth;
+    path->levels[0].noderef = rootref;
+    path->height++;
+  } else {
+    assert(path->levels[0].depth == 0);
+    assert(path->levels[0].noderef == rootref);
+    /* root consumes first octet, other levels consume octet at depth */
+    if (path->height > 1) {
+      depth = path->levels[path->height - 1].depth + 1;
+    }
+  }
+
+  assert(key_len >= path->levels[path->height - 1].depth);
+
+  while (depth < key_len) {
+    noderef = path->levels[path->height - 1].noderef;
+    if (nsd_is_leaf(*noderef)) {
+      uint8_t cnt;
+      nsd_leaf_t *leaf = nsd_leaf_raw(*noderef);
+
+      /* prefixes are compared in full */
+      cnt = compare_leaf(leaf, key, key_len, depth);
+
+      if (cnt == key_len) {
+        /* match */
+        /* duplicates can exist but keys cannot be prefixes */
+        assert(key_len == leaf->key_len);
+        return nsd_ok;
+      } else {
+        /* mismatch, split node. */
+        nsd_node_t *node;
+
+        assert(cnt < key_len);
+        assert(cnt < leaf->key_len);
+
+        if ((node = alloc_node(tree, nsd_node4)) == NULL) {
+          return nsd_no_memory;
+        }
+        /* take depth of *this* node for offset, exclude first octet */
+        depth = path->levels[path->height - 1].depth;
+        if (!set_prefix(tree, node, &key[1 + depth], cnt - (depth + 1))) {
+          release_node(tree, node);
+          return nsd_no_memory;
+        }
+        (void)add_child(
+          tree, &node, leaf->key[cnt - leaf->depth], SET_LEAF(leaf));
+        /* unlink leaf, link inner node */
+        *noderef = node;
+        depth = cnt;
+      }
+    } else if ((*noderef)->prefix_len != 0) {
+      uint8_t cnt;
+      nsd_node_t *node;
+
+      cnt = match_prefix(tree, *noderef, key, key_len, depth);
+      assert(path->levels[path->height - 1].depth == depth - 1);
+
+      if (cnt != (*noderef)->prefix_len) {
+        /* mismatch, split node */
+        nsd_node_t *child = *noderef;
+        const uint8_t *prefix = load_prefix(tree, child, depth);
+
+        assert(cnt < key_len - depth);
+        assert(cnt < child->prefix_len);
+
+        if ((node = alloc_node(tree, nsd_node4)) == NULL) {
+          return nsd_no_memory;
+        } else if (!set_prefix(tree, node, prefix, cnt)) {
+          release_node(tree, node);
+          return nsd_no_memory;
+        }
+
+        if (tree->rcu != NULL && long_prefix(tree, child)) {
+          /* readers may compare the prefix, node is replaced by a copy */
+          nsd_node_t *clone;
+          if ((clone = clone_node(tree, child)) == NULL ||
+              !set_prefix(tree, clone, prefix + (1 + cnt),
+                          child->prefix_len - (1 + cnt)))
+          {
+            if (clone != NULL) {
+              release_node(tree, clone);
+            }
+            free_prefix(tree, node);
+            release_node(tree, node);
+            return nsd_no_memory;
+          }
+          /* link node */
+          add_child(tree, &node, prefix[cnt], clone);
+          free_prefix(tree, child);
+          free_node(tree, child);
+        } else {
+          /* link node */
+          add_child(tree, &node, prefix[cnt], child);
+          /* determine prefix length, exclude first octet */
+          cut_prefix(tree, child, depth, 1 + cnt);
+        }
+        /* unlink node, link inner node */
+        *noderef = node;
+      }
+      depth += cnt;
+    }
+
+    childref = find_child(tree->simd, *noderef, key[depth]);
+    if (childref != NULL) {
+      path->levels[path->height].depth = depth;
+      path->levels[path->height].noderef = childref;
+      path->height++;
+      depth++;
+    } else {
+      nsd_leaf_t *leaf;
+
+      if ((leaf = make_leaf(tree, key, key_len, depth + 1)) == NULL) {
+        return nsd_no_memory;
+      }
+      childref = add_child(tree, noderef, key[depth], SET_LEAF(leaf));
+      if (childref == NULL) {
+        free_node(tree, SET_LEAF(leaf));
+        return nsd_no_memory;
+      }
+
+      path->levels[path->height].depth = depth;
+      path->levels[path->height].noderef = childref;
+      path->height++;
+      depth = key_len;
+    }
+  }
+
+  return nsd_ok;
+}
+
+/* copy inner nodes in path to key so that modifications remain invisible to
+   readers, originals are retired once copies are published */
+static nsd_retcode_t
+copy_path(
+  nsd_tree_t *tree,
+  nsd_node_t **rootref,
+  nsd_path_t *path,
+  nsd_node_t **nodes,
+  uint8_t *count,
+  const nsd_key_t key,
+  uint8_t key_len)
+{
+  uint8_t cnt = 0, depth = 0;
+  nsd_node_t *node, **childref, **noderef = rootref;
+
+  *rootref = tree->root;
+  path->levels[0].depth = 0;
+  path->levels[0].noderef = rootref;
+  path->height = 1;
+
+  while (!nsd_is_leaf(*noderef)) {
+    if ((node = clone_node(tree, *noderef)) == NULL) {
+      /* copies were never published, release directly */
+      for (; cnt > 0; cnt--) {
+        release_node(tree, *path->levels[cnt - 1].noderef);
+      }
+      return nsd_no_memory;
+    }
+    nodes[cnt++] = *noderef;
+    *noderef = node;
+
+    if (node->prefix_len != 0) {
+      if (match_prefix(tree, node, key, key_len, depth) != node->prefix_len) {
+        break;
+      }
+      depth += node->prefix_len;
+    }
+
+    if (depth >= key_len || (childref = find_child(tree->simd, node, key[depth])) == NULL) {
+      break;
+    }
+
+    path->levels[path->height].depth = depth;
+    path->levels[path->height].noderef = childref;
+    path->height++;
+    noderef = childref;
+    depth++;
+  }
+
+  *count = cnt;
+  return nsd_ok;
+}
+
+static void
+publish_path(
+  nsd_tree_t *tree,
+  nsd_node_t *root,
+  nsd_path_t *path,
+  nsd_node_t **nodes,
+  uint8_t count)
+{
+  __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+  path->levels[0].noderef = &tree->root;
+  for (uint8_t cnt = 0; cnt < count; cnt++) {
+    free_node(tree, nodes[cnt]);
+  }
+}
+
+/* nodes in path plus nodes replaced during the operation */
+#define OLC_RETIRE (2 * NSD_MAX_HEIGHT)
+
+static inline bool
+olc_grows(const nsd_node_t *node, uint8_t key)
+{
+  switch (node->type) {
+    case nsd_node4:
+      return node->width == 4;
+    case nsd_node16:
+      return node->width == 16;
+    case nsd_node17:
+      return node17_xlat(key) == (uint8_t)-1;
+    case nsd_node32:
+      return node->width == 32;
+    case nsd_node38:
+      return node38_xlat(key) == (uint8_t)-1;
+    case nsd_node48:
+      return node->width == 48;
+    default:
+      return false;
+  }
+}
+
+/* lock nodes from top to bottom, releases all locks on failure */
+static bool
+olc_lock(olc_state_t *state, uint8_t top, uint8_t bottom)
+{
+  for (uint8_t level = top; level <= bottom; level++) {
+    if (!upgrade_lock(state->nodes[level], state->versions[level])) {
+      while (level > top) {
+        write_unlock(state->nodes[--level]);
+      }
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Run operation on locked levels. The reference to the topmost locked node
+ * is replaced by a local copy as its parent is not locked, nodes replaced by
+ * the operation are locked, which includes the root.
+ */
+typedef struct olc_scope olc_scope_t;
+struct olc_scope {
+  uint8_t top;
+  nsd_node_t **noderef; /**< Reference to topmost locked node */
+  nsd_node_t *node;
+};
+
+static void
+olc_enter(olc_scope_t *scope, nsd_path_t *path, olc_state_t *state, uint8_t top)
+{
+  scope->top = top;
+  scope->noderef = path->levels[top].noderef;
+  scope->node = state->nodes[top];
+  path->levels[top].noderef = &scope->node;
+}
+
+static void
+olc_leave(
+  olc_scope_t *scope,
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  olc_state_t *state,
+  uint8_t bottom)
+{
+  if (scope->node != state->nodes[scope->top]) {
+    assert(scope->top == 0);
+    __atomic_store_n(&tree->root, scope->node, __ATOMIC_RELEASE);
+  }
+
+  assert(path->height > scope->top);
+  path->last = *path->levels[path->height - 1].noderef;
+  if (path->height - 1 != scope->top) {
+    path->levels[scope->top].noderef = scope->noderef;
+  }
+  path->levels[path->height - 1].noderef = &path->last;
+
+  for (uint8_t level = scope->top; level <= bottom; level++) {
+    write_unlock(state->nodes[level]);
+  }
+}
+
+static nsd_retcode_t
+olc_make_path(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  uint8_t top, bottom;
+  olc_state_t state;
+  olc_scope_t scope;
+  nsd_retcode_t ret;
+
+  if (nsd_rcu_hold(tree->rcu, OLC_RETIRE) != 0) {
+    return nsd_no_memory;
+  }
+
+  for (;;) {
+    switch (olc_find(tree, path, &state, key, key_len)) {
+      case olc_restart:
+        olc_pause();
+        continue;
+      case olc_found:
+        nsd_rcu_unhold(tree->rcu, OLC_RETIRE);
+        return nsd_ok;
+      case olc_leaf:
+        /* leaf is replaced by a new node */
+        top = bottom = path->height - 2;
+        break;
+      case olc_prefix:
+        /* node is split, root has no prefix */
+        bottom = path->height - 1;
+        assert(bottom > 0);
+        top = bottom - 1;
+        break;
+      default:
+        /* node is replaced if it grows */
+        assert(path->height > 0);
+        top = bottom = path->height - 1;
+        if (top > 0 && olc_grows(state.nodes[bottom], key[state.depth])) {
+          top--;
+        }
+        break;
+    }
+
+    if (olc_lock(&state, top, bottom)) {
+      break;
+    }
+  }
+
+  /* resume from topmost locked node */
+  path->height = top + 1;
+  olc_enter(&scope, path, &state, top);
+  ret = make_path(tree, path->levels[0].noderef, path, key, key_len);
+  olc_leave(&scope, tree, path, &state, bottom);
+  nsd_rcu_unhold(tree->rcu, OLC_RETIRE);
+
+  return ret;
+}
+
+nsd_retcode_t
+nsd_make_path(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  uint8_t cnt;
+  nsd_retcode_t ret;
+  nsd_node_t *root, *nodes[NSD_MAX_HEIGHT];
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  if (tree->concurrent) {
+    return olc_make_path(tree, path, key, key_len);
+  } else if (tree->rcu == NULL) {
+    return make_path(tree, &tree->root, path, key, key_len);
+  }
+
+  if ((ret = nsd_find_path(tree, path, key, key_len)) != nsd_not_found) {
+    return ret;
+  }
+
+  /* nodes in path plus nodes replaced during the operation */
+  if (nsd_rcu_reserve(tree->rcu, 2 * NSD_MAX_HEIGHT) != 0) {
+    return nsd_no_memory;
+  }
+  if ((ret = copy_path(tree, &root, path, nodes, &cnt, key, key_len)) != nsd_ok) {
+    path->height = 0;
+    return ret;
+  }
+  /* copy is valid even if key could not be created */
+  ret = make_path(tree, &root, path, key, key_len);
+  publish_path(tree, root, path, nodes, cnt);
+
+  return ret;
+}
+
+nsd_retcode_t
+nsd_make_path_from(
+  nsd_tree_t *tree, nsd_path_t *path, const nsd_key_t key, uint8_t key_len)
+{
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  /* paths in concurrent trees cannot be resumed */
+  if (tree->concurrent) {
+    path->height = 0;
+  } else {
+    rewind_path(tree, path, key, key_len);
+  }
+
+  return nsd_make_path(tree, path, key, key_len);
+}
+
+static void
+remove_path(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  void **data)
+{
+  nsd_node_t **noderef;
+  nsd_leaf_t *leaf;
+
+  /* root is never a leaf */
+  assert(path->height > 1);
+  assert(nsd_is_leaf(*path->levels[path->height - 1].noderef));
+  leaf = nsd_leaf_raw(*path->levels[path->height - 1].noderef);
+  path->height--;
+  noderef = path->levels[path->height - 1].noderef;
+
+  /* unlink leaf, node might be replaced by a smaller node */
+  remove_child(tree, noderef, key[path->levels[path->height].depth]);
+
+  /* unlink empty nodes, can only occur if merge was impossible */
+  while (path->height > 1 && (*noderef)->width == 0) {
+    free_prefix(tree, *noderef);
+    free_node(tree, *noderef);
+    path->height--;
+    noderef = path->levels[path->height - 1].noderef;
+    remove_child(tree, noderef, key[path->levels[path->height].depth]);
+  }
+
+  /* merge node with only child, root is never merged */
+  if (path->height > 1 &&
+      (*noderef)->type == nsd_node4 && (*noderef)->width == 1)
+  {
+    collapse_node4(tree, noderef, path->levels[path->height - 1].depth + 1);
+  }
+
+  if (data != NULL) {
+    *data = leaf->data;
+  }
+  free_node(tree, SET_LEAF(leaf));
+}
+
+static inline bool
+olc_shrinks(const nsd_tree_t *tree, const nsd_node_t *node, uint8_t width)
+{
+  switch (node->type) {
+    case nsd_node16:
+      return width <= NODE16_SHRINK;
+    case nsd_node17:
+      return width <= NODE17_SHRINK;
+    case nsd_node32:
+      return width <= NODE32_SHRINK;
+    case nsd_node38:
+      return width <= NODE38_SHRINK(tree);
+    case nsd_node48:
+      return width <= NODE48_SHRINK(tree);
+    case nsd_node256:
+      return width <= NODE256_SHRINK;
+    default:
+      return false;
+  }
+}
+
+static nsd_retcode_t
+olc_remove_path(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len,
+  void **data)
+{
+  uint8_t top, bottom, level, width;
+  uint32_t version = 0;
+  olc_state_t state;
+  olc_scope_t scope;
+  olc_result_t result;
+  nsd_node_t *node, *child;
+
+  if (nsd_rcu_hold(tree->rcu, OLC_RETIRE) != 0) {
+    return nsd_no_memory;
+  }
+
+  for (;;) {
+    if ((result = olc_find(tree, path, &state, key, key_len)) == olc_restart) {
+      olc_pause();
+      continue;
+    } else if (result != olc_found) {
+      nsd_rcu_unhold(tree->rcu, OLC_RETIRE);
+      if (result != olc_child) {
+        path->height--;
+      }
+      path->last = state.nodes[path->height - 1];
+      path->levels[path->height - 1].noderef = &path->last;
+      return nsd_not_found;
+    }
+
+    /* nodes left empty are removed, see remove_path */
+    bottom = level = path->height - 2;
+    while (level > 0 && state.nodes[level]->width == 1) {
+      level--;
+    }
+
+    /* node that remains is replaced if it shrinks or is merged with the
+       only child that remains, which is then replaced too */
+    node = state.nodes[level];
+    width = node->width - 1;
+    child = NULL;
+    top = level;
+    if (level > 0 && width == 1 &&
+        (node->type == nsd_node4 || node->type == nsd_node16))
+    {
+      uint8_t removed = key[path->levels[level + 1].depth];
+      const uint8_t *keys = node->type == nsd_node4
+        ? ((nsd_node4_t *)node)->keys : ((nsd_node16_t *)node)->keys;
+      nsd_node_t **children = node->type == nsd_node4
+        ? ((nsd_node4_t *)node)->children : ((nsd_node16_t *)node)->children;
+      child = load_node(&children[keys[0] == removed ? 1 : 0]);
+      if (child == NULL || (!nsd_is_leaf(child) && !read_lock(child, &version))) {
+        continue;
+      }
+      child = nsd_is_leaf(child) ? NULL : child;
+      top--;
+    } else if (level > 0 && olc_shrinks(tree, node, width)) {
+      top--;
+    }
+
+    if (!olc_lock(&state, top, bottom)) {
+      continue;
+    } else if (child != NULL && !upgrade_lock(child, version)) {
+      for (level = top; level <= bottom; level++) {
+        write_unlock(state.nodes[level]);
+      }
+      continue;
+    }
+    break;
+  }
+
+  olc_enter(&scope, path, &state, top);
+  remove_path(tree, path, key, data);
+  olc_leave(&scope, tree, path, &state, bottom);
+  if (child != NULL) {
+    write_unlock(child);
+  }
+  nsd_rcu_unhold(tree->rcu, OLC_RETIRE);
+
+  return nsd_ok;
+}
+
+nsd_retcode_t
+nsd_remove_path(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len,
+  void **data)
+{
+  uint8_t cnt;
+  nsd_retcode_t ret;
+  nsd_node_t *root, *nodes[NSD_MAX_HEIGHT];
+
+  assert(tree != NULL);
+  assert(path != NULL);
+  assert(key_len != 0);
+
+  if (tree->concurrent) {
+    return olc_remove_path(tree, path, key, key_len, data);
+  }
+
+  if ((ret = nsd_find_path(tree, path, key, key_len)) != nsd_ok) {
+    return ret;
+  }
+
+  if (tree->rcu == NULL) {
+    remove_path(tree, path, key, data);
+    return nsd_ok;
+  }
+
+  if (nsd_rcu_reserve(tree->rcu, 2 * NSD_MAX_HEIGHT) != 0) {
+    return nsd_no_memory;
+  }
+  if ((ret = copy_path(tree, &root, path, nodes, &cnt, key, key_len)) != nsd_ok) {
+    path->height = 0;
+    return ret;
+  }
+  remove_path(tree, path, key, data);
+  publish_path(tree, root, path, nodes, cnt);
+
+  return nsd_ok;
+}
+
+static void
+destroy_node(nsd_tree_t *tree, nsd_node_t *node)
+{
+  uint8_t cnt, keys[NSD_MAX_WIDTH];
+  nsd_node_t *children[NSD_MAX_WIDTH];
+
+  if (!nsd_is_leaf(node)) {
+    cnt = gather_children(node, keys, children);
+    for (uint8_t idx = 0; idx < cnt; idx++) {
+      destroy_node(tree, children[idx]);
+    }
+    if (long_prefix(tree, node)) {
+      release_prefix(tree, node->long_prefix);
+    }
+  }
+
+  release_node(tree, node);
+}
+
+/* default slab is shared by writers of concurrent trees */
+static void *
+locked_allocate(void *arg, size_t size)
+{
+  void *ptr;
+  nsd_tree_t *tree = arg;
+
+  pthread_mutex_lock(&tree->lock);
+  ptr = nsd_slab_allocate(tree->slab, size);
+  pthread_mutex_unlock(&tree->lock);
+  return ptr;
+}
+
+static void
+locked_release(void *arg, void *ptr, size_t size)
+{
+  nsd_tree_t *tree = arg;
+
+  pthread_mutex_lock(&tree->lock);
+  nsd_slab_release(tree->slab, ptr, size);
+  pthread_mutex_unlock(&tree->lock);
+}
+
+nsd_retcode_t
+nsd_init_tree(nsd_tree_t *tree, const nsd_options_t *options)
+{
+  assert(tree != NULL);
+
+  tree->concurrent = options != NULL && options->concurrent;
+  if (tree->concurrent && options->rcu == NULL) {
+    return nsd_bad_parameter;
+  }
+
+  tree->rcu = options != NULL ? options->rcu : NULL;
+  tree->value_size = options != NULL ? options->value_size : 0;
+  tree->suffix_leaves = options != NULL && options->suffix_leaves;
+  /* vector kernels are selected once, node searches and keys created with
+     nsd_make_tree_key do not use extensions that are disabled */
+  tree->simd = nsd_simd_init();
+  if (options != NULL) {
+    tree->simd &= ~options->disable_simd;
+  }
+  tree->slab = NULL;
+  if (options != NULL && options->allocator != NULL) {
+    tree->allocator = *options->allocator;
+  } else {
+    if ((tree->slab = malloc(sizeof(*tree->slab))) == NULL) {
+      return nsd_no_memory;
+    }
+    nsd_slab_init(tree->slab);
+    nsd_slab_allocator(tree->slab, &tree->allocator);
+    if (tree->concurrent) {
+      if (pthread_mutex_init(&tree->lock, NULL) != 0) {
+        free(tree->slab);
+        tree->slab = NULL;
+        return nsd_no_memory;
+      }
+      tree->allocator.arg = tree;
+      tree->allocator.allocate = locked_allocate;
+      tree->allocator.release = locked_release;
+    }
+  }
+
+  if ((tree->root = alloc_node(tree, nsd_node4)) == NULL) {
+    if (tree->slab != NULL) {
+      if (tree->concurrent) {
+        (void)pthread_mutex_destroy(&tree->lock);
+      }
+      nsd_slab_deinit(tree->slab);
+      free(tree->slab);
+      tree->slab = NULL;
+    }
+    return nsd_no_memory;
+  }
+
+  return nsd_ok;
+}
+
+void
+nsd_deinit_tree(nsd_tree_t *tree)
+{
+  assert(tree != NULL);
+
+  if (tree->rcu != NULL) {
+    nsd_rcu_synchronize(tree->rcu);
+  }
+  /* slab releases all nodes and leaves at once */
+  if (tree->slab != NULL) {
+    if (tree->concurrent) {
+      (void)pthread_mutex_destroy(&tree->lock);
+    }
+    nsd_slab_deinit(tree->slab);
+    free(tree->slab);
+    tree->slab = NULL;
+  } else if (tree->root != NULL) {
+    destroy_node(tree, tree->root);
+  }
+  tree->root = NULL;
+}
+
+static void
+stat_node(
+  const nsd_tree_t *tree,
+  nsd_stats_t *stats,
+  const nsd_node_t *node,
+  size_t height)
+{
+  uint8_t cnt, keys[NSD_MAX_WIDTH];
+  nsd_node_t *children[NSD_MAX_WIDTH];
+  nsd_node_stats_t *node_stats;
+
+  if (nsd_is_leaf(node)) {
+    const nsd_leaf_t *leaf = nsd_leaf_raw(node);
+    stats->leaves++;
+    stats->leaf_bytes += leaf_size(tree, leaf->key_len - leaf->depth);
+    stats->key_bytes += leaf->key_len - leaf->depth;
+    stats->heights[height]++;
+    if (height > stats->max_height) {
+      stats->max_height = height;
+    }
+    return;
+  }
+
+  node_stats = &stats->nodes[node->type];
+  node_stats->count++;
+  node_stats->bytes += node_size(node->type);
+  if (long_prefix(tree, node)) {
+    node_stats->bytes += 1u + node->long_prefix[0];
+  }
+  node_stats->children += node->width;
+  node_stats->fill[node->width]++;
+  stats->prefixes[node->prefix_len]++;
+
+  cnt = gather_children(node, keys, children);
+  for (uint8_t idx = 0; idx < cnt; idx++) {
+    stat_node(tree, stats, children[idx], height + 1);
+  }
+}
+
+void
+nsd_stat_tree(const nsd_tree_t *tree, nsd_stats_t *stats)
+{
+  assert(tree != NULL);
+  assert(stats != NULL);
+
+  memset(stats, 0, sizeof(*stats));
+  stat_node(tree, stats, tree->root, 1);
+  stats->bytes = stats->leaf_bytes;
+  for (int type = 0; type < NSD_NODE_TYPES; type++) {
+    stats->bytes += stats->nodes[type].bytes;
+  }
+}
+
+/* Keys are added in canonical order, hence only nodes on the path to the
+ * previous key can receive more children. Children of those nodes are
+ * gathered in frames, one frame per node, and nodes are created once the
+ * first key that diverges before the depth of the node is added.
+ */
+typedef struct nsd_bulk_frame nsd_bulk_frame_t;
+struct nsd_bulk_frame {
+  uint8_t depth; /**< Index of octet that selects children */
+  uint8_t width;
+  uint8_t keys[NSD_MAX_WIDTH];
+  nsd_node_t *children[NSD_MAX_WIDTH];
+};
+
+struct nsd_bulk {
+  nsd_tree_t *tree;
+  nsd_retcode_t status;
+  nsd_node_t *last; /**< Leaf of previous key */
+  uint8_t key_len;
+  nsd_key_t key; /**< Previous key */
+  uint8_t height;
+  nsd_bulk_frame_t frames[NSD_MAX_HEIGHT];
+};
+
+/* smallest type that fits, same as incremental inserts would pick */
+static nsd_node_type_t
+bulk_type(const nsd_tree_t *tree, const uint8_t *keys, uint8_t width)
+{
+  bool ishost = true;
+
+  if (width <= 4) {
+    return nsd_node4;
+  } else if (width <= 17 && is_reverse(keys, width - 1, keys[width - 1])) {
+    return nsd_node17;
+  } else if (width <= 16) {
+    return nsd_node16;
+  } else if (width <= 32 && use_node32(tree)) {
+    return nsd_node32;
+  }
+
+  for (uint8_t idx = 0; ishost && idx < width; idx++) {
+    ishost = (node38_xlat(keys[idx]) != (uint8_t)-1);
+  }
+
+  if (ishost) {
+    return nsd_node38;
+  } else if (width <= 48) {
+    return nsd_node48;
+  } else {
+    return nsd_node256;
+  }
+}
+
+static void
+bulk_discard(nsd_bulk_t *bulk)
+{
+  for (; bulk->height > 0; bulk->height--) {
+    nsd_bulk_frame_t *frame = &bulk->frames[bulk->height - 1];
+    for (uint8_t idx = 0; idx < frame->width; idx++) {
+      destroy_node(bulk->tree, frame->children[idx]);
+    }
+  }
+  if (bulk->last != NULL) {
+    destroy_node(bulk->tree, bulk->last);
+    bulk->last = NULL;
+  }
+}
+
+/* create node for frame, octets between parent and frame form the prefix */
+static nsd_node_t *
+bulk_close(nsd_bulk_t *bulk, nsd_bulk_frame_t *frame, int parent_depth)
+{
+  int offset = parent_depth + 1;
+  nsd_node_t *node;
+
+  if ((node = alloc_node(bulk->tree, bulk_type(bulk->tree, frame->keys, frame->width))) == NULL) {
+    return NULL;
+  }
+  node->width = frame->width;
+  if (!set_prefix(bulk->tree, node, &bulk->key[offset],
+                  (uint8_t)(frame->depth - offset)))
+  {
+    release_node(bulk->tree, node);
+    return NULL;
+  }
+  fill_node(node, frame->keys, frame->children, frame->width);
+  frame->width = 0;
+
+  return node;
+}
+
+nsd_retcode_t
+nsd_bulk_begin(nsd_tree_t *tree, nsd_bulk_t **bulkp)
+{
+  nsd_bulk_t *bulk;
+
+  assert(tree != NULL);
+  assert(bulkp != NULL);
+
+  if (tree->root->width != 0) {
+    return nsd_bad_parameter;
+  }
+  if ((bulk = malloc(sizeof(*bulk))) == NULL) {
+    return nsd_no_memory;
+  }
+
+  bulk->tree = tree;
+  bulk->status = nsd_ok;
+  bulk->last = NULL;
+  bulk->key_len = 0;
+  /* root selects children by first octet */
+  bulk->height = 1;
+  bulk->frames[0].depth = 0;
+  bulk->frames[0].width = 0;
+
+  *bulkp = bulk;
+  return nsd_ok;
+}
+
+nsd_retcode_t
+nsd_bulk_add(
+  nsd_bulk_t *bulk, const nsd_key_t key, uint8_t key_len, nsd_leaf_t **leafp)
+{
+  uint8_t depth = 0;
+  nsd_leaf_t *leaf;
+  nsd_node_t *node;
+  nsd_bulk_frame_t *frame;
+
+  assert(bulk != NULL);
+  assert(key_len != 0);
+
+  if (bulk->status != nsd_ok) {
+    return bulk->status;
+  }
+
+  if (bulk->last != NULL) {
+    depth = compare_keys(bulk->key, bulk->key_len, key, key_len);
+    if (depth == key_len && depth == bulk->key_len) {
+      if (leafp != NULL) {
+        *leafp = nsd_leaf_raw(bulk->last);
+      }
+      return nsd_ok;
+    }
+    /* keys cannot be prefixes */
+    if (depth == key_len || depth == bulk->key_len || key[depth] < bulk->key[depth]) {
+      return nsd_bad_parameter;
+    }
+
+    /* nodes below depth at which keys diverge are complete */
+    node = bulk->last;
+    bulk->last = NULL;
+    while ((frame = &bulk->frames[bulk->height - 1])->depth > depth) {
+      int parent_depth = bulk->frames[bulk->height - 2].depth;
+      frame->keys[frame->width] = bulk->key[frame->depth];
+      frame->children[frame->width++] = node;
+      if (parent_depth < depth) {
+        parent_depth = depth;
+      }
+      if ((node = bulk_close(bulk, frame, parent_depth)) == NULL) {
+        goto no_memory;
+      }
+      bulk->height--;
+    }
+
+    if (frame->depth < depth) {
+      frame = &bulk->frames[bulk->height++];
+      frame->depth = depth;
+      frame->width = 0;
+    }
+    frame->keys[frame->width] = bulk->key[depth];
+    frame->children[frame->width++] = node;
+  }
+
+  /* leaf is selected by the octet at which keys diverge or a later one */
+  if ((leaf = make_leaf(bulk->tree, key, key_len, depth + 1)) == NULL) {
+    goto no_memory;
+  }
+  bulk->last = SET_LEAF(leaf);
+  memcpy(bulk->key, key, key_len);
+  bulk->key_len = key_len;
+  if (leafp != NULL) {
+    *leafp = leaf;
+  }
+  return nsd_ok;
+no_memory:
+  bulk_discard(bulk);
+  bulk->status = nsd_no_memory;
+  return nsd_no_memory;
+}
+
+nsd_retcode_t
+nsd_bulk_end(nsd_bulk_t *bulk)
+{
+  nsd_retcode_t ret;
+  nsd_node_t *node, *root;
+  nsd_tree_t *tree;
+  nsd_bulk_frame_t *frame;
+
+  assert(bulk != NULL);
+
+  tree = bulk->tree;
+  if ((ret = bulk->status) != nsd_ok || bulk->last == NULL) {
+    free(bulk);
+    return ret;
+  }
+
+  node = bulk->last;
+  bulk->last = NULL;
+  for (; bulk->height > 1; bulk->height--) {
+    frame = &bulk->frames[bulk->height - 1];
+    frame->keys[frame->width] = bulk->key[frame->depth];
+    frame->children[frame->width++] = node;
+    node = bulk_close(bulk, frame, bulk->frames[bulk->height - 2].depth);
+    if (node == NULL) {
+      goto no_memory;
+    }
+  }
+
+  frame = &bulk->frames[0];
+  frame->keys[frame->width] = bulk->key[0];
+  frame->children[frame->width++] = node;
+  /* root never has a prefix */
+  if ((root = bulk_close(bulk, frame, -1)) == NULL) {
+    goto no_memory;
+  }
+
+  node = tree->root;
+  __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+  free_node(tree, node);
+  free(bulk);
+  return nsd_ok;
+no_memory:
+  bulk_discard(bulk);
+  free(bulk);
+  return nsd_no_memory;
+}
+
+/* Keys are partitioned by first octet. Octets of keys under a first octet
+ * that holds more than its share of keys are equal up to some depth, those
+ * keys are partitioned by the octet at that depth too. Partitions are
+ * assigned to workers in key order and trees of workers are merged once all
+ * workers finish. Subtrees that occur in multiple trees are combined in new
+ * nodes, all of which are allocated before trees of workers are modified so
+ * that failure leaves them intact.
+ */
+#define BUILD_MIN_KEYS (4096) /**< Minimum number of keys per worker */
+
+typedef struct build_worker build_worker_t;
+struct build_worker {
+  nsd_tree_t tree;
+  nsd_lookup_t *keys;
+  const size_t *order; /**< Indexes of keys assigned to worker */
+  size_t count;
+  nsd_retcode_t status;
+  pthread_t thread;
+};
+
+/* subtree at depth, skip octets of the prefix are consumed by a new node */
+typedef struct build_item build_item_t;
+struct build_item {
+  nsd_node_t *node;
+  uint8_t skip;
+  uint8_t key;
+};
+
+typedef enum {
+  build_shorten, /**< Remove skip octets from prefix of node */
+  build_release, /**< Node is replaced by a new node */
+  build_alloc /**< Node is new */
+} build_action_t;
+
+typedef struct build_change build_change_t;
+struct build_change {
+  build_action_t action;
+  uint8_t skip;
+  uint8_t depth; /**< Depth of first octet of prefix before it is shortened */
+  nsd_node_t *node;
+};
+
+typedef struct build_merge build_merge_t;
+struct build_merge {
+  nsd_tree_t *tree;
+  size_t count, size;
+  build_change_t *changes;
+};
+
+static void *
+build_worker(void *arg)
+{
+  build_worker_t *worker = arg;
+  nsd_path_t path;
+
+  for (size_t idx = 0; idx < worker->count; idx++) {
+    nsd_lookup_t *lookup = &worker->keys[worker->order[idx]];
+    path.height = 0;
+    worker->status = nsd_make_path(
+      &worker->tree, &path, lookup->key, lookup->key_len);
+    if (worker->status != nsd_ok) {
+      break;
+    }
+    lookup->leaf = nsd_leaf_raw(*path.levels[path.height - 1].noderef);
+  }
+
+  return NULL;
+}
+
+static bool
+build_change(
+  build_merge_t *merge,
+  build_action_t action,
+  nsd_node_t *node,
+  uint8_t skip,
+  uint8_t depth)
+{
+  if (merge->count == merge->size) {
+    size_t size = merge->size ? merge->size * 2 : 64;
+    build_change_t *changes;
+    if (!(changes = realloc(merge->changes, size * sizeof(*changes)))) {
+      return false;
+    }
+    merge->changes = changes;
+    merge->size = size;
+  }
+
+  merge->changes[merge->count++] = (build_change_t){ action, skip, depth, node };
+  return true;
+}
+
+static inline uint8_t
+build_octet(
+  const nsd_tree_t *tree, const build_item_t *item, uint8_t depth, uint8_t off)
+{
+  if (nsd_is_leaf(item->node)) {
+    const nsd_leaf_t *leaf = nsd_leaf_raw(item->node);
+    return leaf->key[depth + off - leaf->depth];
+  }
+  return load_prefix(tree, item->node, depth - item->skip)[item->skip + off];
+}
+
+/* combine subtrees at depth that hold disjoint sets of keys */
+static nsd_node_t *
+build_merge(
+  build_merge_t *merge,
+  const build_item_t *items,
+  size_t count,
+  uint8_t depth)
+{
+  uint8_t len = UINT8_MAX, width = 0, keys[NSD_MAX_WIDTH];
+  uint8_t prefix[NSD_MAX_HEIGHT];
+  nsd_node_t *node = NULL, *children[NSD_MAX_WIDTH];
+  build_item_t *next;
+  size_t cnt = 0;
+
+  if (count == 1) {
+    node = items[0].node;
+    if (!nsd_is_leaf(node) && items[0].skip != 0 &&
+        !build_change(merge, build_shorten, node, items[0].skip,
+                      (uint8_t)(depth - items[0].skip)))
+    {
+      return NULL;
+    }
+    return node;
+  }
+
+  /* octets that all subtrees have in common form the prefix */
+  for (size_t idx = 0; idx < count; idx++) {
+    const nsd_node_t *item = items[idx].node;
+    uint8_t max;
+    if (nsd_is_leaf(item)) {
+      max = (uint8_t)(nsd_leaf_raw(item)->key_len - depth - 1);
+    } else {
+      max = (uint8_t)(item->prefix_len - items[idx].skip);
+    }
+    len = len < max ? len : max;
+  }
+  for (uint8_t off = 0; off < len; off++) {
+    uint8_t octet = build_octet(merge->tree, &items[0], depth, off);
+    for (size_t idx = 1; idx < count; idx++) {
+      if (build_octet(merge->tree, &items[idx], depth, off) != octet) {
+        len = off;
+        break;
+      }
+    }
+  }
+
+  if (!(next = malloc(count * NSD_MAX_WIDTH * sizeof(*next)))) {
+    return NULL;
+  }
+
+  /* subtrees branch on the same octet, or subtrees of subtrees do */
+  for (size_t idx = 0; idx < count; idx++) {
+    nsd_node_t *item = items[idx].node;
+    if (!nsd_is_leaf(item) && item->prefix_len - items[idx].skip == len) {
+      uint8_t keys2[NSD_MAX_WIDTH];
+      nsd_node_t *children2[NSD_MAX_WIDTH];
+      uint8_t width2 = gather_children(item, keys2, children2);
+      for (uint8_t idx2 = 0; idx2 < width2; idx2++) {
+        next[cnt++] = (build_item_t){ children2[idx2], 0, keys2[idx2] };
+      }
+      if (!build_change(merge, build_release, item, 0, 0)) {
+        goto out;
+      }
+    } else {
+      next[cnt++] = (build_item_t){
+        item, (uint8_t)(items[idx].skip + len + 1),
+        build_octet(merge->tree, &items[idx], depth, len) };
+    }
+  }
+
+  /* keys of workers are disjoint and ordered, so are subtrees */
+  for (size_t idx = 0, last; idx < cnt; idx = last) {
+    for (last = idx + 1; last < cnt && next[last].key == next[idx].key; last++) ;
+    assert(last == cnt || next[last].key > next[idx].key);
+    keys[width] = next[idx].key;
+    children[width] = build_merge(merge, &next[idx], last - idx, depth + len + 1);
+    if (children[width++] == NULL) {
+      goto out;
+    }
+  }
+
+  if (!(node = alloc_node(merge->tree, bulk_type(merge->tree, keys, width)))) {
+    goto out;
+  }
+  /* prefixes are stored in full in trees with suffix leaves */
+  for (uint8_t off = 0; off < len; off++) {
+    if (off == NSD_MAX_PREFIX && !merge->tree->suffix_leaves) {
+      break;
+    }
+    prefix[off] = build_octet(merge->tree, &items[0], depth, off);
+  }
+  if (!set_prefix(merge->tree, node, prefix, len)) {
+    release_node(merge->tree, node);
+    node = NULL;
+    goto out;
+  }
+  if (!build_change(merge, build_alloc, node, 0, 0)) {
+    free_prefix(merge->tree, node);
+    release_node(merge->tree, node);
+    node = NULL;
+    goto out;
+  }
+  node->width = width;
+  fill_node(node, keys, children, width);
+out:
+  free(next);
+  return node;
+}
+
+static nsd_retcode_t
+build_stitch(nsd_tree_t *tree, build_worker_t *workers, unsigned int nworkers)
+{
+  build_item_t items[nworkers];
+  build_merge_t merge = { tree, 0, 0, NULL };
+  nsd_node_t *root, *node;
+  size_t count = 0;
+
+  for (unsigned int idx = 0; idx < nworkers; idx++) {
+    if (workers[idx].count != 0) {
+      items[count++] = (build_item_t){ workers[idx].tree.root, 0, 0 };
+    }
+  }
+
+  assert(count != 0);
+  if ((root = build_merge(&merge, items, count, 0)) == NULL) {
+    for (size_t idx = 0; idx < merge.count; idx++) {
+      if (merge.changes[idx].action == build_alloc) {
+        free_prefix(tree, merge.changes[idx].node);
+        release_node(tree, merge.changes[idx].node);
+      }
+    }
+    free(merge.changes);
+    return nsd_no_memory;
+  }
+
+  for (unsigned int idx = 0; idx < nworkers; idx++) {
+    if (workers[idx].count != 0) {
+      workers[idx].tree.root = NULL;
+      nsd_slab_merge(tree->slab, workers[idx].tree.slab);
+    }
+  }
+
+  for (size_t idx = 0; idx < merge.count; idx++) {
+    build_change_t *change = &merge.changes[idx];
+    if (change->action == build_shorten) {
+      cut_prefix(tree, change->node, change->depth, change->skip);
+    } else if (change->action == build_release) {
+      free_prefix(tree, change->node);
+      release_node(tree, change->node);
+    }
+  }
+  free(merge.changes);
+
+  node = tree->root;
+  __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+  free_node(tree, node);
+  return nsd_ok;
+}
+
+static inline uint16_t
+build_owner(
+  const uint16_t *owners, const uint8_t *depths, const nsd_lookup_t *lookup)
+{
+  uint8_t depth = depths[lookup->key[0]];
+  uint8_t octet = lookup->key_len > depth ? lookup->key[depth] : 0;
+  return owners[lookup->key[0] * 256 + octet];
+}
+
+nsd_retcode_t
+nsd_build_parallel(
+  nsd_tree_t *tree, nsd_lookup_t *keys, size_t count, unsigned int threads)
+{
+  nsd_retcode_t ret = nsd_no_memory;
+  size_t share, total, *counts = NULL, *order = NULL, *offsets = NULL;
+  uint16_t *owners = NULL;
+  uint8_t depths[256];
+  const uint8_t *firsts[256] = { NULL };
+  build_worker_t *workers = NULL;
+  nsd_options_t options = { NULL, NULL, 0, false, 0, false };
+  unsigned int nworkers = 0, worker;
+
+  assert(tree != NULL);
+  assert(keys != NULL || count == 0);
+
+  if (tree->root->width != 0) {
+    return nsd_bad_parameter;
+  }
+
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (unsigned int)cpus : 1;
+  }
+  if (threads > count / BUILD_MIN_KEYS) {
+    threads = count < BUILD_MIN_KEYS ? 1 : (unsigned int)(count / BUILD_MIN_KEYS);
+  }
+
+  if (threads == 1 || tree->slab == NULL) {
+    nsd_path_t path;
+    for (size_t idx = 0; idx < count; idx++) {
+      path.height = 0;
+      ret = nsd_make_path(tree, &path, keys[idx].key, keys[idx].key_len);
+      if (ret != nsd_ok) {
+        /* leave tree empty */
+        for (size_t cnt = 0; cnt < idx; cnt++) {
+          path.height = 0;
+          (void)nsd_remove_path(
+            tree, &path, keys[cnt].key, keys[cnt].key_len, NULL);
+        }
+        return ret;
+      }
+      keys[idx].leaf = nsd_leaf_raw(*path.levels[path.height - 1].noderef);
+    }
+    return nsd_ok;
+  }
+
+  if (!(counts = calloc(256 * 256, sizeof(*counts))) ||
+      !(owners = malloc(256 * 256 * sizeof(*owners))) ||
+      !(offsets = calloc(threads + 1, sizeof(*offsets))) ||
+      !(order = malloc(count * sizeof(*order))) ||
+      !(workers = calloc(threads, sizeof(*workers))))
+  {
+    goto out;
+  }
+
+  /* depth at which keys under each first octet differ */
+  for (size_t idx = 0; idx < count; idx++) {
+    const nsd_lookup_t *key = &keys[idx];
+    const uint8_t *first = firsts[key->key[0]];
+    uint8_t depth = 1;
+    counts[key->key[0] * 256]++;
+    if (first == NULL) {
+      firsts[key->key[0]] = key->key;
+      depths[key->key[0]] = key->key_len;
+      continue;
+    }
+    while (depth < depths[key->key[0]] && key->key[depth] == first[depth]) {
+      depth++;
+    }
+    depths[key->key[0]] = depth;
+  }
+
+  share = (count + threads - 1) / threads;
+  for (size_t idx = 0; idx < count; idx++) {
+    const nsd_lookup_t *key = &keys[idx];
+    uint8_t first = key->key[0];
+    if (counts[first * 256] > share && key->key_len > depths[first]) {
+      counts[first * 256 + 1 + key->key[depths[first]]]++;
+    }
+  }
+
+  /* assign partitions to workers in key order */
+  worker = 0;
+  total = 0;
+  for (int first = 0; first < 256; first++) {
+    bool split = counts[first * 256] > share;
+    if (!split) {
+      total += counts[first * 256];
+    }
+    for (int octet = 0; octet < 256; octet++) {
+      owners[first * 256 + octet] = (uint16_t)worker;
+      if (split && octet < 255) {
+        total += counts[first * 256 + 1 + octet];
+      }
+      if ((split || octet == 255) && total >= share && worker + 1 < threads) {
+        worker++;
+        total = 0;
+      }
+    }
+  }
+
+  for (size_t idx = 0; idx < count; idx++) {
+    offsets[build_owner(owners, depths, &keys[idx]) + 1]++;
+  }
+  for (unsigned int idx = 0; idx < threads; idx++) {
+    offsets[idx + 1] += offsets[idx];
+    workers[idx].keys = keys;
+    workers[idx].order = order + offsets[idx];
+    workers[idx].count = offsets[idx + 1] - offsets[idx];
+  }
+  for (size_t idx = 0; idx < count; idx++) {
+    order[offsets[build_owner(owners, depths, &keys[idx])]++] = idx;
+  }
+
+  /* node32 is used by all trees or by none, leaves are merged as is */
+  options.disable_simd = ~tree->simd;
+  options.value_size = tree->value_size;
+  options.suffix_leaves = tree->suffix_leaves;
+  for (nworkers = 0; nworkers < threads; nworkers++) {
+    build_worker_t *build = &workers[nworkers];
+    if (build->count == 0) {
+      continue;
+    }
+    if ((ret = nsd_init_tree(&build->tree, &options)) != nsd_ok) {
+      break;
+    }
+    if (pthread_create(&build->thread, NULL, build_worker, build) != 0) {
+      nsd_deinit_tree(&build->tree);
+      ret = nsd_no_memory;
+      break;
+    }
+  }
+
+  for (unsigned int idx = 0; idx < nworkers; idx++) {
+    if (workers[idx].count != 0) {
+      pthread_join(workers[idx].thread, NULL);
+      if (ret == nsd_ok && workers[idx].status != nsd_ok) {
+        ret = workers[idx].status;
+      }
+    }
+  }
+  if (ret == nsd_ok) {
+    ret = build_stitch(tree, workers, nworkers);
+  }
+  for (unsigned int idx = 0; idx < nworkers; idx++) {
+    if (workers[idx].count != 0) {
+      nsd_deinit_tree(&workers[idx].tree);
+    }
+  }
+
+out:
+  free(workers);
+  free(order);
+  free(offsets);
+  free(owners);
+  free(counts);
+  return ret;
+}
+
+/* Images start with a header, nodes and leaves follow in depth-first order
+ * so that subtrees are stored together. Nodes are copied verbatim, except
+ * that references to children are replaced by offsets, leaves retain the
+ * tag in the least significant bit. Prefixes that exceed the node are stored
+ * in full directly before it, so that lookups compare every octet on the way
+ * down and leaves only store the octets that follow the one that selected
+ * them (suffix). Leaves start with the value if the image stores values.
+ * Nodes and leaves with values are aligned to 8 octets, other leaves to 2.
+ */
+#define SNAPSHOT_MAGIC "NSDSNAP"
+#define SNAPSHOT_ORDER (0x0102u)
+#define SNAPSHOT_VALUES (0x01u) /* leaves store values */
+#define SNAPSHOT_ALIGN(size, align) \
+  (((size) + ((align) - 1u)) & ~(size_t)((align) - 1u))
+
+typedef struct snapshot_header snapshot_header_t;
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint16_t order; /* SNAPSHOT_ORDER in native byte order */
+  uint8_t pointer_size;
+  uint8_t flags;
+  uint64_t size;
+  uint64_t root;
+  uint64_t leaves;
+};
+
+typedef struct snapshot_writer snapshot_writer_t;
+struct snapshot_writer {
+  uint8_t *image;
+  size_t size;
+  size_t image_size;
+  size_t leaves;
+  uintptr_t (*value)(void *arg, void *data);
+  void *arg;
+  const nsd_tree_t *tree;
+};
+
+/* returns offset of reserved space, 0 if out of memory */
+static size_t
+reserve_image(snapshot_writer_t *writer, size_t size, size_t align)
+{
+  size_t offset = SNAPSHOT_ALIGN(writer->size, align);
+
+  if (offset + size > writer->image_size) {
+    size_t image_size = writer->image_size ? writer->image_size : 65536;
+    uint8_t *image;
+    while (offset + size > image_size) {
+      image_size *= 2;
+    }
+    if ((image = realloc(writer->image, image_size)) == NULL) {
+      return 0;
+    }
+    writer->image = image;
+    writer->image_size = image_size;
+  }
+
+  memset(writer->image + writer->size, 0, (offset - writer->size) + size);
+  writer->size = offset + size;
+  return offset;
+}
+
+/* returns offset of node in image, 0 if out of memory. depth is the depth
+   at which the prefix of node, or the suffix of a leaf, starts */
+static uintptr_t
+save_node(snapshot_writer_t *writer, const nsd_node_t *node, uint8_t depth)
+{
+  size_t offset, size, extra = 0;
+  uint8_t keys[256], cnt, width;
+  nsd_node_t *children[256], *copy;
+
+  if (nsd_is_leaf(node)) {
+    const nsd_leaf_t *leaf = nsd_leaf_raw(node);
+    uint8_t *copy, len = leaf->key_len - depth;
+    assert(depth <= leaf->key_len);
+    assert(depth >= leaf->depth);
+    if (writer->value != NULL) {
+      extra = sizeof(uintptr_t);
+    }
+    offset = reserve_image(writer, extra + 1 + len, extra != 0 ? extra : 2u);
+    if (offset == 0) {
+      return 0;
+    }
+    copy = writer->image + offset;
+    if (writer->value != NULL) {
+      uintptr_t value = writer->value(writer->arg, leaf->data);
+      memcpy(copy, &value, sizeof(value));
+    }
+    copy[extra] = len;
+    memcpy(copy + extra + 1, leaf->key + (depth - leaf->depth), len);
+    writer->leaves++;
+    return (uintptr_t)SET_LEAF(offset);
+  }
+
+  if (node->prefix_len > NSD_MAX_PREFIX) {
+    extra = SNAPSHOT_ALIGN(node->prefix_len, 8u);
+  }
+  size = node_size(node->type);
+  if ((offset = reserve_image(writer, extra + size, 8u)) == 0) {
+    return 0;
+  }
+  if (extra != 0) {
+    /* trees are not modified while a snapshot is written */
+    const uint8_t *prefix = load_prefix(writer->tree, node, depth);
+    assert(prefix != NULL);
+    offset += extra;
+    memcpy(writer->image + offset - node->prefix_len, prefix, node->prefix_len);
+  }
+  copy = (nsd_node_t *)(writer->image + offset);
+  memcpy(copy, node, size);
+  copy->version = 0;
+  if (long_prefix(writer->tree, node)) {
+    /* image stores the first octets in the node, never the buffer */
+    memcpy(copy->prefix, writer->image + offset - node->prefix_len,
+           NSD_MAX_PREFIX);
+  }
+  depth += node->prefix_len;
+
+  /* unused slots may hold stale references */
+  switch (node->type) {
+    case nsd_node4:
+      memset(((nsd_node4_t *)copy)->children, 0, sizeof(((nsd_node4_t *)copy)->children));
+      break;
+    case nsd_node16:
+      memset(((nsd_node16_t *)copy)->children, 0, sizeof(((nsd_node16_t *)copy)->children));
+      break;
+    case nsd_node17:
+      memset(((nsd_node17_t *)copy)->children, 0, sizeof(((nsd_node17_t *)copy)->children));
+      break;
+    case nsd_node32:
+      memset(((nsd_node32_t *)copy)->children, 0, sizeof(((nsd_node32_t *)copy)->children));
+      break;
+    case nsd_node38:
+      memset(((nsd_node38_t *)copy)->children, 0, sizeof(((nsd_node38_t *)copy)->children));
+      break;
+    case nsd_node48:
+      memset(((nsd_node48_t *)copy)->children, 0, sizeof(((nsd_node48_t *)copy)->children));
+      break;
+    case nsd_node256:
+      memset(((nsd_node256_t *)copy)->children, 0, sizeof(((nsd_node256_t *)copy)->children));
+      break;
+    default:
+      abort();
+  }
+
+  width = gather_children(node, keys, children);
+  for (cnt = 0; cnt < width; cnt++) {
+    uintptr_t child;
+    nsd_node_t **childref;
+    if ((child = save_node(writer, children[cnt], depth + 1)) == 0) {
+      return 0;
+    }
+    /* image may have moved */
+    copy = (nsd_node_t *)(writer->image + offset);
+    childref = find_child(writer->tree->simd, copy, keys[cnt]);
+    if (childref == NULL) {
+      /* direct index slots are only found if not empty */
+      assert(node->type == nsd_node17 ||
+             node->type == nsd_node38 ||
+             node->type == nsd_node256);
+      if (node->type == nsd_node17) {
+        childref = &((nsd_node17_t *)copy)->children[node17_xlat(keys[cnt])];
+      } else if (node->type == nsd_node38) {
+        childref = &((nsd_node38_t *)copy)->children[node38_xlat(keys[cnt])];
+      } else {
+        childref = &((nsd_node256_t *)copy)->children[keys[cnt]];
+      }
+    }
+    *childref = (nsd_node_t *)child;
+  }
+
+  return offset;
+}
+
+nsd_retcode_t
+nsd_save_snapshot(
+  const nsd_tree_t *tree,
+  const char *file,
+  uintptr_t (*value)(void *arg, void *data),
+  void *arg)
+{
+  nsd_retcode_t ret = nsd_ok;
+  snapshot_writer_t writer = { NULL, 0, 0, 0, value, arg, tree };
+  snapshot_header_t *header;
+  uintptr_t root;
+  FILE *fh;
+
+  assert(tree != NULL);
+  assert(file != NULL);
+
+  /* header is at offset 0, which doubles as the error value */
+  (void)reserve_image(&writer, sizeof(*header), 8u);
+  if (writer.image == NULL || (root = save_node(&writer, tree->root, 0)) == 0) {
+    free(writer.image);
+    return nsd_no_memory;
+  }
+
+  header = (snapshot_header_t *)writer.image;
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = NSD_SNAPSHOT_VERSION;
+  header->order = SNAPSHOT_ORDER;
+  header->pointer_size = (uint8_t)sizeof(void *);
+  header->flags = value != NULL ? SNAPSHOT_VALUES : 0;
+  header->size = writer.size;
+  header->root = root;
+  header->leaves = writer.leaves;
+
+  if ((fh = fopen(file, "wb")) == NULL) {
+    ret = nsd_io_error;
+  } else {
+    if (fwrite(writer.image, 1, writer.size, fh) != writer.size) {
+      ret = nsd_io_error;
+    }
+    if (fclose(fh) != 0) {
+      ret = nsd_io_error;
+    }
+  }
+
+  free(writer.image);
+  return ret;
+}
+
+nsd_retcode_t
+nsd_open_snapshot(nsd_snapshot_t *snapshot, const char *file)
+{
+  int fd;
+  struct stat st;
+  void *image;
+  const snapshot_header_t *header;
+
+  assert(snapshot != NULL);
+  assert(file != NULL);
+
+  if ((fd = open(file, O_RDONLY)) == -1) {
+    return nsd_io_error;
+  }
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return nsd_io_error;
+  }
+  if ((size_t)st.st_size < sizeof(*header)) {
+    close(fd);
+    return nsd_bad_parameter;
+  }
+  image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return nsd_io_error;
+  }
+
+  header = image;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != NSD_SNAPSHOT_VERSION ||
+      header->order != SNAPSHOT_ORDER ||
+      header->pointer_size != sizeof(void *) ||
+      (header->flags & ~SNAPSHOT_VALUES) != 0 ||
+      header->size != (uint64_t)st.st_size ||
+      header->root < sizeof(*header) ||
+      header->root >= header->size)
+  {
+    munmap(image, (size_t)st.st_size);
+    return nsd_bad_parameter;
+  }
+
+  snapshot->image = image;
+  snapshot->size = (size_t)st.st_size;
+  snapshot->root = (uintptr_t)header->root;
+  snapshot->leaves = (size_t)header->leaves;
+  snapshot->values = (header->flags & SNAPSHOT_VALUES) != 0;
+  snapshot->simd = nsd_simd_init();
+  return nsd_ok;
+}
+
+void
+nsd_close_snapshot(nsd_snapshot_t *snapshot)
+{
+  assert(snapshot != NULL);
+
+  if (snapshot->image != NULL) {
+    munmap((void *)snapshot->image, snapshot->size);
+  }
+  snapshot->image = NULL;
+  snapshot->size = 0;
+}
+
+nsd_retcode_t
+nsd_find_snapshot(
+  const nsd_snapshot_t *snapshot,
+  const nsd_key_t key,
+  uint8_t key_len,
+  uintptr_t *value)
+{
+  uint8_t depth = 0;
+  uintptr_t offset = snapshot->root;
+  const nsd_node_t *node;
+  nsd_node_t **childref;
+
+  assert(snapshot != NULL);
+  assert(snapshot->image != NULL);
+  assert(key_len != 0);
+
+  for (;;) {
+    node = (const nsd_node_t *)(snapshot->image + offset);
+    if (nsd_is_leaf(node)) {
+      const uint8_t *leaf = (const uint8_t *)nsd_leaf_raw(node);
+      uintptr_t data = 0;
+      if (snapshot->values) {
+        memcpy(&data, leaf, sizeof(data));
+        leaf += sizeof(data);
+      }
+      /* octets before depth were compared in the descent */
+      if (leaf[0] != key_len - depth ||
+          memcmp(leaf + 1, key + depth, leaf[0]) != 0)
+      {
+        return nsd_not_found;
+      }
+      if (value != NULL) {
+        *value = data;
+      }
+      return nsd_ok;
+    } else if (node->prefix_len != 0) {
+      uint8_t len = node->prefix_len;
+      const uint8_t *prefix =
+        len > NSD_MAX_PREFIX ? (const uint8_t *)node - len : node->prefix;
+      if (len >= key_len - depth || memcmp(key + depth, prefix, len) != 0) {
+        return nsd_not_found;
+      }
+      depth += len;
+    }
+
+    if (depth >= key_len || (childref = find_child(snapshot->simd, node, key[depth])) == NULL)
+    {
+      return nsd_not_found;
+    }
+    offset = (uintptr_t)*childref;
+    depth++;
+  }
+}
+
+/* Frozen trees are laid out in van Emde Boas order, the top half of the
+ * levels is stored first, followed by each subtree below it, recursively, so
+ * that a lookup touches few cache lines and pages regardless of the block
+ * size. Nodes start with the width and the length of the prefix, followed by
+ * the prefix in full and either the keys (up to FROZEN_KEYS children) or a
+ * bitmap of keys. Children follow, aligned to 4 octets, as offsets relative
+ * to the node, leaves are tagged in the least significant bit. The position
+ * of a child in the bitmap is the number of bits set before it. Leaves store
+ * data and the octets of the key that follow the octet that selected them.
+ * Nodes are aligned to 4 octets, leaves to 2.
+ */
+#define FROZEN_KEYS (32)
+#define FROZEN_BITMAP (32) /* followed by number of children per word */
+#define FROZEN_PAGE (2u * 1024u * 1024u)
+#define FROZEN_ALIGN(size, align) \
+  (((size) + ((align) - 1u)) & ~(size_t)((align) - 1u))
+
+typedef struct frozen_item frozen_item_t;
+struct frozen_item {
+  const nsd_node_t *node;
+  size_t offset;
+  size_t first; /* index of first child */
+  uint8_t depth; /* depth at which prefix or suffix starts */
+  uint8_t height; /* number of levels in subtree */
+};
+
+static inline size_t
+frozen_header_size(uint8_t width, uint8_t prefix_len)
+{
+  return 2u + prefix_len + (width <= FROZEN_KEYS ? width : FROZEN_BITMAP + 4u);
+}
+
+/* baseline x86-64 has no popcnt, avoid the libgcc call */
+static inline uint8_t
+frozen_popcount(uint64_t bits)
+{
+#if defined(__POPCNT__) || !NSD_X86
+  return (uint8_t)__builtin_popcountll(bits);
+#else
+  bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+  bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+  bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (uint8_t)((bits * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+static inline uint8_t
+frozen_rank(const uint8_t *bitmap, uint8_t key)
+{
+  uint64_t word, bit = 1ull << (key % 64);
+
+  memcpy(&word, bitmap + (key / 64) * sizeof(word), sizeof(word));
+  if (!(word & bit)) {
+    return 0;
+  }
+  return bitmap[FROZEN_BITMAP + key / 64] + frozen_popcount(word & (bit - 1)) + 1;
+}
+
+static size_t
+frozen_size(const frozen_item_t *item)
+{
+  if (nsd_is_leaf(item->node)) {
+    return sizeof(void *) + 1u + nsd_leaf_raw(item->node)->key_len - item->depth;
+  } else {
+    const nsd_node_t *node = item->node;
+    return FROZEN_ALIGN(frozen_header_size(node->width, node->prefix_len), 4u) +
+      node->width * sizeof(uint32_t);
+  }
+}
+
+static void
+place_frozen(frozen_item_t *item, size_t *size)
+{
+  *size = FROZEN_ALIGN(*size, nsd_is_leaf(item->node) ? 2u : 4u);
+  item->offset = *size;
+  *size += frozen_size(item);
+}
+
+static void
+layout_frozen(frozen_item_t *items, size_t idx, uint8_t height, size_t *size);
+
+/* lay out subtrees at level below the node, leaves above were placed */
+static void
+layout_level(
+  frozen_item_t *items, size_t idx, uint8_t level, uint8_t height, size_t *size)
+{
+  if (level == 0) {
+    layout_frozen(items, idx, height, size);
+  } else if (!nsd_is_leaf(items[idx].node)) {
+    for (uint8_t cnt = 0; cnt < items[idx].node->width; cnt++) {
+      layout_level(items, items[idx].first + cnt, level - 1, height, size);
+    }
+  }
+}
+
+/* lay out top height levels of subtree in van Emde Boas order */
+static void
+layout_frozen(frozen_item_t *items, size_t idx, uint8_t height, size_t *size)
+{
+  uint8_t top;
+
+  if (height == 1 || nsd_is_leaf(items[idx].node)) {
+    place_frozen(&items[idx], size);
+    return;
+  }
+
+  top = height / 2;
+  layout_frozen(items, idx, top, size);
+  layout_level(items, idx, top, height - top, size);
+}
+
+static void
+write_frozen(
+  const nsd_tree_t *tree,
+  uint8_t *image,
+  const frozen_item_t *items,
+  size_t idx)
+{
+  const frozen_item_t *item = &items[idx];
+  uint8_t *copy = image + item->offset;
+  uint8_t keys[256], cnt, width;
+  nsd_node_t *children[256];
+  uint32_t *offsets;
+
+  if (nsd_is_leaf(item->node)) {
+    const nsd_leaf_t *leaf = nsd_leaf_raw(item->node);
+    uint8_t len = leaf->key_len - item->depth;
+    memcpy(copy, &leaf->data, sizeof(void *));
+    copy[sizeof(void *)] = len;
+    assert(item->depth >= leaf->depth);
+    memcpy(copy + sizeof(void *) + 1, leaf->key + (item->depth - leaf->depth),
+           len);
+    return;
+  }
+
+  /* trees are not modified while frozen */
+  width = gather_children(item->node, keys, children);
+  assert(width == item->node->width);
+  copy[0] = width;
+  copy[1] = item->node->prefix_len;
+  if (item->node->prefix_len != 0) {
+    const uint8_t *prefix = load_prefix(tree, item->node, item->depth);
+    assert(prefix != NULL);
+    memcpy(copy + 2, prefix, item->node->prefix_len);
+  }
+
+  copy += 2 + item->node->prefix_len;
+  if (width <= FROZEN_KEYS) {
+    memcpy(copy, keys, width);
+  } else {
+    uint64_t bitmap[4] = { 0, 0, 0, 0 };
+    for (cnt = 0; cnt < width; cnt++) {
+      bitmap[keys[cnt] / 64] |= 1ull << (keys[cnt] % 64);
+    }
+    memcpy(copy, bitmap, sizeof(bitmap));
+    /* children in preceding words */
+    for (cnt = 1; cnt < 4; cnt++) {
+      copy[FROZEN_BITMAP + cnt] = copy[FROZEN_BITMAP + cnt - 1] +
+        frozen_popcount(bitmap[cnt - 1]);
+    }
+  }
+
+  offsets = (uint32_t *)(image + item->offset +
+    FROZEN_ALIGN(frozen_header_size(width, item->node->prefix_len), 4u));
+  for (cnt = 0; cnt < width; cnt++) {
+    const frozen_item_t *child = &items[item->first + cnt];
+    assert(child->node == children[cnt]);
+    offsets[cnt] = (uint32_t)(child->offset - item->offset) |
+      (nsd_is_leaf(child->node) ? 1u : 0u);
+  }
+}
+
+/* lookups are spread over the entire image, back large images by huge pages
+   where supported to avoid a TLB miss for nearly every node */
+static uint8_t *
+alloc_frozen(size_t size)
+{
+  uint8_t *image;
+
+  if (size < FROZEN_PAGE) {
+    return calloc(1, size);
+  }
+
+  size = FROZEN_ALIGN(size, FROZEN_PAGE);
+  if ((image = aligned_alloc(FROZEN_PAGE, size)) == NULL) {
+    return NULL;
+  }
+#if defined(MADV_HUGEPAGE)
+  (void)madvise(image, size, MADV_HUGEPAGE);
+#endif
+  memset(image, 0, size);
+  return image;
+}
+
+nsd_retcode_t
+nsd_freeze(const nsd_tree_t *tree, nsd_frozen_t *frozen)
+{
+  size_t idx, count = 1, size = 0, leaves = 0, max_count = 1024;
+  frozen_item_t *items;
+  uint8_t *image;
+
+  assert(tree != NULL);
+  assert(frozen != NULL);
+
+  if ((items = malloc(max_count * sizeof(*items))) == NULL) {
+    return nsd_no_memory;
+  }
+
+  /* index items in breadth-first order, children of a node are adjacent */
+  items[0].node = tree->root;
+  items[0].depth = 0;
+  for (idx = 0; idx < count; idx++) {
+    frozen_item_t *item = &items[idx];
+    uint8_t keys[256], cnt, width, depth;
+    nsd_node_t *children[256];
+
+    if (nsd_is_leaf(item->node)) {
+      leaves++;
+      continue;
+    }
+
+    item->first = count;
+    depth = item->depth + item->node->prefix_len + 1;
+    width = gather_children(item->node, keys, children);
+    if (count + width > max_count) {
+      frozen_item_t *more;
+      max_count *= 2;
+      if ((more = realloc(items, max_count * sizeof(*items))) == NULL) {
+        free(items);
+        return nsd_no_memory;
+      }
+      items = more;
+      item = &items[idx];
+    }
+    for (cnt = 0; cnt < width; cnt++) {
+      items[count].node = children[cnt];
+      items[count].depth = depth;
+      count++;
+    }
+  }
+
+  /* heights are known once all children are indexed */
+  for (idx = count; idx-- > 0; ) {
+    frozen_item_t *item = &items[idx];
+    item->height = 1;
+    if (!nsd_is_leaf(item->node)) {
+      for (uint8_t cnt = 0; cnt < item->node->width; cnt++) {
+        if (items[item->first + cnt].height >= item->height) {
+          item->height = items[item->first + cnt].height + 1;
+        }
+      }
+    }
+  }
+
+  layout_frozen(items, 0, items[0].height, &size);
+
+  /* relative offsets must fit */
+  if (size > UINT32_MAX || (image = alloc_frozen(size)) == NULL) {
+    free(items);
+    return nsd_no_memory;
+  }
+
+  for (idx = 0; idx < count; idx++) {
+    write_frozen(tree, image, items, idx);
+  }
+
+  free(items);
+  frozen->image = image;
+  frozen->size = size;
+  frozen->leaves = leaves;
+  return nsd_ok;
+}
+
+void
+nsd_free_frozen(nsd_frozen_t *frozen)
+{
+  assert(frozen != NULL);
+
+  free(frozen->image);
+  frozen->image = NULL;
+  frozen->size = 0;
+  frozen->leaves = 0;
+}
+
+nsd_retcode_t
+nsd_find_frozen(
+  const nsd_frozen_t *frozen,
+  const nsd_key_t key,
+  uint8_t key_len,
+  void **data)
+{
+  uint8_t depth = 0;
+  const uint8_t *node;
+
+  assert(frozen != NULL);
+  assert(frozen->image != NULL);
+  assert(key_len != 0);
+
+  node = frozen->image;
+  for (;;) {
+    uint8_t width = node[0], len = node[1], idx;
+    const uint8_t *keys = node + 2 + len;
+    uint32_t offset;
+
+    if (len >= key_len - depth) {
+      return nsd_not_found;
+    }
+    for (uint8_t cnt = 0; cnt < len; cnt++) {
+      if (node[2 + cnt] != key[depth + cnt]) {
+        return nsd_not_found;
+      }
+    }
+    depth += len;
+
+    if (width <= FROZEN_KEYS) {
+      /* a plain scan is cheaper than a vector compare here, the branch is
+         predicted and the load of the next node is issued speculatively */
+      idx = nsd_findeq_u8(key[depth], keys, width);
+    } else {
+      idx = frozen_rank(keys, key[depth]);
+    }
+    if (idx == 0) {
+      return nsd_not_found;
+    }
+
+    offset = ((const uint32_t *)(node +
+      FROZEN_ALIGN(frozen_header_size(width, len), 4u)))[idx - 1];
+    node += offset & ~1u;
+    depth++;
+
+    if (offset & 1u) {
+      /* octets before depth were compared in the descent */
+      const uint8_t *suffix = node + sizeof(void *);
+      if (suffix[0] != key_len - depth ||
+          memcmp(suffix + 1, key + depth, suffix[0]) != 0)
+      {
+        return nsd_not_found;
+      }
+      if (data != NULL) {
+        memcpy(data, node, sizeof(void *));
+      }
+      return nsd_ok;
+    }
+  }
+}
@@ -9,13 +9,19 @@
 #ifndef NSD_TREE_H
 #define NSD_TREE_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "alloc.h"
+#include "rcu.h"
+
 #define NSD_RETCODES(X) \
   X(ok, 0, "Success") \
   X(no_memory, -1, "Out of memory") \
   X(bad_parameter, -2, "Bad parameter") \
+  X(io_error, -3, "Input/output error") \
   X(not_found, 1, "Not found")
 
 #define NSD_RETCODE_ENUM(label, value, ...) \
@@ -67,18 +73,34 @@ enum nsd_retcode {
 typedef uint8_t nsd_key_t[NSD_MAX_HEIGHT];
 
 /* Octets can have any value between 0 and 255, but uppercase letters are
- * converted to lowercase for lookup and 0 is reserved as a terminator, hence
- * the maximum width after conversion is 230.
+ * converted to lowercase for lookup, leaving 230 distinct values, and 0 is
+ * reserved as a terminator, hence the maximum width after conversion is 231.
  */
-#define NSD_MAX_WIDTH (230)
+#define NSD_MAX_WIDTH (231)
 
+/* Prefixes are not limited in length, but only the first NSD_MAX_PREFIX
+ * octets are stored in the node (hybrid path compression). Lookups skip the
+ * remaining octets and compare the key of the leaf in full instead, other
+ * operations read them from any leaf under the node. Trees with suffix
+ * leaves (see @nsd_options_t) store longer prefixes out of line and in full
+ * instead, leaves do not store the octets required.
+ */
 #define NSD_MAX_PREFIX (8)
 
+/* Nodes that index children directly keep a bitmap of keys in use so that
+ * ordered traversal does not require probing every slot.
+ */
+#define NSD_BITMAP_WORDS ((NSD_MAX_WIDTH + 63) / 64)
+
 typedef enum nsd_node_type nsd_node_type_t;
 /** Node types used in the tree */
 enum nsd_node_type {
   nsd_node4, /**< Default (smallest) node */
   nsd_node16, /**< Node to leverage 128-bit SIMD instructions */
+  /* Labels in reverse zones are hexadecimal digits (ip6.arpa) or decimal
+   * numbers (in-addr.arpa).
+   */
+  nsd_node17, /**< Node that stores reverse DNS keys exclusively */
   nsd_node32, /**< Node to leverage 256-bit SIMD instructions (if available) */
   /* Octets can have any value between 0x00 and 0xff, but most domain names
    * stick to the preferred syntax as outlined in RFC 1035 section 2.3.1.
@@ -88,12 +110,23 @@ enum nsd_node_type {
   nsd_node256
 };
 
+/* Header is 16 octets so that the keys of node4, node16 and node32 directly
+ * follow it. Nodes are allocated so that header and keys share a cache line,
+ * children follow.
+ */
 typedef struct nsd_node nsd_node_t;
 struct nsd_node {
-  nsd_node_type_t type;
+  uint8_t type; /**< @nsd_node_type_t */
   uint8_t width;
   uint8_t prefix_len;
-  uint8_t prefix[NSD_MAX_PREFIX];
+  uint32_t version; /**< Version and lock in concurrent trees */
+  union {
+    uint8_t prefix[NSD_MAX_PREFIX];
+    /** Size of allocation followed by the prefix in full, used instead of
+        prefix if prefix_len exceeds NSD_MAX_PREFIX in trees with suffix
+        leaves */
+    uint8_t *long_prefix;
+  };
 };
 
 typedef struct nsd_node4 nsd_node4_t;
@@ -110,6 +143,15 @@ struct nsd_node16 {
   nsd_node_t *children[16];
 };
 
+/* Used if a node stores digits, "a..f" and the label separator
+   exclusively. */
+typedef struct nsd_node17 nsd_node17_t;
+struct nsd_node17 {
+  nsd_node_t base;
+  uint32_t bitmap;
+  nsd_node_t *children[17];
+};
+
 /* Used if CPU supports AVX2 extensions. */
 typedef struct nsd_node32 nsd_node32_t;
 struct nsd_node32 {
@@ -122,12 +164,14 @@ struct nsd_node32 {
 typedef struct nsd_node38 nsd_node38_t;
 struct nsd_node38 {
   nsd_node_t base;
+  uint64_t bitmap;
   nsd_node_t *children[38];
 };
 
 typedef struct nsd_node48 nsd_node48_t;
 struct nsd_node48 {
   nsd_node_t base;
+  uint64_t bitmap[NSD_BITMAP_WORDS];
   uint8_t keys[NSD_MAX_WIDTH];
   nsd_node_t *children[48];
 };
@@ -135,6 +179,7 @@ struct nsd_node48 {
 typedef struct nsd_node256 nsd_node256_t;
 struct nsd_node256 {
   nsd_node_t base;
+  uint64_t bitmap[NSD_BITMAP_WORDS];
   nsd_node_t *children[NSD_MAX_WIDTH];
 };
 
@@ -142,6 +187,9 @@ typedef struct nsd_leaf nsd_leaf_t;
 struct nsd_leaf {
   void *data;
   uint8_t key_len;
+  /** Number of octets at the start of the key that are not stored, always
+      0 unless the tree has suffix leaves (see @nsd_options_t) */
+  uint8_t depth;
   uint8_t key[]; /* dynamically sized, avoids use of a pointer */
 };
 
@@ -157,6 +205,24 @@ nsd_leaf_raw(const nsd_node_t *node)
   return ((nsd_leaf_t*)((void*)((uintptr_t)node & ~1)));
 }
 
+/**
+ * @brief Get value stored inline in leaf
+ *
+ * Values follow the key, aligned to 8 octets, and are zeroed when the leaf
+ * is created and released with the leaf. Like data, values are not
+ * synchronized by the tree. Snapshots and frozen trees do not store them.
+ *
+ * @param[in]  leaf  Leaf of a tree with a value size (see @nsd_options_t)
+ *
+ * @returns Value of leaf
+ */
+inline void *
+nsd_leaf_value(const nsd_leaf_t *leaf)
+{
+  size_t size = sizeof(*leaf) + (leaf->key_len - leaf->depth);
+  return (uint8_t *)leaf + ((size + 7u) & ~(size_t)7u);
+}
+
 typedef struct nsd_level nsd_level_t;
 struct nsd_level {
   uint8_t depth;
@@ -167,16 +233,151 @@ typedef struct nsd_path nsd_path_t;
 struct nsd_path {
   uint8_t height;
   nsd_level_t levels[NSD_MAX_HEIGHT];
+  /** Copy of the reference at the last level, which the last level refers
+      to in concurrent trees */
+  nsd_node_t *last;
+};
+
+/* Trees can be shared with any number of lock-free readers if a reclamation
+ * domain is specified. The writer never modifies nodes that are reachable
+ * for readers. Instead, nodes in the path are copied, modified and published
+ * by atomically replacing the root. Replaced nodes are retired and reclaimed
+ * once readers pass through a quiescent state. A single writer is supported,
+ * writers must be serialized by the application.
+ *
+ * Leaves are visible to readers as soon as @nsd_make_path returns. The writer
+ * must set data using an atomic store with release semantics and readers must
+ * treat leaves without data as nonexistent. Data that is replaced must be
+ * retired by the writer.
+ *
+ * Concurrent trees support any number of writers by means of optimistic lock
+ * coupling (ART-OLC). Every node carries a version that writers increment
+ * when they unlock the node. Writers modify nodes in place and lock only the
+ * nodes they modify or replace, plus the parent of a node they replace.
+ * Readers do not lock, they restart if the version of a node changed while
+ * it was read. Nodes that are replaced are retired, writers must therefore
+ * be registered with the reclamation domain and be online, like readers.
+ * Paths record the state at the time of the operation. The last level refers
+ * to a copy of the reference in the path, other levels must not be
+ * dereferenced and paths cannot be resumed. @nsd_find_path, @nsd_make_path,
+ * their _from variants and @nsd_remove_path may be used concurrently, other
+ * operations require that there are no writers.
+ */
+typedef struct nsd_options nsd_options_t;
+struct nsd_options {
+  nsd_rcu_t *rcu; /**< Reclamation domain if tree is shared (optional) */
+  /** Allocator for nodes and leaves (optional), a slab owned by the tree is
+      used by default */
+  const nsd_allocator_t *allocator;
+  /** SIMD extensions not to use (optional), e.g. @NSD_SIMD_AVX2. Applies to
+      node searches, @nsd_make_tree_key and the choice of node types (node32
+      requires AVX2) */
+  uint32_t disable_simd;
+  /** Allow concurrent writers, requires a reclamation domain and, if
+      specified, a thread-safe allocator (optional) */
+  bool concurrent;
+  /** Size of a value stored inline in every leaf (optional), see
+      @nsd_leaf_value */
+  size_t value_size;
+  /** Leaves only store the octets of the key that follow the octet that
+      selected them when they were created and prefixes are stored in full,
+      so that lookups compare every octet on the way down (optional). Paths
+      passed to nsd_find_path_from and nsd_make_path_from restart at the
+      root */
+  bool suffix_leaves;
 };
 
 typedef struct nsd_tree nsd_tree_t;
 struct nsd_tree {
   nsd_node_t *root;
+  nsd_rcu_t *rcu;
+  nsd_allocator_t allocator;
+  nsd_slab_t *slab; /**< Default allocator, NULL if allocator was specified */
+  /** SIMD extensions in use, selected once by @nsd_init_tree, see simd.h */
+  uint32_t simd;
+  bool concurrent;
+  size_t value_size; /**< Size of value stored inline in leaves */
+  bool suffix_leaves; /**< Leaves store suffixes, see @nsd_options_t */
+  pthread_mutex_t lock; /**< Protects default slab in concurrent trees */
 };
 
+/**
+ * @brief Initialize tree
+ *
+ * @param[out]  tree     Tree
+ * @param[in]   options  Options (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Tree initialized
+ * @retval @nsd_bad_parameter
+ *   Concurrent tree without reclamation domain
+ * @retval @nsd_no_memory
+ *   Out of memory
+ */
+nsd_retcode_t
+nsd_init_tree(nsd_tree_t *tree, const nsd_options_t *options)
+__attribute__((nonnull(1)));
+
+/**
+ * @brief Release all nodes and leaves, data is not released
+ *
+ * Readers must no longer access the tree. Shared trees wait for a grace
+ * period to release retired nodes, the caller must therefore not be online
+ * in the reclamation domain (see @nsd_rcu_synchronize).
+ */
+void
+nsd_deinit_tree(nsd_tree_t *tree)
+__attribute__((nonnull));
+
+/* Statistics describe the memory and shape of a tree, e.g. to determine
+ * bytes per name or whether promotion thresholds suit the data.
+ */
+#define NSD_NODE_TYPES (nsd_node256 + 1)
+
+typedef struct nsd_node_stats nsd_node_stats_t;
+struct nsd_node_stats {
+  size_t count;
+  size_t bytes;
+  size_t children;
+  /** Number of nodes by number of children, e.g. fill[20] counts nodes
+      with 20 children */
+  size_t fill[NSD_MAX_WIDTH + 1];
+};
+
+typedef struct nsd_stats nsd_stats_t;
+struct nsd_stats {
+  nsd_node_stats_t nodes[NSD_NODE_TYPES]; /**< Inner nodes by type */
+  size_t leaves;
+  size_t leaf_bytes; /**< Octets allocated for leaves, keys included */
+  size_t key_bytes; /**< Octets of keys stored in leaves */
+  size_t bytes; /**< Octets allocated for nodes and leaves */
+  /** Number of inner nodes by prefix length */
+  size_t prefixes[NSD_MAX_HEIGHT];
+  /** Number of leaves by height of the path to the leaf, i.e. number of
+      inner nodes passed plus one */
+  size_t heights[NSD_MAX_HEIGHT + 1];
+  size_t max_height;
+};
+
+/**
+ * @brief Gather statistics on memory and shape of tree
+ *
+ * Every node is visited. Writers must not modify the tree concurrently.
+ *
+ * @param[in]   tree   Tree
+ * @param[out]  stats  Statistics
+ */
+void
+nsd_stat_tree(const nsd_tree_t *tree, nsd_stats_t *stats)
+__attribute__((nonnull));
+
 /**
  * @brief Create key suitable for tree
  *
+ * Octets in key beyond the returned length may be modified.
+ *
  * @param[out]  key   Key
  * @param[in]   name  Domain name in wire format
  *
@@ -186,6 +387,22 @@ uint8_t
 nsd_make_key(nsd_key_t key, const uint8_t *name)
 __attribute__((nonnull));
 
+/**
+ * @brief Create key suitable for tree using only SIMD extensions of tree
+ *
+ * Keys are identical to keys created with @nsd_make_key, extensions disabled
+ * for tree (see @nsd_options_t) are not used.
+ *
+ * @param[in]   tree  Tree
+ * @param[out]  key   Key
+ * @param[in]   name  Domain name in wire format
+ *
+ * @returns Length of key in octets or 0 if name is invalid
+ */
+uint8_t
+nsd_make_tree_key(const nsd_tree_t *tree, nsd_key_t key, const uint8_t *name)
+__attribute__((nonnull));
+
 /**
  * @brief Find key and register nodes in the path
  *
@@ -209,6 +426,97 @@ nsd_find_path(
   uint8_t key_len)
 __attribute__((nonnull(1,2)));
 
+/**
+ * @brief Find key starting from the path of a previous key
+ *
+ * Finger search for keys that are looked up in sorted order. Levels of the
+ * path that key does not share with the previous key are discarded and the
+ * descent continues from the longest common prefix, so that only the octets
+ * that differ are visited. Results are identical to those of @nsd_find_path
+ * with an empty path. Paths in concurrent trees cannot be resumed, the
+ * descent always starts at the root.
+ *
+ * @param[in]      tree     Tree
+ * @param[in,out]  path     Path recorded by @nsd_find_path, @nsd_make_path
+ *                          or either function with a _from suffix, nodes in
+ *                          the path must not have been modified since, or
+ *                          an empty path
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists, path recorded in @path
+ * @retval @nsd_not_found
+ *   Key does not exist, maximum path recorded in @path
+ */
+nsd_retcode_t
+nsd_find_path_from(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Find key without registering nodes in a path
+ *
+ * Cheaper than @nsd_find_path for callers that only need the leaf, nothing
+ * is written while descending the tree.
+ *
+ * @param[in]   tree     Tree
+ * @param[in]   key      Key previously created with @nsd_make_key
+ * @param[in]   key_len  Length of specified key
+ * @param[out]  leaf     Leaf for key (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists
+ * @retval @nsd_not_found
+ *   Key does not exist
+ */
+nsd_retcode_t
+nsd_find(
+  nsd_tree_t *tree,
+  const nsd_key_t key,
+  uint8_t key_len,
+  nsd_leaf_t **leaf)
+__attribute__((nonnull(1)));
+
+/**
+ * @brief Find domain name in a DNS message and register nodes in the path
+ *
+ * Avoids creating a key. Compression pointers (RFC 1035 section 4.1.4) are
+ * followed and octets are transformed as the descent requires them, labels
+ * beyond the point where the name is found not to exist are never
+ * transformed.
+ *
+ * @param[in]   tree        Tree
+ * @param[out]  path        Path
+ * @param[in]   packet      DNS message
+ * @param[in]   packet_len  Length of DNS message in octets
+ * @param[in]   offset      Offset of domain name in DNS message
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Name exists, path recorded in @path
+ * @retval @nsd_not_found
+ *   Name does not exist, maximum path recorded in @path
+ * @retval @nsd_bad_parameter
+ *   Name is malformed or exceeds the message, @path is empty
+ */
+nsd_retcode_t
+nsd_find_wire(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const uint8_t *packet,
+  size_t packet_len,
+  size_t offset)
+__attribute__((nonnull(1,2,3)));
+
 /**
  * @brief Create key and register nodes in path
  *
@@ -232,4 +540,477 @@ nsd_make_path(
   uint8_t key_len)
 __attribute__((nonnull(1,2)));
 
+/**
+ * @brief Create key starting from the path of a previous key
+ *
+ * Equivalent to @nsd_make_path with an empty path, but the descent continues
+ * from the longest common prefix with the previous key as in
+ * @nsd_find_path_from.
+ *
+ * @param[in]      tree     Tree
+ * @param[in,out]  path     Path of previous key (see @nsd_find_path_from)
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key is created or existed already, path registered in @path
+ * @retval @nsd_no_memory
+ *   Key cannot be created, insufficient memory was available
+ */
+nsd_retcode_t
+nsd_make_path_from(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+__attribute__((nonnull(1,2)));
+
+#define NSD_BATCH_WIDTH (16) /**< Maximum number of lookups in flight */
+
+typedef struct nsd_lookup nsd_lookup_t;
+struct nsd_lookup {
+  const uint8_t *key;
+  uint8_t key_len;
+  nsd_leaf_t *leaf; /**< Leaf for key if key exists, NULL otherwise */
+};
+
+/**
+ * @brief Find multiple keys at once
+ *
+ * Up to @NSD_BATCH_WIDTH lookups are interleaved and nodes are prefetched
+ * before they are accessed so that cache misses for independent lookups
+ * overlap. Paths are not recorded.
+ *
+ * @param[in]      tree     Tree
+ * @param[in,out]  lookups  Keys previously created with @nsd_make_key
+ * @param[in]      count    Number of lookups
+ *
+ * @returns Number of keys that exist
+ */
+size_t
+nsd_find_batch(nsd_tree_t *tree, nsd_lookup_t *lookups, size_t count)
+__attribute__((nonnull(1)));
+
+/**
+ * @brief Find key or closest encloser and register nodes in the path
+ *
+ * The closest encloser is the longest existing ancestor of a domain name
+ * (RFC 4592 section 3.3.1). Ancestors are located in the same descent as
+ * the key itself because labels are stored root-first and separated by 0x00,
+ * i.e. a node that branches on 0x00 at the start of a label holds the
+ * ancestor that ends with the preceding label.
+ *
+ * @param[in]      tree     Tree
+ * @param[out]     path     Path
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists, path recorded in @path
+ * @retval @nsd_not_found
+ *   Key does not exist, path to closest encloser recorded in @path or @path
+ *   is empty if no ancestor exists
+ */
+nsd_retcode_t
+nsd_find_encloser(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Position path at first key greater than or equal to key
+ *
+ * Keys are ordered by octet value, which is canonical order (RFC 4034
+ * section 6.1) for keys created with @nsd_make_key.
+ *
+ * @param[in]      tree     Tree
+ * @param[out]     path     Path
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Path registered in @path, leaf at top of path is equal to or greater
+ *   than @key
+ * @retval @nsd_not_found
+ *   All keys are less than @key, @path is empty
+ */
+nsd_retcode_t
+nsd_seek(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Find key or key that precedes it and register nodes in the path
+ *
+ * Used to locate the name that precedes a nonexistent name in canonical
+ * order, e.g. to prove nonexistence with NSEC records (RFC 4034 section 4).
+ * Nodes registered by a failed lookup with @nsd_find_path are reused and the
+ * predecessor is found by backtracking over the levels in the path once.
+ *
+ * @param[in]      tree     Tree
+ * @param[in,out]  path     Path, empty or registered by @nsd_find_path
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists, path recorded in @path
+ * @retval @nsd_not_found
+ *   Key does not exist, path to preceding key recorded in @path or @path is
+ *   empty if all keys are greater than @key
+ */
+nsd_retcode_t
+nsd_find_prev(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Move path to next key in order
+ *
+ * An empty path is moved to the first key.
+ *
+ * @param[in]      tree  Tree
+ * @param[in,out]  path  Path registered by a previous operation
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Path to next key registered in @path
+ * @retval @nsd_not_found
+ *   Path was at last key (or tree is empty), @path is not modified
+ */
+nsd_retcode_t
+nsd_next(nsd_tree_t *tree, nsd_path_t *path)
+__attribute__((nonnull));
+
+/**
+ * @brief Move path to previous key in order
+ *
+ * An empty path is moved to the last key.
+ *
+ * @param[in]      tree  Tree
+ * @param[in,out]  path  Path registered by a previous operation
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Path to previous key registered in @path
+ * @retval @nsd_not_found
+ *   Path was at first key (or tree is empty), @path is not modified
+ */
+nsd_retcode_t
+nsd_prev(nsd_tree_t *tree, nsd_path_t *path)
+__attribute__((nonnull));
+
+/**
+ * @brief Remove key and shrink nodes in path
+ *
+ * Nodes that hold considerably fewer children than they can accommodate are
+ * replaced by smaller nodes. Nodes that are left with a single child are
+ * merged with said child if prefixes allow it.
+ *
+ * @param[in]      tree     Tree
+ * @param[in,out]  path     Path
+ * @param[in]      key      Key previously created with @nsd_make_key
+ * @param[in]      key_len  Length of specified key
+ * @param[out]     data     Data associated with the removed key (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key is removed, path registered in @path up to the node that held the
+ *   key, which might have been replaced
+ * @retval @nsd_not_found
+ *   Key does not exist, maximum path recorded in @path
+ */
+nsd_retcode_t
+nsd_remove_path(
+  nsd_tree_t *tree,
+  nsd_path_t *path,
+  const nsd_key_t key,
+  uint8_t key_len,
+  void **data)
+__attribute__((nonnull(1,2)));
+
+/* Trees can be built bottom-up from keys in canonical order. Every node is
+ * created once, at its final type and width, which is considerably faster
+ * than inserting keys one by one. Nodes are published once the bulk load is
+ * finished.
+ */
+typedef struct nsd_bulk nsd_bulk_t;
+
+/**
+ * @brief Start bulk load into an empty tree
+ *
+ * @param[in]   tree  Tree
+ * @param[out]  bulk  Bulk load state
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Bulk load started, keys can be added
+ * @retval @nsd_bad_parameter
+ *   Tree is not empty
+ */
+nsd_retcode_t
+nsd_bulk_begin(nsd_tree_t *tree, nsd_bulk_t **bulk)
+__attribute__((nonnull));
+
+/**
+ * @brief Add key to bulk load
+ *
+ * Keys must be added in canonical order. Adding the previous key again is
+ * allowed, the leaf created for that key is returned.
+ *
+ * @param[in]   bulk     Bulk load state
+ * @param[in]   key      Key previously created with @nsd_make_key
+ * @param[in]   key_len  Length of specified key
+ * @param[out]  leaf     Leaf for specified key (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key added
+ * @retval @nsd_bad_parameter
+ *   Key sorts before previous key, key is not added
+ * @retval @nsd_no_memory
+ *   Out of memory, all keys are discarded
+ */
+nsd_retcode_t
+nsd_bulk_add(
+  nsd_bulk_t *bulk, const nsd_key_t key, uint8_t key_len, nsd_leaf_t **leaf)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Finish bulk load, publish keys and release bulk load state
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Keys published
+ * @retval @nsd_no_memory
+ *   Out of memory, all keys are discarded and the tree remains empty
+ */
+nsd_retcode_t
+nsd_bulk_end(nsd_bulk_t *bulk)
+__attribute__((nonnull));
+
+/**
+ * @brief Insert keys using multiple threads
+ *
+ * Keys are partitioned by first octet, or by a longer prefix if a single
+ * octet holds more than its share of keys, which is common as most names in
+ * a zone share the same suffix. Every thread builds the subtrees for its
+ * partitions in a private tree with a private slab. Trees are merged under a
+ * new root once all threads finish and slabs are merged into the slab of the
+ * tree. Keys are not required to be sorted and may occur more than once.
+ * Trees that were initialized with an allocator are built by the calling
+ * thread, allocators are not required to be thread-safe.
+ *
+ * @param[in]      tree     Tree, must be empty
+ * @param[in,out]  keys     Keys previously created with @nsd_make_key, leaf
+ *                          is set to the leaf for the key
+ * @param[in]      count    Number of keys
+ * @param[in]      threads  Number of threads, 0 for number of processors
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Keys inserted and published
+ * @retval @nsd_bad_parameter
+ *   Tree is not empty
+ * @retval @nsd_no_memory
+ *   Out of memory, the tree remains empty
+ */
+nsd_retcode_t
+nsd_build_parallel(
+  nsd_tree_t *tree, nsd_lookup_t *keys, size_t count, unsigned int threads)
+__attribute__((nonnull(1)));
+
+/* Snapshots are images of a tree that can be mapped into memory and searched
+ * without deserialization. Children are referenced by offset from the start
+ * of the image rather than by pointer, which makes images position
+ * independent so that any number of processes can share the pages mapped
+ * from the same file. Nodes retain their in-memory layout, images are
+ * therefore only portable between machines with the same byte order and
+ * pointer size, which is verified when an image is opened. Images are
+ * trusted, offsets are not validated on lookup. Prefixes are stored in full
+ * and compared on the way down, leaves only store the remainder of the key
+ * and optionally a value.
+ */
+#define NSD_SNAPSHOT_VERSION (6)
+
+typedef struct nsd_snapshot nsd_snapshot_t;
+struct nsd_snapshot {
+  const uint8_t *image;
+  size_t size;
+  uintptr_t root; /**< Offset of root node */
+  size_t leaves; /**< Number of leaves in image */
+  bool values; /**< Leaves store values */
+  /** SIMD extensions in use, all supported extensions by default, may be
+      cleared after @nsd_open_snapshot, see simd.h */
+  uint32_t simd;
+};
+
+/**
+ * @brief Write snapshot of tree to file
+ *
+ * Data pointers are meaningless in another process, leaves store a value
+ * (e.g. offset of data in another image) inline instead.
+ *
+ * @param[in]  tree   Tree
+ * @param[in]  file   Name of file to write
+ * @param[in]  value  Function that returns value for data of leaf, leaves
+ *                    do not store values if not specified (optional)
+ * @param[in]  arg    Argument passed to @value (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Snapshot written to @file
+ * @retval @nsd_no_memory
+ *   Out of memory
+ * @retval @nsd_io_error
+ *   Snapshot cannot be written, @errno is set
+ */
+nsd_retcode_t
+nsd_save_snapshot(
+  const nsd_tree_t *tree,
+  const char *file,
+  uintptr_t (*value)(void *arg, void *data),
+  void *arg)
+__attribute__((nonnull(1,2)));
+
+/**
+ * @brief Map snapshot into memory read-only
+ *
+ * @param[out]  snapshot  Snapshot
+ * @param[in]   file      Name of file previously written by @nsd_save_snapshot
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Snapshot mapped
+ * @retval @nsd_bad_parameter
+ *   File is not a snapshot or was written on an incompatible machine
+ * @retval @nsd_io_error
+ *   File cannot be opened or mapped, @errno is set
+ */
+nsd_retcode_t
+nsd_open_snapshot(nsd_snapshot_t *snapshot, const char *file)
+__attribute__((nonnull));
+
+/**
+ * @brief Unmap snapshot
+ */
+void
+nsd_close_snapshot(nsd_snapshot_t *snapshot)
+__attribute__((nonnull));
+
+/**
+ * @brief Find key in snapshot
+ *
+ * @param[in]   snapshot  Snapshot
+ * @param[in]   key       Key previously created with @nsd_make_key
+ * @param[in]   key_len   Length of specified key
+ * @param[out]  value     Value stored for key, 0 if the snapshot stores no
+ *                        values (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists
+ * @retval @nsd_not_found
+ *   Key does not exist
+ */
+nsd_retcode_t
+nsd_find_snapshot(
+  const nsd_snapshot_t *snapshot,
+  const nsd_key_t key,
+  uint8_t key_len,
+  uintptr_t *value)
+__attribute__((nonnull(1)));
+
+/* Frozen trees are immutable copies of a tree in a single buffer. Children
+ * are referenced by 32-bit offsets relative to their parent, nodes store
+ * exactly as many children as they have and prefixes in full, leaves only
+ * store the remainder of the key. Nodes are laid out in van Emde Boas order,
+ * the top half of the levels first, followed by each subtree below it,
+ * recursively, so that lookups touch few cache lines and pages.
+ */
+typedef struct nsd_frozen nsd_frozen_t;
+struct nsd_frozen {
+  uint8_t *image;
+  size_t size; /**< Size of image in octets */
+  size_t leaves; /**< Number of leaves in image */
+};
+
+/**
+ * @brief Create frozen copy of tree
+ *
+ * Leaves in the frozen tree refer to the same data as leaves in @tree, the
+ * tree itself may be destroyed afterwards.
+ *
+ * @param[in]   tree    Tree
+ * @param[out]  frozen  Frozen tree
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Frozen tree created
+ * @retval @nsd_no_memory
+ *   Out of memory or image exceeds 4 GiB
+ */
+nsd_retcode_t
+nsd_freeze(const nsd_tree_t *tree, nsd_frozen_t *frozen)
+__attribute__((nonnull));
+
+/**
+ * @brief Release frozen tree
+ */
+void
+nsd_free_frozen(nsd_frozen_t *frozen)
+__attribute__((nonnull));
+
+/**
+ * @brief Find key in frozen tree
+ *
+ * Results are identical to @nsd_find_path on the tree that was frozen, no
+ * path is recorded as there are no references into the tree to record.
+ *
+ * @param[in]   frozen   Frozen tree
+ * @param[in]   key      Key previously created with @nsd_make_key
+ * @param[in]   key_len  Length of specified key
+ * @param[out]  data     Data of leaf for key (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Key exists
+ * @retval @nsd_not_found
+ *   Key does not exist
+ */
+nsd_retcode_t
+nsd_find_frozen(
+  const nsd_frozen_t *frozen,
+  const nsd_key_t key,
+  uint8_t key_len,
+  void **data)
+__attribute__((nonnull(1)));
+
 #endif /* NSD_TREE_H */
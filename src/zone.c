@@ -0,0 +1,679 @@
+/*
+ * zone.c -- load domain names from zone files into a tree
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "dname.h"
+#include "zone.h"
+
+/* Entries are split into fields by the reader, which takes care of
+ * comments, parentheses and quoting so that the parser only deals with
+ * fields. Fields point into the buffer and remain valid until the next
+ * field is read, the remainder of the buffer is moved to the front when
+ * more data is read so that fields are always contiguous.
+ */
+typedef enum field_type field_type_t;
+enum field_type {
+  FIELD_STRING,
+  FIELD_QUOTED,
+  FIELD_END, /* end of entry */
+  FIELD_EOF
+};
+
+typedef struct field field_t;
+struct field {
+  field_type_t type;
+  bool blank; /* entry starts with blank, i.e. owner is omitted */
+  const char *data;
+  size_t len;
+};
+
+typedef struct reader reader_t;
+struct reader {
+  int fd;
+  char *buffer;
+  size_t pos;
+  size_t end;
+  bool eof;
+  bool start; /* no fields in entry yet */
+  bool blank;
+  size_t line; /* line on which entry starts */
+  unsigned int parens;
+  nsd_zone_stats_t *stats;
+};
+
+typedef struct parser parser_t;
+struct parser {
+  reader_t reader;
+  nsd_tree_t *tree;
+  const nsd_zone_options_t *options;
+  nsd_path_t path;
+  nsd_key_t key;
+  uint8_t origin[DNAME_MAX_LENGTH];
+  int origin_len; /* 0 if no origin is known */
+  uint8_t owner[DNAME_MAX_LENGTH];
+  int owner_len; /* 0 if no owner is known */
+  nsd_leaf_t *leaf;
+  uint32_t ttl; /* $TTL */
+  uint32_t last_ttl;
+  bool has_ttl;
+  bool has_last_ttl;
+  uint16_t class;
+};
+
+static nsd_retcode_t
+syntax_error(reader_t *reader, const char *error)
+{
+  reader->stats->error = error;
+  reader->stats->line = reader->line;
+  return nsd_bad_parameter;
+}
+
+/* move octets from keep onward to the front and fill the buffer, returns
+   nsd_not_found if no data is left */
+static nsd_retcode_t
+refill(reader_t *reader, size_t keep)
+{
+  ssize_t cnt;
+
+  assert(keep <= reader->pos);
+  memmove(reader->buffer, reader->buffer + keep, reader->end - keep);
+  reader->end -= keep;
+  reader->pos -= keep;
+
+  if (reader->eof) {
+    return nsd_not_found;
+  }
+
+  do {
+    cnt = read(reader->fd, reader->buffer + reader->end,
+               NSD_ZONE_BUFFER_SIZE - reader->end);
+  } while (cnt == -1 && errno == EINTR);
+
+  if (cnt == -1) {
+    reader->stats->error = "Cannot read file";
+    return nsd_io_error;
+  } else if (cnt == 0) {
+    reader->eof = true;
+    return nsd_not_found;
+  }
+
+  reader->end += (size_t)cnt;
+  reader->stats->octets += (size_t)cnt;
+  return nsd_ok;
+}
+
+static nsd_retcode_t
+scan_field(reader_t *reader, field_t *field, bool quoted)
+{
+  nsd_retcode_t ret;
+  size_t len = 0;
+
+  if (reader->start) {
+    reader->line = reader->stats->lines + 1;
+  }
+  reader->pos += quoted;
+  for (;;) {
+    size_t idx = reader->pos + len;
+
+    if (len > NSD_ZONE_MAX_FIELD) {
+      return syntax_error(reader, "Field too long");
+    } else if (idx + 1 >= reader->end && !reader->eof) {
+      /* escapes require the next octet as well */
+      if ((ret = refill(reader, reader->pos)) == nsd_ok) {
+        continue;
+      } else if (ret != nsd_not_found) {
+        return ret;
+      }
+      idx = reader->pos + len;
+    }
+
+    if (idx == reader->end) {
+      if (quoted) {
+        return syntax_error(reader, "Missing closing quote");
+      }
+      break;
+    }
+
+    char chr = reader->buffer[idx];
+    if (chr == '\\') {
+      len += idx + 1 < reader->end ? 2 : 1;
+    } else if (quoted) {
+      if (chr == '"') {
+        break;
+      } else if (chr == '\n') {
+        reader->stats->lines++;
+      }
+      len++;
+    } else if (chr == ' ' || chr == '\t' || chr == '\r' || chr == '\n' ||
+               chr == ';' || chr == '(' || chr == ')' || chr == '"')
+    {
+      break;
+    } else {
+      len++;
+    }
+  }
+
+  field->type = quoted ? FIELD_QUOTED : FIELD_STRING;
+  field->blank = reader->blank;
+  field->data = reader->buffer + reader->pos;
+  field->len = len;
+  reader->pos += len + quoted;
+  reader->start = false;
+  return nsd_ok;
+}
+
+static nsd_retcode_t
+next_field(reader_t *reader, field_t *field)
+{
+  nsd_retcode_t ret;
+
+  for (;;) {
+    if (reader->pos == reader->end) {
+      if ((ret = refill(reader, reader->pos)) == nsd_ok) {
+        continue;
+      } else if (ret != nsd_not_found) {
+        return ret;
+      } else if (reader->parens != 0) {
+        return syntax_error(reader, "Missing closing parenthesis");
+      }
+      /* last line is not terminated */
+      field->type = reader->start ? FIELD_EOF : FIELD_END;
+      reader->start = true;
+      return nsd_ok;
+    }
+
+    switch (reader->buffer[reader->pos]) {
+      case '\n':
+        reader->stats->lines++;
+        reader->pos++;
+        if (reader->parens == 0) {
+          reader->blank = false;
+          if (!reader->start) {
+            reader->start = true;
+            field->type = FIELD_END;
+            return nsd_ok;
+          }
+        }
+        break;
+      case ' ':
+      case '\t':
+      case '\r':
+        if (reader->start) {
+          reader->blank = true;
+        }
+        reader->pos++;
+        break;
+      case ';':
+        /* comment extends to end of line */
+        for (;;) {
+          char *eol = memchr(reader->buffer + reader->pos, '\n',
+                             reader->end - reader->pos);
+          if (eol != NULL) {
+            reader->pos = (size_t)(eol - reader->buffer);
+            break;
+          }
+          reader->pos = reader->end;
+          if ((ret = refill(reader, reader->pos)) == nsd_not_found) {
+            break;
+          } else if (ret != nsd_ok) {
+            return ret;
+          }
+        }
+        break;
+      case '(':
+        reader->parens++;
+        reader->pos++;
+        break;
+      case ')':
+        if (reader->parens == 0) {
+          reader->line = reader->stats->lines + 1;
+          return syntax_error(reader, "Unexpected closing parenthesis");
+        }
+        reader->parens--;
+        reader->pos++;
+        break;
+      case '"':
+        return scan_field(reader, field, true);
+      default:
+        return scan_field(reader, field, false);
+    }
+  }
+}
+
+static bool
+is_field(const field_t *field, const char *str)
+{
+  return field->type == FIELD_STRING &&
+         field->len == strlen(str) &&
+         strncasecmp(field->data, str, field->len) == 0;
+}
+
+/* parse decimal number, returns -1 if field is not a number in range */
+static int64_t
+parse_number(const char *data, size_t len, int64_t max)
+{
+  int64_t num = 0;
+
+  if (len == 0) {
+    return -1;
+  }
+  for (size_t cnt = 0; cnt < len; cnt++) {
+    if (data[cnt] < '0' || data[cnt] > '9') {
+      return -1;
+    }
+    num = num * 10 + (data[cnt] - '0');
+    if (num > max) {
+      return -1;
+    }
+  }
+
+  return num;
+}
+
+/* TTLs are in seconds, but units are accepted as well, e.g. 1h30m */
+static bool
+parse_ttl(const field_t *field, uint32_t *ttl)
+{
+  int64_t total = 0, value = 0;
+  bool digits = false;
+
+  if (field->type != FIELD_STRING || field->len == 0) {
+    return false;
+  }
+
+  for (size_t cnt = 0; cnt < field->len; cnt++) {
+    char chr = field->data[cnt];
+    int64_t unit;
+
+    if (chr >= '0' && chr <= '9') {
+      value = value * 10 + (chr - '0');
+      digits = true;
+      if (value > INT32_MAX) {
+        return false;
+      }
+      continue;
+    }
+
+    switch (chr) {
+      case 's': case 'S': unit = 1; break;
+      case 'm': case 'M': unit = 60; break;
+      case 'h': case 'H': unit = 3600; break;
+      case 'd': case 'D': unit = 86400; break;
+      case 'w': case 'W': unit = 604800; break;
+      default: return false;
+    }
+    if (!digits) {
+      return false;
+    }
+    total += value * unit;
+    value = 0;
+    digits = false;
+    if (total > INT32_MAX) {
+      return false;
+    }
+  }
+
+  total += value;
+  /* RFC 2181 section 8, most significant bit is zero */
+  if (total > INT32_MAX) {
+    return false;
+  }
+  *ttl = (uint32_t)total;
+  return true;
+}
+
+static bool
+parse_class(const field_t *field, uint16_t *class)
+{
+  static const struct { const char *name; uint16_t class; } classes[] = {
+    { "IN", 1 }, { "CS", 2 }, { "CH", 3 }, { "HS", 4 }
+  };
+  int64_t num;
+
+  if (field->type != FIELD_STRING) {
+    return false;
+  }
+  for (size_t cnt = 0; cnt < sizeof(classes) / sizeof(classes[0]); cnt++) {
+    if (is_field(field, classes[cnt].name)) {
+      *class = classes[cnt].class;
+      return true;
+    }
+  }
+  /* RFC 3597 section 5 */
+  if (field->len > 5 && strncasecmp(field->data, "CLASS", 5) == 0 &&
+      (num = parse_number(field->data + 5, field->len - 5, UINT16_MAX)) >= 0)
+  {
+    *class = (uint16_t)num;
+    return true;
+  }
+
+  return false;
+}
+
+static bool
+parse_type(const field_t *field, uint16_t *type)
+{
+  static const struct { const char *name; uint16_t type; } types[] = {
+    { "A", 1 }, { "NS", 2 }, { "MD", 3 }, { "MF", 4 }, { "CNAME", 5 },
+    { "SOA", 6 }, { "MB", 7 }, { "MG", 8 }, { "MR", 9 }, { "NULL", 10 },
+    { "WKS", 11 }, { "PTR", 12 }, { "HINFO", 13 }, { "MINFO", 14 },
+    { "MX", 15 }, { "TXT", 16 }, { "RP", 17 }, { "AFSDB", 18 },
+    { "X25", 19 }, { "ISDN", 20 }, { "RT", 21 }, { "NSAP", 22 },
+    { "NSAP-PTR", 23 }, { "SIG", 24 }, { "KEY", 25 }, { "PX", 26 },
+    { "GPOS", 27 }, { "AAAA", 28 }, { "LOC", 29 }, { "NXT", 30 },
+    { "SRV", 33 }, { "NAPTR", 35 }, { "KX", 36 }, { "CERT", 37 },
+    { "A6", 38 }, { "DNAME", 39 }, { "APL", 42 }, { "DS", 43 },
+    { "SSHFP", 44 }, { "IPSECKEY", 45 }, { "RRSIG", 46 }, { "NSEC", 47 },
+    { "DNSKEY", 48 }, { "DHCID", 49 }, { "NSEC3", 50 },
+    { "NSEC3PARAM", 51 }, { "TLSA", 52 }, { "SMIMEA", 53 }, { "HIP", 55 },
+    { "CDS", 59 }, { "CDNSKEY", 60 }, { "OPENPGPKEY", 61 }, { "CSYNC", 62 },
+    { "ZONEMD", 63 }, { "SVCB", 64 }, { "HTTPS", 65 }, { "SPF", 99 },
+    { "NID", 104 }, { "L32", 105 }, { "L64", 106 }, { "LP", 107 },
+    { "EUI48", 108 }, { "EUI64", 109 }, { "URI", 256 }, { "CAA", 257 },
+    { "AVC", 258 }, { "DLV", 32769 }
+  };
+  int64_t num;
+
+  if (field->type != FIELD_STRING) {
+    return false;
+  }
+  for (size_t cnt = 0; cnt < sizeof(types) / sizeof(types[0]); cnt++) {
+    if (is_field(field, types[cnt].name)) {
+      *type = types[cnt].type;
+      return true;
+    }
+  }
+  /* RFC 3597 section 5 */
+  if (field->len > 4 && strncasecmp(field->data, "TYPE", 4) == 0 &&
+      (num = parse_number(field->data + 4, field->len - 4, UINT16_MAX)) >= 0)
+  {
+    *type = (uint16_t)num;
+    return true;
+  }
+
+  return false;
+}
+
+/* returns length of name in wire format, 0 on error */
+static int
+parse_name(parser_t *parser, const field_t *field, uint8_t *name)
+{
+  size_t escapes = 0;
+  int len;
+
+  if (field->type != FIELD_STRING) {
+    return 0;
+  }
+
+  if (field->len == 1 && field->data[0] == '@') {
+    memcpy(name, parser->origin, (size_t)parser->origin_len);
+    return parser->origin_len;
+  }
+
+  /* name is absolute if the last dot is not escaped */
+  for (size_t cnt = field->len - 1; cnt > 0 && field->data[cnt - 1] == '\\'; cnt--) {
+    escapes++;
+  }
+  if ((len = dname_parse(name, field->data, field->len)) < 0) {
+    return 0;
+  } else if (field->data[field->len - 1] == '.' && !(escapes & 1)) {
+    return len;
+  } else if (parser->origin_len == 0 ||
+             len - 1 + parser->origin_len > DNAME_MAX_LENGTH)
+  {
+    return 0;
+  }
+
+  memcpy(name + len - 1, parser->origin, (size_t)parser->origin_len);
+  return len - 1 + parser->origin_len;
+}
+
+static nsd_retcode_t
+expect_end(parser_t *parser, field_t *field)
+{
+  nsd_retcode_t ret;
+
+  if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+    return ret;
+  } else if (field->type != FIELD_END && field->type != FIELD_EOF) {
+    return syntax_error(&parser->reader, "Trailing data");
+  }
+  return nsd_ok;
+}
+
+static nsd_retcode_t
+parse_directive(parser_t *parser, field_t *field)
+{
+  nsd_retcode_t ret;
+
+  if (is_field(field, "$ORIGIN")) {
+    uint8_t origin[DNAME_MAX_LENGTH];
+    int origin_len;
+    if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+      return ret;
+    } else if ((origin_len = parse_name(parser, field, origin)) == 0) {
+      return syntax_error(&parser->reader, "Invalid origin");
+    }
+    memcpy(parser->origin, origin, (size_t)origin_len);
+    parser->origin_len = origin_len;
+  } else if (is_field(field, "$TTL")) {
+    if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+      return ret;
+    } else if (!parse_ttl(field, &parser->ttl)) {
+      return syntax_error(&parser->reader, "Invalid TTL");
+    }
+    parser->has_ttl = true;
+  } else if (is_field(field, "$INCLUDE")) {
+    return syntax_error(&parser->reader, "$INCLUDE is not supported");
+  } else {
+    return syntax_error(&parser->reader, "Unknown directive");
+  }
+
+  return expect_end(parser, field);
+}
+
+static nsd_retcode_t
+parse_owner(parser_t *parser, const field_t *field)
+{
+  nsd_retcode_t ret;
+  uint8_t owner[DNAME_MAX_LENGTH];
+  uint8_t key_len;
+  int owner_len;
+
+  if ((owner_len = parse_name(parser, field, owner)) == 0) {
+    return syntax_error(&parser->reader, "Invalid owner");
+  }
+
+  /* records are usually grouped by owner */
+  if (owner_len == parser->owner_len &&
+      memcmp(owner, parser->owner, (size_t)owner_len) == 0)
+  {
+    return nsd_ok;
+  }
+
+  if ((key_len = nsd_make_tree_key(parser->tree, parser->key, owner)) == 0) {
+    return syntax_error(&parser->reader, "Invalid owner");
+  }
+  /* zones are usually sorted, insert from the path of the previous owner */
+  if ((ret = nsd_make_path_from(
+         parser->tree, &parser->path, parser->key, key_len)) != nsd_ok)
+  {
+    parser->reader.stats->error = "Cannot insert owner";
+    return ret;
+  }
+
+  memcpy(parser->owner, owner, (size_t)owner_len);
+  parser->owner_len = owner_len;
+  parser->leaf = nsd_leaf_raw(
+    *parser->path.levels[parser->path.height - 1].noderef);
+  return nsd_ok;
+}
+
+/* <domain-name> [<TTL>] [<class>] <type> <RDATA>, TTL and class may be
+   specified in any order, owner may be omitted */
+static nsd_retcode_t
+parse_record(parser_t *parser, field_t *field)
+{
+  nsd_retcode_t ret;
+  nsd_record_t record;
+  bool has_ttl = false, has_class = false;
+
+  if (!field->blank) {
+    if ((ret = parse_owner(parser, field)) != nsd_ok) {
+      return ret;
+    } else if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+      return ret;
+    }
+  } else if (parser->owner_len == 0) {
+    return syntax_error(&parser->reader, "Missing owner");
+  }
+
+  record.owner = parser->leaf;
+  record.class = parser->class;
+  for (int cnt = 0; cnt < 2 && field->type == FIELD_STRING; cnt++) {
+    if (!has_ttl && field->len != 0 &&
+        field->data[0] >= '0' && field->data[0] <= '9')
+    {
+      if (!parse_ttl(field, &record.ttl)) {
+        return syntax_error(&parser->reader, "Invalid TTL");
+      }
+      has_ttl = true;
+    } else if (!has_class && parse_class(field, &record.class)) {
+      has_class = true;
+    } else {
+      break;
+    }
+    if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+      return ret;
+    }
+  }
+
+  if (!parse_type(field, &record.type)) {
+    return syntax_error(&parser->reader, field->type == FIELD_STRING
+      ? "Unknown type" : "Missing type");
+  }
+
+  /* RFC 2308 section 4, otherwise RFC 1035 section 5.1 */
+  if (has_ttl) {
+    parser->last_ttl = record.ttl;
+    parser->has_last_ttl = true;
+  } else if (parser->has_ttl) {
+    record.ttl = parser->ttl;
+  } else if (parser->has_last_ttl) {
+    record.ttl = parser->last_ttl;
+  } else {
+    return syntax_error(&parser->reader, "Missing TTL");
+  }
+  parser->class = record.class;
+
+  record.rdata_fields = 0;
+  for (;;) {
+    if ((ret = next_field(&parser->reader, field)) != nsd_ok) {
+      return ret;
+    } else if (field->type == FIELD_END || field->type == FIELD_EOF) {
+      break;
+    }
+    record.rdata_fields++;
+  }
+
+  parser->reader.stats->records++;
+  if (parser->options != NULL && parser->options->record != NULL) {
+    ret = parser->options->record(parser->options->arg, &record);
+    if (ret != nsd_ok) {
+      parser->reader.stats->error = "Record rejected";
+      return ret;
+    }
+  }
+
+  return nsd_ok;
+}
+
+nsd_retcode_t
+nsd_load_zone(
+  nsd_tree_t *tree,
+  const char *file,
+  const nsd_zone_options_t *options,
+  nsd_zone_stats_t *stats)
+{
+  nsd_retcode_t ret = nsd_ok;
+  nsd_zone_stats_t dummy;
+  parser_t *parser;
+  field_t field;
+
+  assert(tree != NULL);
+  assert(file != NULL);
+
+  if (stats == NULL) {
+    stats = &dummy;
+  }
+  memset(stats, 0, sizeof(*stats));
+
+  /* path is large, do not allocate on the stack */
+  if ((parser = calloc(1, sizeof(*parser))) == NULL ||
+      (parser->reader.buffer = malloc(NSD_ZONE_BUFFER_SIZE)) == NULL)
+  {
+    free(parser);
+    stats->error = "Out of memory";
+    return nsd_no_memory;
+  }
+
+  parser->tree = tree;
+  parser->options = options;
+  parser->class = 1; /* IN */
+  parser->reader.start = true;
+  parser->reader.stats = stats;
+  if (options != NULL && options->origin != NULL) {
+    parser->origin_len = dname_parse(
+      parser->origin, options->origin, strlen(options->origin));
+    if (parser->origin_len < 0) {
+      stats->error = "Invalid origin";
+      ret = nsd_bad_parameter;
+      goto out;
+    }
+  }
+
+  if ((parser->reader.fd = open(file, O_RDONLY)) == -1) {
+    stats->error = "Cannot open file";
+    ret = nsd_io_error;
+    goto out;
+  }
+
+  for (;;) {
+    if ((ret = next_field(&parser->reader, &field)) != nsd_ok) {
+      break;
+    } else if (field.type == FIELD_EOF) {
+      break;
+    } else if (field.type == FIELD_END) {
+      continue;
+    } else if (!field.blank && field.type == FIELD_STRING &&
+               field.len != 0 && field.data[0] == '$')
+    {
+      ret = parse_directive(parser, &field);
+    } else {
+      ret = parse_record(parser, &field);
+    }
+    if (ret != nsd_ok) {
+      break;
+    }
+  }
+
+  close(parser->reader.fd);
+out:
+  free(parser->reader.buffer);
+  free(parser);
+  return ret;
+}
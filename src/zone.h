@@ -0,0 +1,85 @@
+/*
+ * zone.h -- load domain names from zone files into a tree
+ *
+ * Copyright (c) 2020, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+#ifndef NSD_ZONE_H
+#define NSD_ZONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tree.h"
+
+/* Zone files (RFC 1035 section 5) are read in fixed size chunks and owner
+ * names are inserted as soon as they are parsed, memory usage is therefore
+ * independent of the size of the file. $ORIGIN, $TTL (RFC 2308), relative
+ * names, "@", parentheses, comments, quoted strings and escapes are
+ * supported. $INCLUDE is not. Types and classes are parsed, RDATA is split
+ * into fields, but not interpreted.
+ */
+#define NSD_ZONE_BUFFER_SIZE (1024 * 1024)
+#define NSD_ZONE_MAX_FIELD (65535) /**< Maximum length of a single field */
+
+typedef struct nsd_record nsd_record_t;
+struct nsd_record {
+  nsd_leaf_t *owner; /**< Leaf for owner name */
+  uint32_t ttl;
+  uint16_t type;
+  uint16_t class;
+  size_t rdata_fields; /**< Number of fields in RDATA */
+};
+
+typedef struct nsd_zone_options nsd_zone_options_t;
+struct nsd_zone_options {
+  /** Origin in presentation format, required for relative names if the
+      zone does not specify $ORIGIN (optional) */
+  const char *origin;
+  /** Called for every record, loading stops if nsd_ok is not returned
+      (optional), must not modify the tree as owners are inserted from the
+      path of the previous owner */
+  nsd_retcode_t (*record)(void *arg, const nsd_record_t *record);
+  void *arg;
+};
+
+typedef struct nsd_zone_stats nsd_zone_stats_t;
+struct nsd_zone_stats {
+  size_t records;
+  size_t lines;
+  size_t octets; /**< Number of octets read */
+  const char *error; /**< Description of error, NULL on success */
+  size_t line; /**< Line on which the entry with the error starts */
+};
+
+/**
+ * @brief Load owner names of all records in zone file into tree
+ *
+ * @param[in]   tree     Tree
+ * @param[in]   file     Name of zone file
+ * @param[in]   options  Options (optional)
+ * @param[out]  stats    Statistics, line of error if loading fails
+ *                       (optional)
+ *
+ * @returns @nsd_retcode_t indicating success or failure
+ *
+ * @retval @nsd_ok
+ *   Zone loaded
+ * @retval @nsd_bad_parameter
+ *   Syntax error, names parsed before the error remain in the tree
+ * @retval @nsd_no_memory
+ *   Out of memory
+ * @retval @nsd_io_error
+ *   File cannot be read, @errno is set
+ */
+nsd_retcode_t
+nsd_load_zone(
+  nsd_tree_t *tree,
+  const char *file,
+  const nsd_zone_options_t *options,
+  nsd_zone_stats_t *stats)
+__attribute__((nonnull(1,2)));
+
+#endif /* NSD_ZONE_H */